@@ -143,7 +143,7 @@ $(FIRM_BUILD_DIR):
 #######################################
 
 # list of common source files
-SOURCES = main.c system_stm32g4xx.c system.c interrupts.c can.c error.c led.c dfu.c utils.c usb_ctrlreq.c usb_ioreq.c usb_core.c usb_lowlevel.c usb_desc.c 
+SOURCES = main.c system_stm32g4xx.c system.c interrupts.c can.c error.c led.c dfu.c utils.c hexcodec.c cyclic.c isotp.c responder.c idtable.c reduce.c busload.c idstats.c profiler.c latency.c bufstats.c usb_ctrlreq.c usb_ioreq.c usb_core.c usb_lowlevel.c usb_desc.c 
 
 # list of user program objects
 OBJECTS = $(addprefix $(BUILD_DIR)/,$(notdir $(SOURCES:.c=.o)))
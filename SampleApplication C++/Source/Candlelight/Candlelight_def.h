@@ -37,11 +37,21 @@ typedef enum // transferred as 8 bit
 
     // ----------- ELM commands added by ElmSoft -----------
     ELM_ReqGetBoardInfo = 20,  // kBoardInfo: get name about target board and processor
-    ELM_ReqSetFilter,          // kFilter: set up to 8 acceptance mask filters
+    ELM_ReqSetFilter,          // kFilter: set up to 36 mask, range or dual ID filters for acceptance or rejection
     ELM_ReqGetLastError,       // uint8_t: get the eFeedback error that has stalled the SETUP request of the last command
-    ELM_ReqSetBusLoadReport,   // uint8_t: enable busload report in percent to be sent in a user defined interval
+    ELM_ReqSetBusLoadReport,   // uint8_t[2]: enable busload report to be sent in a user defined interval, optional averaging window
     ELM_ReqSetPinStatus,       // kPinStatus: set, reset, enable, disable,... processor pins
     ELM_ReqGetPinStatus,       // Receive: SETUP.wValue = ePinID, Send: ePinStatus in 2 data bytes
+    ELM_ReqSetBatchDeadline,   // uint32_t: maximum time in s that messages are held back to be sent together (ELM_DevFlagBatchMessages)
+    ELM_ReqSetCyclic,          // kCyclic + data bytes: set or remove a cyclic message that the firmware sends periodically
+    ELM_ReqSetIsoTp,           // kIsoTp: open or close the ISO-TP channel (ISO 15765-2) that segments and reassembles PDUs in the firmware
+    ELM_ReqSetResponder,       // kResponder + data bytes: set or remove a response that the firmware sends automatically when a request is received
+    ELM_ReqGetResponderStats,  // kResponderStats: get the count of automatic responses and their latency
+    ELM_ReqSetReduction,       // kReduction: set or remove a rule that reduces the periodic Rx packets sent to the host
+    ELM_ReqSetIdStatistics,    // uint8_t: enable or disable the statistics of each CAN ID on the bus
+    ELM_ReqGetIdStatistics,    // Receive: SETUP.wValue = first table slot, Send: kIdStatisticsPage
+    ELM_ReqSetStatistics,      // uint8_t: eStatisticsOperation, enable, disable or reset the firmware statistics
+    ELM_ReqGetStatistics,      // Receive: SETUP.wValue = eStatisticsType + index, Send: depends on eStatisticsType
 } eUsbRequest;
 
 // These flags are used to enable/disable a mode with GS_ReqSetDeviceMode 
@@ -92,6 +102,17 @@ typedef enum // transferred as 32 bit
     // Do not send an echo for the successfully sent CAN packets (by default this is enabled in the Candlelight firmware)
     // The Tx event packet is sent in the moment when the ACK was recived. You can turn this off to reduce USB traffic.
     ELM_DevFlagDisableTxEcho          = 0x08000, 
+    // Pack multiple messages into one USB IN transfer (requires ELM_DevFlagProtocolElmue).
+    // The host must split the received data into messages using kHeader.size.
+    // Messages are held back at maximum for the time that has been set with ELM_ReqSetBatchDeadline (default 0 = do not wait).
+    ELM_DevFlagBatchMessages          = 0x10000, 
+    // Send 64 bit timestamps which never roll over (requires ELM_DevFlagProtocolElmue, implies GS_DevFlagTimestamp).
+    // The upper 32 bit are appended behind the 32 bit timestamp. See kRxFrameElmue, kTxEchoElmue, kErrorElmue.
+    ELM_DevFlagTimestamp64            = 0x20000, 
+    // Send the waiting Tx frames in CAN bus priority order (lowest CAN ID first) instead of FIFO order.
+    // Frames with the same CAN ID are always sent in the order in which the host has sent them.
+    // This avoids that a high priority frame must wait behind up to 67 low priority frames.
+    ELM_DevFlagTxPriority             = 0x40000, 
 } eDeviceFlags;
 
 // ==============================================================================
@@ -483,19 +504,311 @@ typedef enum // 8 bit
     FIL_ClearAll = 0,    // remove all filters
     FIL_AcceptMask11bit, // add a new acceptance mask filter for 11 bit CAN IDs
     FIL_AcceptMask29bit, // add a new acceptance mask filter for 29 bit CAN IDs
+    FIL_SetElement,      // set the filter element Index with Type
+    FIL_RemoveElement,   // disable the filter element Index
 //  FIL_xxxx             // future expansions are easily possible
 } eFilterOperation;
 
+// The type of a filter element
+// The values 0...2 are identical with FDCAN_FILTER_RANGE, FDCAN_FILTER_DUAL, FDCAN_FILTER_MASK
+typedef enum // 8 bit
+{
+    FLT_Range  = 0,    // accept CAN IDs from ID1 to ID2
+    FLT_Dual   = 1,    // accept the two CAN IDs ID1 and ID2
+    FLT_Mask   = 2,    // classic filter: ID1 = filter, ID2 = mask
+    FLT_Reject = 0x80, // flag: packets that match the filter are not sent to the host
+} eFilterType;
+
 // ELM_ReqSetFilter
+// The filter elements 0...27 are for 11 bit CAN IDs, the elements 28...35 for 29 bit CAN IDs.
+// If a packet matches multiple filters, the filter with the lowest index decides.
 typedef struct
 {
     uint8_t  Operation; // eFilterOperation
-    uint32_t Filter;    // the filter (e.g. 0x7E0), ignored for Operation FIL_ClearAll
-    uint32_t Mask;      // the mask   (e.g. 0x7FF), ignored for Operation FIL_ClearAll
-    uint32_t Reserved1;
-    uint32_t Reserved2;
+    uint32_t Filter;    // the filter (e.g. 0x7E0) or ID1 for FIL_SetElement, ignored for FIL_ClearAll, FIL_RemoveElement
+    uint32_t Mask;      // the mask   (e.g. 0x7FF) or ID2 for FIL_SetElement, ignored for FIL_ClearAll, FIL_RemoveElement
+    uint32_t Index;     // the filter element 0...35 for FIL_SetElement, FIL_RemoveElement
+    uint32_t Type;      // eFilterType for FIL_SetElement
 } __packed __aligned(1) kFilter;
 
+// -----------------------------------------
+
+// ELM_ReqSetCyclic
+// The firmware sends up to 32 cyclic messages with the precise 1 s timer without any involvement of the host (see cyclic.c).
+// The data bytes (0...64) are appended to the struct. The count of data bytes is calculated as: SETUP.wLength - sizeof(kCyclic)
+// For remote frames the host can write the DLC value into the first data byte, otherwise DLC = 0 is sent.
+// The host does not receive Tx echoes for cyclic messages. The table is cleared when the adapter is closed.
+typedef struct
+{
+    uint8_t  Index;         // 0...31, or 0xFF with Period = 0 to remove all cyclic messages
+    uint8_t  Flags;         // eFrameFlags (FRM_FDF, FRM_BRS)
+    uint8_t  CounterByte;   // 0 = no counter,  1...64 = the data byte that is incremented before each message
+    uint8_t  ChecksumByte;  // 0 = no checksum, 1...64 = the data byte that receives the 8 bit sum of all other data bytes
+    uint32_t CanID;         // CAN ID + eCanIdFlags
+    uint32_t Period;        // interval in s (minimum 100 s), 0 = remove the cyclic message
+    uint32_t Phase;         // offset in s from the common time base of all cyclic messages (smaller than Period)
+    uint8_t  DataStart[0];  // data start
+} __packed __aligned(1) kCyclic;
+
+// -----------------------------------------
+
+typedef enum // 8 bit
+{
+    ISO_Close = 0,  // close the ISO-TP channel, a PDU that is currently sent or received is aborted
+    ISO_Open,       // open the ISO-TP channel with the parameters in kIsoTp
+//  ISO_xxxx        // future expansions are easily possible
+} eIsoTpOperation;
+
+typedef enum // 8 bit
+{
+    ISO_Extended = 0x01, // Tx ID and Rx ID are 29 bit
+    ISO_FD       = 0x02, // send CAN FD frames with up to 64 bytes
+    ISO_BRS      = 0x04, // send CAN FD frames with baudrate switch
+    ISO_Padding  = 0x08, // pad all Tx frames to 8 bytes with PadByte (CAN FD frames are always padded to the next valid DLC)
+} eIsoTpFlags;
+
+typedef enum // 8 bit
+{
+    ISO_TxDone = 1,  // the Tx PDU has been sent completely
+    ISO_TxTimeout,   // the peer did not send a Flow Control frame within one second
+    ISO_TxOverflow,  // the peer has answered with Flow Control "Overflow" (the PDU is too long for the peer)
+    ISO_TxRejected,  // the host has sent PDU data while a PDU was sent or received, or more data than announced
+    ISO_RxTimeout,   // the peer did not send the next Consecutive Frame within one second
+    ISO_RxSequence,  // a Consecutive Frame with a wrong sequence number has been received
+    ISO_RxOverflow,  // the peer has sent a First Frame for a PDU that is too long or while the channel was busy
+    ISO_TxInvalidFS, // the peer has sent a Flow Control frame with an invalid Flow Status, the Tx PDU has been aborted
+} eIsoTpEvent;
+
+// ELM_ReqSetIsoTp
+// The firmware segments a Tx PDU of up to 4095 bytes into Single, First and Consecutive Frames and handles the Flow Control.
+// Received PDUs are reassembled and sent to the host with MSG_IsoTpData, the Flow Control for them is sent by the firmware.
+// The PDUs are exchanged with MSG_IsoTpData in both directions, events are reported with MSG_IsoTpEvent.
+// The channel is closed when the adapter is closed. Requires ELM_DevFlagProtocolElmue.
+typedef struct
+{
+    uint8_t  Operation; // eIsoTpOperation
+    uint8_t  Flags;     // eIsoTpFlags
+    uint8_t  BlockSize; // block size sent in the Flow Control frames (0 = the peer sends all Consecutive Frames without waiting)
+    uint8_t  STmin;     // minimum separation time sent in the Flow Control frames (0x00...0x7F ms, 0xF1...0xF9 = 100...900 s)
+    uint8_t  PadByte;   // the byte used for padding (typically 0x55, 0xAA or 0xCC)
+    uint32_t TxID;      // the CAN ID of the Tx frames (e.g. 0x7E0)
+    uint32_t RxID;      // the CAN ID of the Rx frames (e.g. 0x7E8)
+} __packed __aligned(1) kIsoTp;
+
+// -----------------------------------------
+
+typedef enum // 8 bit
+{
+    RESP_ClearAll = 0,  // remove all automatic responses and reset the statistics
+    RESP_Remove,        // remove the response with Index
+    RESP_Set,           // add or replace the response with Index
+//  RESP_xxxx           // future expansions are easily possible
+} eResponderOperation;
+
+// ELM_ReqSetResponder
+// The firmware answers up to 8 requests within approx 10 s without any involvement of the host (see responder.c).
+// A received frame (accepted or rejected by the filters) is a request if (CanID & MatchMask) == (MatchID & MatchMask)
+// and the first PatternLength data bytes match the Pattern in all bits that are set in PatternMask.
+// The response data bytes (0...8) are appended to the struct. The count is calculated as: SETUP.wLength - sizeof(kResponder)
+// CopyCount bytes from the request (starting at CopySource) are copied into the response (starting at CopyTarget).
+// The request is passed to the host as usual, the response does not produce a Tx echo. The table is cleared when the adapter is closed.
+typedef struct
+{
+    uint8_t  Operation;       // eResponderOperation
+    uint8_t  Index;           // 0...7, the lowest matching index is sent
+    uint8_t  Flags;           // eFrameFlags of the response (FRM_FDF, FRM_BRS)
+    uint8_t  PatternLength;   // 0...8 data bytes to compare, 0 = compare only the CAN ID
+    uint8_t  CopySource;      // first data byte in the request to be copied (0 based)
+    uint8_t  CopyTarget;      // position in the response where the bytes are copied to (0 based)
+    uint8_t  CopyCount;       // 0 = nothing is copied
+    uint32_t MatchID;         // CAN ID of the request + CAN_ID_29Bit
+    uint32_t MatchMask;       // only the bits that are set in the mask are compared
+    uint32_t ResponseID;      // CAN ID of the response + eCanIdFlags
+    uint8_t  Pattern[8];
+    uint8_t  PatternMask[8];
+    uint8_t  DataStart[0];    // data start of the response
+} __packed __aligned(1) kResponder;
+
+// ELM_ReqGetResponderStats
+typedef struct
+{
+    uint32_t Count;    // count of responses sent
+    uint32_t Dropped;  // count of responses not sent because the Tx FIFO was full
+    uint32_t LastUs;   // latency of the last response in s (from the start of frame of the request)
+    uint32_t MaxUs;    // maximum latency in s since the last RESP_ClearAll
+} __packed __aligned(4) kResponderStats;
+
+// -----------------------------------------
+
+typedef enum // 8 bit
+{
+    REDU_ClearAll = 0,  // remove all reduction rules
+    REDU_Remove,        // remove the rule with Index
+    REDU_Set,           // add or replace the rule with Index
+//  REDU_xxxx           // future expansions are easily possible
+} eReductionOperation;
+
+typedef enum // 8 bit
+{
+    RED_Off = 0,   // send all packets of the IDs (the rule excludes IDs from the following rules)
+    RED_OnChange,  // send a packet only if DLC or data have changed
+    RED_Interval,  // send a packet at most every Param ms
+    RED_EveryNth,  // send only every Param'th packet
+} eReduceMode;
+
+// ELM_ReqSetReduction
+// On a typical vehicle bus most packets are periodic with unchanged data. Up to 8 rules reduce the Rx packets sent to the host (see reduce.c).
+// A rule applies to all IDs where (CanID & Mask) == (RuleID & Mask). The first packet of each ID is always sent.
+// The state is stored for up to 63 different IDs. Packets of further IDs are sent without reduction. The rules are removed when the adapter is closed.
+typedef struct
+{
+    uint8_t  Operation; // eReductionOperation
+    uint8_t  Index;     // 0...7, the lowest matching index is applied
+    uint8_t  Mode;      // eReduceMode
+    uint8_t  Reserved;
+    uint32_t CanID;     // CAN ID + CAN_ID_29Bit
+    uint32_t Mask;      // only the bits that are set in the mask are compared (0 = all IDs)
+    uint32_t Param;     // RED_OnChange: send an unchanged packet after Param ms (0 = never), RED_Interval: ms, RED_EveryNth: N
+} __packed __aligned(1) kReduction;
+
+// -----------------------------------------
+
+// ELM_ReqSetIdStatistics: uint8_t 1 = enable and reset, 0 = disable the statistics of each CAN ID (see idstats.c)
+// ELM_ReqGetIdStatistics: SETUP.wValue = first table slot, returns kIdStatisticsPage with the IDs at slots >= wValue
+// The host starts with slot 0 and continues with the Slot of the last entry + 1 until EntryCount = 0.
+// All received packets are counted, also those rejected by the filters. The table has space for 64 different IDs.
+// The statistics are cleared when the adapter is closed.
+typedef struct
+{
+    uint16_t Slot;          // table slot of this ID
+    uint8_t  DLC;           // DLC of the last packet
+    uint8_t  Reserved;
+    uint32_t CanID;         // CAN ID + CAN_ID_29Bit
+    uint32_t Count;         // count of packets received
+    uint32_t LastTimestamp; // timestamp of the last packet in s
+    uint32_t MinPeriod;     // shortest period between two packets in s (valid if Count >= 2)
+    uint32_t MaxPeriod;     // longest  period between two packets in s (valid if Count >= 2)
+    uint32_t AvgPeriod;     // average  period over approx. the last 8 packets in s (valid if Count >= 2)
+} __packed __aligned(1) kIdStatistics;
+
+#define ID_STATS_PER_PAGE   8
+
+typedef struct
+{
+    uint8_t       EntryCount; // count of valid entries, 0 = there are no more IDs
+    uint8_t       Reserved;
+    uint16_t      IdCount;    // count of IDs in the table
+    uint32_t      Overflow;   // count of packets that have not been counted because the table was full
+    kIdStatistics Entries[ID_STATS_PER_PAGE];
+} __packed __aligned(1) kIdStatisticsPage;
+
+// -----------------------------------------
+
+typedef enum // 8 bit
+{
+    STATOP_ProfilerOff = 0, // disable the profiler
+    STATOP_ProfilerOn,      // reset and enable the profiler
+    STATOP_LatencyReset,    // clear the latency histogram
+    STATOP_QueueReset,      // clear the drop counters and peak levels of the queues
+    STATOP_QueueReport,     // second byte = interval of MSG_QueueStats in 100 ms steps (0 = off), requires ELM_DevFlagProtocolElmue
+//  STATOP_xxxx             // future expansions are easily possible
+} eStatisticsOperation;
+
+// The high byte of SETUP.wValue of ELM_ReqGetStatistics
+typedef enum // 8 bit
+{
+    STAT_Profiler = 0,      // low byte = eProfStage, returns kProfilerStats
+    STAT_Latency,           // low byte = 0, returns kLatencyStats
+    STAT_Queues,            // low byte = 0, returns kQueueStats
+//  STAT_xxxx               // future expansions are easily possible
+} eStatisticsType;
+
+// The stages of the profiler
+typedef enum // 8 bit
+{
+    PRF_Loop = 0,  // one complete pass of the main loop
+    PRF_Led,       // LED processing
+    PRF_Cyclic,    // cyclic messages
+    PRF_IsoTp,     // ISO-TP channel
+    PRF_Buffer,    // buffer processing
+    PRF_Control,   // control processing, error reports
+    PRF_Can,       // CAN Rx / Tx processing
+    PRF_UsbIsr,    // USB interrupt
+    PRF_CanIsr,    // FDCAN interrupt
+    PRF_StageCount,
+} eProfStage;
+
+// The queues between CAN bus and USB
+typedef enum // 8 bit
+{
+    QUE_CanTx = 0, // frames in the CAN Tx buffer
+    QUE_TxFifo,    // frames in the 3 hardware Tx buffers
+    QUE_RxFifo,    // frames in a hardware Rx FIFO when the interrupt handler reads it
+    QUE_RxRing,    // frames buffered by the CAN interrupt handler
+    QUE_Host,      // bytes in the USB IN buffer
+    QUE_UsbRx,     // unused in Candlelight (size = 0)
+    QUE_Count,
+} eQueue;
+
+// The reasons why a frame or a message is lost
+typedef enum // 8 bit
+{
+    DRP_CanTxFull = 0, // a Tx frame was discarded because the CAN Tx buffer was full
+    DRP_CanTxFail,     // a Tx frame was invalid or not allowed (silent mode, bus off, FD frame without data baudrate)
+    DRP_CanTxTimeout,  // a Tx frame was discarded because it was not acknowledged
+    DRP_TxEventLost,   // a Tx event was lost, the host gets no echo for the frame
+    DRP_RxFifoLost,    // a hardware Rx FIFO has lost frames (counts at least one frame)
+    DRP_RxRingFull,    // an Rx frame was discarded because the Rx buffer of the interrupt handler was full
+    DRP_HostFull,      // a message to the host was discarded because the USB IN buffer was full
+    DRP_Count,
+} eDropReason;
+
+// ELM_ReqSetStatistics: uint8_t eStatisticsOperation (+ uint8_t interval for STATOP_QueueReport)
+// ELM_ReqGetStatistics: SETUP.wValue = (STAT_Profiler << 8) + eProfStage returns the execution time of one stage in CPU cycles (see profiler.c)
+// The stages of the main loop include the time of the interrupts that occurred while they were running.
+// Histogram bin N counts the execution times < 64 * 4^N cycles, the last bin counts all longer times.
+// The profiler is disabled after power-on because it costs approx. 30 CPU cycles per measurement.
+typedef struct
+{
+    uint8_t  Stage;       // eProfStage
+    uint8_t  StageCount;  // count of stages, the host requests the stages 0 ... StageCount - 1
+    uint8_t  Enabled;     // 1 = the profiler is running
+    uint8_t  Reserved;
+    uint32_t CpuClock;    // CPU clock in Hz to convert the cycles into time
+    uint32_t Count;       // count of measurements
+    uint32_t MinCycles;   // shortest execution time
+    uint32_t AvgCycles;   // average  execution time
+    uint32_t MaxCycles;   // longest  execution time
+    uint32_t Histogram[8];
+} __packed __aligned(1) kProfilerStats;
+
+// ELM_ReqGetStatistics: SETUP.wValue = (STAT_Latency << 8) returns the latency of the Rx packets (see latency.c)
+// The latency is measured from the start of frame on CAN bus until the USB IN transfer to the host has completed.
+// Histogram bin 0 counts latencies < 16 s, then each octave has 2 bins: < 24 s, < 32 s, < 48 s, < 64 s, ... bin 31 counts all >= 524 ms.
+// The percentiles are interpolated inside the bins. All values are in s.
+typedef struct
+{
+    uint32_t Count;       // count of packets measured
+    uint32_t Merged;      // count of packets with an interpolated latency because 32 tags were already waiting for the host
+    uint32_t Min;
+    uint32_t P50;         // median
+    uint32_t P90;
+    uint32_t P99;
+    uint32_t P999;        // 99.9 %
+    uint32_t Max;
+    uint32_t Histogram[32];
+} __packed __aligned(1) kLatencyStats;
+
+// ELM_ReqGetStatistics: SETUP.wValue = (STAT_Queues << 8) returns the drop counters and the peak fill levels of the queues (see bufstats.c)
+// The peak levels of QUE_Host are in bytes, all others in frames. A size of 0 means that the queue does not exist.
+// The drop counters and peak levels are cleared with STATOP_QueueReset, not when the adapter is closed.
+typedef struct
+{
+    uint32_t Drops[7];    // count of lost frames or messages for each eDropReason
+    uint32_t Peaks[6];    // highest fill level of each eQueue
+    uint32_t Sizes[6];    // capacity of each eQueue
+} __packed __aligned(1) kQueueStats;
+
 
 // -----------------------------------------
 
@@ -561,7 +874,12 @@ typedef enum // 8 bit
     MSG_RxFrame,      // the message contains a received CAN frame from CAN bus (kRxFrameElmue)
     MSG_Error,        // the message contains multiple error flags (kErrorElmue, same format as legacy protocol, see buf_store_error())
     MSG_String,       // the message contains an ASCII string to be displayed to the user (kStringElmue)
-    MSG_Busload,      // the message contains one byte which is the bus load in percent (kBusloadElmue)
+    MSG_Busload,      // the message contains the bus load in percent and in ppm (kBusloadElmue)
+    // received from host and sent to host
+    MSG_IsoTpData,    // the message contains a chunk of an ISO-TP PDU (kIsoTpDataElmue)
+    // sent to host
+    MSG_IsoTpEvent,   // the message contains one byte which is an ISO-TP event (kIsoTpEventElmue)
+    MSG_QueueStats,   // the message contains the drop counters and the peak levels of the queues (kQueueStatsElmue)
 //  MSG_xxxx          // future expansions are easily possible
 } eMessageType;
 
@@ -574,6 +892,8 @@ typedef struct
 
 // this struct is received on endpoint 02 (OUT) from the host
 // A DLC byte is not required. The count of transferred data bytes is calculated as: header.size - sizeof(kTxFrameElmue)
+// The host can send multiple complete kTxFrameElmue back-to-back in one USB transfer of up to 256 bytes.
+// If such a transfer is shorter than 256 bytes and a multiple of 64 bytes it must be terminated with a zero length packet.
 // For remote frames the host can write the DLC value into the first data byte, otherwise DLC = 0 is sent.
 // see buf_process_can_bus()
 typedef struct 
@@ -587,7 +907,7 @@ typedef struct
 // this struct is transmitted on endpoint 81 (IN) to the host
 // A DLC byte is not required. The count of transferred data bytes is calculated as: header.size - sizeof(kRxFrameElmue)
 // For remote frames the DLC from the Rx packet is transmitted in the first data byte to the host.
-// if timestamps are not used subtract 4 additional bytes
+// if timestamps are not used subtract 4 additional bytes, with ELM_DevFlagTimestamp64 the data starts 4 bytes later
 // see buf_store_rx_packet()
 typedef struct 
 {
@@ -597,6 +917,7 @@ typedef struct
     uint32_t timestamp;   // timestamp with 1 s precision, only sent to host if GS_DevFlagTimestamp has been set, roll over detection required!
 } __packed __aligned(1) kRxFrameElmue;
 
+// with ELM_DevFlagTimestamp64 the upper 32 bit of the timestamp follow behind this struct
 // see buf_store_tx_echo()
 typedef struct 
 {
@@ -605,6 +926,7 @@ typedef struct
     uint32_t timestamp;   // timestamp with 1 s precision, only sent to host if GS_DevFlagTimestamp has been set, roll over detection required!
 } __packed __aligned(1) kTxEchoElmue;
 
+// with ELM_DevFlagTimestamp64 the upper 32 bit of the timestamp follow behind this struct
 // see buf_store_error()
 typedef struct 
 {
@@ -625,8 +947,35 @@ typedef struct
 typedef struct 
 {
     kHeader  header;      // MSG_Busload
-    uint8_t  bus_load;    // current bus load in percent
+    uint8_t  bus_load;    // current bus load in percent (0...99)
+    uint32_t bus_load_ppm; // current bus load in ppm (1000000 = 100%), averaged over the window of ELM_ReqSetBusLoadReport
 } __packed __aligned(1) kBusloadElmue;
 
+// A PDU is transferred in chunks of up to 64 data bytes. The count of data bytes is calculated as: header.size - sizeof(kIsoTpDataElmue)
+// The first chunk contains the length of the entire PDU, the following chunks have length = 0.
+// The host sends the chunks on endpoint 02 (OUT) in the same way as kTxFrameElmue, the PDU is sent when all bytes have arrived.
+// see buf_process_isotp_data() and buf_store_isotp_data()
+typedef struct 
+{
+    kHeader  header;        // MSG_IsoTpData
+    uint16_t length;        // first chunk: length of the PDU (1...4095), following chunks: 0
+    uint8_t  data_start[0]; // data start
+} __packed __aligned(1) kIsoTpDataElmue;
+
+// see control_report_isotp()
+typedef struct 
+{
+    kHeader  header;      // MSG_IsoTpEvent
+    uint8_t  event;       // eIsoTpEvent
+} __packed __aligned(1) kIsoTpEventElmue;
+
+// see control_report_queues(), enabled with STATOP_QueueReport
+typedef struct 
+{
+    kHeader  header;      // MSG_QueueStats
+    uint32_t drops[7];    // count of lost frames or messages for each eDropReason
+    uint16_t peaks[6];    // highest fill level of each eQueue
+} __packed __aligned(1) kQueueStatsElmue;
+
 #pragma pack(pop)
 
@@ -13,12 +13,19 @@
 #include "usb_class.h"
 #include "candlelight_def.h"
 #include "can.h"
+#include "txheap.h"
+#include "isotp.h"
+#include "latency.h"
+#include "bufstats.h"
 
-// If 3 Tx messages are in the Tx FIFO of the processor while 64 more Tx messages are in list_to_host, we have 67 messages waiting for an ACK.
+// If 3 Tx messages are in the Tx FIFO of the processor while 64 more Tx messages are in ring_to_can, we have 67 messages waiting for an ACK.
 // If now another adapter is opened and acknowledges them all we are flooded with 67 Tx events to be sent to the host.
 // So the host buffer should be larger than the CAN buffer to avoid error APP_UsbInOverflow.
-#define CAN_QUEUE_SIZE      64
-#define HOST_QUEUE_SIZE     70
+// The host ring stores messages with their real length: 65 legacy frames or up to 466 Tx echoes (12 byte) of the ElmSoft protocol.
+#define CAN_QUEUE_SIZE      64 // maximum 64 because of tx_sent_mask and TXHEAP_SIZE
+#define HOST_RING_SIZE      (70 * sizeof(kHostFrameLegacy)) // 5600 byte
+#define LEGACY_ECHO_SLOTS    8 // more than 3 frames in the Tx FIFO + 3 Tx events in the Tx Event FIFO
+#define LEGACY_ECHO_TIMEOUT 600 // ms, longer than CAN_TX_TIMEOUT in can.c
 
 extern eUserFlags     USER_Flags;
 USB_BufHandleTypeDef  USB_BufHandle = {0};
@@ -31,44 +38,73 @@ USB_BufHandleTypeDef  USB_BufHandle = {0};
 // not even an error message could be sent to the host.
 // So the adapter simply stopped responding and was dead.
 // Addionally due to another bug it could even crash when the buffer got full.
-kHostFrameObject  can_pool_buffer [CAN_QUEUE_SIZE];
-kHostFrameObject  host_pool_buffer[HOST_QUEUE_SIZE];
+kHostFrameLegacy  can_ring_buffer [CAN_QUEUE_SIZE];
+uint8_t __aligned(4) host_ring_buffer[HOST_RING_SIZE];
+
+uint32_t batch_deadline_us = 0; // set with ELM_ReqSetBatchDeadline
+uint32_t batch_length      = 0; // count of bytes that have already been packed into to_host_buf
+uint32_t batch_start_time  = 0; // timestamp when the first message was packed into to_host_buf
+bool     host_msg_in_use   = false; // the oldest message in ring_to_host is being transmitted directly from the ring
+uint32_t host_msg_taken    = 0; // free running count of messages that have been passed to a USB IN transfer (positions for latency.c)
+
+// ELM_DevFlagTxPriority: the frames in ring_to_can are sent in priority order, so they are not released in the order of the ring.
+kTxHeap  tx_heap;               // ring slots that wait for the CAN Tx FIFO, see txheap.h
+uint32_t tx_heap_pos  = 0;      // ring position up to which the frames have been inserted into tx_heap
+uint64_t tx_sent_mask = 0;      // one bit per ring slot: the frame has been sent, but the slot cannot be released yet
+
+// Legacy protocol: the echoes of the frames that are in the Tx FIFO. They are sent to the host when the Tx event arrives.
+// The MessageMarker of the frame is the index in legacy_echo.
+kHostFrameLegacy legacy_echo     [LEGACY_ECHO_SLOTS];
+uint32_t         legacy_echo_tick[LEGACY_ECHO_SLOTS]; // HAL_GetTick() when the frame was passed to the Tx FIFO
+uint32_t         legacy_echo_mask = 0; // one bit per slot of legacy_echo that waits for the Tx event
+uint32_t         legacy_echo_next = 0; // the next slot in legacy_echo
 
 void buf_process_host();
+void buf_process_host_batch();
 void buf_process_can_bus();
+void buf_process_isotp_data(kIsoTpDataElmue* packet);
+kHostFrameLegacy* buf_get_can_frame();
+void buf_release_can_frame();
 void buf_clear_buffers(bool clear_can, bool clear_host);
+void buf_commit_host_message(uint32_t rx_stamp);
+void buf_send_legacy_echo(kHostFrameLegacy* echo, uint32_t timestamp);
+void buf_flush_legacy_echoes(uint32_t tick_now);
+void buf_tag_latency(uint32_t rx_stamp);
+uint8_t buf_store_timestamp_high(uint8_t* dest, uint32_t timestamp);
 
 void buf_init()
 {
     buf_clear_buffers(true, true);
+    bufstats_set_size(QUE_CanTx, CAN_QUEUE_SIZE);
+    bufstats_set_size(QUE_Host,  HOST_RING_SIZE);
 }
 void buf_clear_can_buffer()
 {
     buf_clear_buffers(true, false);
 }
+// returns the count of frames in ring_to_can that have not yet been sent
+uint32_t buf_get_can_count()
+{
+    return ring_count(&USB_BufHandle.ring_to_can) - __builtin_popcountll(tx_sent_mask);
+}
 void buf_clear_buffers(bool clear_can, bool clear_host)
 {
+    // buf_clear_can_buffer() is also called from the USB interrupt (can_open) while the main loop may read ring_to_can.
+    // So the CAN ring is only initialized once, later it is cleared without modifying the tail of the consumer.
+    static bool init_done = false;
     if (clear_can)
     {
-        list_init(&USB_BufHandle.list_can_pool);
-        list_init(&USB_BufHandle.list_to_can);
-
-        // add the 64 entries to the pool ringbuffers
-        for (unsigned i=0; i < CAN_QUEUE_SIZE; i++)
-        {
-            list_add_tail(&can_pool_buffer[i].list, &USB_BufHandle.list_can_pool);
-        }
+        if (init_done) ring_clear(&USB_BufHandle.ring_to_can);
+        else           ring_init (&USB_BufHandle.ring_to_can, can_ring_buffer, CAN_QUEUE_SIZE);
     }
     if (clear_host)
     {
-        list_init(&USB_BufHandle.list_host_pool);
-        list_init(&USB_BufHandle.list_to_host);
-
-        for (unsigned i=0; i < HOST_QUEUE_SIZE; i++)
-        {
-            list_add_tail(&host_pool_buffer[i].list, &USB_BufHandle.list_host_pool);
-        }
+        msgring_init(&USB_BufHandle.ring_to_host, host_ring_buffer, HOST_RING_SIZE);
+        host_msg_in_use = false;
+        latency_clear_tags();
+        legacy_echo_mask = 0;
     }
+    init_done = true;
 }
 
 // This function is called approx 100 times in one millisecond from the main loop
@@ -76,36 +112,177 @@ void buf_process(uint32_t tick_now)
 {
     buf_process_host();
     buf_process_can_bus();
+    buf_flush_legacy_echoes(tick_now);
 
     // The APP_xxx errors are deleted after sending them to the host.
     // They must be refreshed here, so the green + blue LED stay ON permanently and show that there is a problem.
-    if (list_is_empty(&USB_BufHandle.list_can_pool))  error_assert(APP_CanTxOverflow, false);
-    if (list_is_empty(&USB_BufHandle.list_host_pool)) error_assert(APP_UsbInOverflow, false);
+    if (ring_is_full(&USB_BufHandle.ring_to_can))  error_assert(APP_CanTxOverflow, false);
+    if (msgring_find_space(&USB_BufHandle.ring_to_host, sizeof(kHostFrameLegacy)) < 0) error_assert(APP_UsbInOverflow, false);
 }
 
-// send a CAN packet to the host if list_to_host has data
+// send a CAN packet to the host if ring_to_host has data
 void buf_process_host()
 {
     if (USBD_IsTxBusy())
         return; // USB IN transfer to the host is still in progress
 
-    kHostFrameObject* frame_to_host = buf_get_frame_locked(&USB_BufHandle.list_to_host);
+    // The last message has been transmitted directly from ring_to_host and USBD_GS_DataIn() has completed.
+    // Only now the space can be given back to the ring, otherwise the producer could overwrite it during the transfer.
+    if (host_msg_in_use)
+    {
+        host_msg_in_use = false;
+        msgring_release(&USB_BufHandle.ring_to_host);
+    }
+
+    // If the host has turned off ELM_DevFlagBatchMessages while a batch was pending, the batch must be sent first.
+    if ((USER_Flags & USR_BatchIN) || batch_length > 0)
+    {
+        buf_process_host_batch();
+        return;
+    }
+
+    uint16_t len;
+    uint32_t rx_stamp;
+    uint8_t* frame_to_host = msgring_peek(&USB_BufHandle.ring_to_host, &len, &rx_stamp);
     if (!frame_to_host)
         return; // nothing to be sent
 
-    USBD_SendFrameToHost(&frame_to_host->frame);
+    // The message is not copied. It stays in the ring until the transfer has completed (see above).
+    host_msg_in_use = true;
+    host_msg_taken ++;
+    buf_tag_latency(rx_stamp);
+    latency_begin_transfer(host_msg_taken); // see latency.c
+    USBD_SendFrameToHost(frame_to_host, len);
+}
+
+// ELM_DevFlagBatchMessages: pack as many messages from ring_to_host into to_host_buf as fit into HOST_BATCH_SIZE.
+// All ElmSoft messages start with kHeader, so the host can split the transfer using kHeader.size.
+// The batch is sent when the next message does not fit anymore or when the first message has waited batch_deadline_us.
+// With the default deadline = 0 all messages that have been queued while the last transfer was running are sent at once.
+void buf_process_host_batch()
+{
+    while (USER_Flags & USR_BatchIN)
+    {
+        uint16_t size;
+        uint32_t rx_stamp;
+        uint8_t* frame_to_host = msgring_peek(&USB_BufHandle.ring_to_host, &size, &rx_stamp);
+        if (!frame_to_host)
+            break; // nothing more to be packed
 
-    // packet was sent --> give the frame back to the pool
-    list_add_tail_locked(&frame_to_host->list, &USB_BufHandle.list_host_pool);
+        if (batch_length + size > HOST_BATCH_SIZE)
+            break; // the batch is full -> the message stays in the ring for the next batch
+
+        if (batch_length == 0)
+            batch_start_time = system_get_timestamp();
+
+        memcpy(USB_BufHandle.to_host_buf + batch_length, frame_to_host, size);
+        batch_length += size;
+
+        // message was packed --> give the space back to the ring
+        msgring_release(&USB_BufHandle.ring_to_host);
+        host_msg_taken ++;
+        buf_tag_latency(rx_stamp);
+    }
+
+    if (batch_length == 0)
+        return;
+
+    // Wait for more messages until the batch is full or the deadline has elapsed.
+    // If batching has been turned off send the pending batch immediately.
+    bool batch_full = !msgring_is_empty(&USB_BufHandle.ring_to_host);
+    if (!batch_full && (USER_Flags & USR_BatchIN) && system_get_timestamp() - batch_start_time < batch_deadline_us)
+        return;
+
+    latency_begin_transfer(host_msg_taken); // see latency.c
+    USBD_SendBufferToHost(batch_length);
+    batch_length = 0;
 }
 
-// send a host packet to CAN bus if list_to_can has data
+// ELM_ReqSetBatchDeadline: the maximum time in s that messages are held back to be sent in one USB transfer.
+// 0 = do not wait, send all pending messages as soon as the IN endpoint is free.
+eFeedback buf_set_batch_deadline(uint32_t deadline_us)
+{
+    if (deadline_us > 10000) // 10 ms
+        return FBK_InvalidParameter;
+
+    batch_deadline_us = deadline_us;
+    return FBK_Success;
+}
+
+// Returns the next frame in ring_to_can that must be sent to CAN bus, or NULL if the ring is empty.
+// FIFO mode: the oldest frame.
+// Priority mode: the frame with the lowest CAN ID. Frames with the same CAN ID are returned in the order of the ring.
+kHostFrameLegacy* buf_get_can_frame()
+{
+    kFrameRing* ring = &USB_BufHandle.ring_to_can;
+    if ((USER_Flags & USR_TxPriority) == 0)
+        return ring_get_read_slot(ring);
+
+    // ring_clear() has discarded all frames or the frames have been read in FIFO mode.
+    // tail and tx_heap_pos are at most one ring size apart, so the comparison is safe when the counters roll over.
+    if (ring_apply_clear(ring) || (int32_t)(ring->tail - tx_heap_pos) > 0)
+    {
+        tx_heap_pos  = ring->tail;
+        tx_sent_mask = 0;
+        txheap_clear(&tx_heap);
+    }
+
+    // Insert the new frames from the USB interrupt into the heap
+    uint32_t head = ring->head;
+    while (tx_heap_pos != head)
+    {
+        uint32_t slot = tx_heap_pos % ring->size;
+        uint32_t can_id;
+        if (USER_Flags & USR_ProtoElmue) can_id = ((kTxFrameElmue*)&ring->slots[slot])->can_id;
+        else                             can_id = ring->slots[slot].can_id;
+
+        uint32_t priority = can_get_tx_priority((can_id & CAN_ID_29Bit) ? (can_id & CAN_MASK_29) : (can_id & CAN_MASK_11),
+                                                (can_id & CAN_ID_29Bit) > 0, (can_id & CAN_ID_RTR) > 0);
+
+        // ISO-TP chunks have no CAN ID. They are processed after the CAN frames, but always in the order of the ring.
+        if ((USER_Flags & USR_ProtoElmue) && ((kHeader*)&ring->slots[slot])->msg_type == MSG_IsoTpData)
+            priority = 0xFFFFFFFF;
+
+        // The ring position is the sequence number
+        txheap_push(&tx_heap, ((uint64_t)priority << 32) | tx_heap_pos, slot);
+        tx_heap_pos ++;
+    }
+
+    if (tx_heap.count == 0)
+        return NULL;
+
+    return &ring->slots[txheap_top(&tx_heap)];
+}
+
+// The frame from buf_get_can_frame() has been sent or discarded.
+void buf_release_can_frame()
+{
+    kFrameRing* ring = &USB_BufHandle.ring_to_can;
+    if ((USER_Flags & USR_TxPriority) == 0)
+    {
+        ring_commit_read(ring);
+        return;
+    }
+
+    tx_sent_mask |= 1ull << txheap_top(&tx_heap);
+    txheap_pop(&tx_heap);
+
+    // The producer needs the slots in the order of the ring.
+    // A slot behind a frame that is still waiting stays occupied until that frame has been sent.
+    while (ring->tail != tx_heap_pos && (tx_sent_mask & (1ull << (ring->tail % ring->size))))
+    {
+        tx_sent_mask &= ~(1ull << (ring->tail % ring->size));
+        ring_commit_read(ring);
+    }
+}
+
+// send a host packet to CAN bus if ring_to_can has data
 void buf_process_can_bus()
 {
-    if (HAL_FDCAN_GetTxFifoFreeLevel(can_get_handle()) == 0)
+    if (can_get_tx_free_level() == 0)
         return; // all 3 CAN Tx buffers are full
 
-    kHostFrameObject* frame_to_can = buf_get_frame_locked(&USB_BufHandle.list_to_can);
+    kHostFrameLegacy* frame_to_can = buf_get_can_frame();
     if (!frame_to_can)
         return; // nothing to be sent
 
@@ -118,12 +295,19 @@ void buf_process_can_bus()
     uint8_t* frame_data;
     if (USER_Flags & USR_ProtoElmue) // new ElmSoft protocol
     {
-        kTxFrameElmue *tx_frame = (kTxFrameElmue*)&frame_to_can->frame;
+        kTxFrameElmue *tx_frame = (kTxFrameElmue*)frame_to_can;
+        if (tx_frame->header.msg_type == MSG_IsoTpData)
+        {
+            buf_process_isotp_data((kIsoTpDataElmue*)frame_to_can);
+            buf_release_can_frame();
+            return;
+        }
         if (tx_frame->header.msg_type != MSG_TxFrame || can_is_tx_allowed() != FBK_Success)
         {
             // the host has sent an invalid packet or silent mode is enabled or bus is off
             error_assert(APP_CanTxFail, true);
-            list_add_tail_locked(&frame_to_can->list, &USB_BufHandle.list_can_pool);
+            bufstats_drop(DRP_CanTxFail, 1);
+            buf_release_can_frame();
             return; // do not send the message
         }
         can_id     = tx_frame->can_id;
@@ -143,12 +327,13 @@ void buf_process_can_bus()
     }
     else // legacy Geschwister Schneider protocol
     {
-        kHostFrameLegacy *tx_frame = &frame_to_can->frame;
+        kHostFrameLegacy *tx_frame = frame_to_can;
         can_id     = tx_frame->can_id;
         flags      = tx_frame->flags;
         frame_data = tx_frame->pack_FD.data;
         can_dlc    = tx_frame->can_dlc;
-        // marker not used, legacy sends a fake echo with echo_id.
+        // The marker is the slot in legacy_echo where the echo waits for the Tx event.
+        marker     = legacy_echo_next;
     }
 
     // ------------------------------
@@ -172,6 +357,10 @@ void buf_process_can_bus()
     if (can_id & CAN_ID_RTR)
         tx_header.TxFrameType = FDCAN_REMOTE_FRAME;
 
+    // Priority mode: wait while an earlier frame with the same ID is in a hardware Tx buffer, the frame stays in ring_to_can.
+    if (can_is_tx_id_pending(&tx_header))
+        return;
+
     if (flags & FRM_FDF) // FDF bit is set if recessive
     {
         tx_header.FDFormat = FDCAN_FD_CAN;
@@ -187,55 +376,75 @@ void buf_process_can_bus()
     if (!can_using_FD() && (tx_header.FDFormat == FDCAN_FD_CAN || can_dlc > 8))
     {
         error_assert(APP_CanTxFail, true);
+        bufstats_drop(DRP_CanTxFail, 1);
     }
     else // Transmit CAN packet
     {
         can_send_packet(&tx_header, frame_data);
         // At this point the Tx packet is in the CAN Tx FIFO, but it has not yet been transmitted to CAN bus.
-    }
 
-    if (USER_Flags & USR_ProtoElmue)
-    {
-        // The new ElmSoft firmware sends an echo marker when the packet has REALLY been dispatched to CAN bus.
-        // This is when HAL_FDCAN_GetTxEvent() received the Tx event.
-        // Here is nothing to be sent now because the packet is in the Tx FIFO and may wait there eternally until an ACK is received.
-    }
-    else // legacy
-    {
-        // The legacy Candlelight firmware sends a fake echo packet to the host when the packet was stored in the Tx FIFO.
-        // An exactly identical packet with a new timestamp is immediately sent back to the host.
-        // The host can recognize the echo packet because it has the same echo_id that he has put into the Tx packet.
-        // But this echo is useless because it gives no information if the packet has really been sent to CAN bus or not.
-        // If the packet stays a longer time in the Tx FIFO until an ACK is received, the echo has a wrong timestamp.
-        // But to maintain backwards compatibility with legacy software, this design error is left unchanged.
-
-        // frame_to_can comes from the CAN pool and cannot be sent to the host otherwise the CAN pool would be empty soon.
-        kHostFrameObject* frame_to_host = buf_get_frame_locked(&USB_BufHandle.list_host_pool);
-        if (frame_to_host)
+        if ((USER_Flags & USR_ProtoElmue) == 0)
         {
-            memcpy(&frame_to_host->frame, &frame_to_can->frame, sizeof(kHostFrameLegacy));
+            // The legacy Candlelight firmware sent a fake echo packet to the host when the packet was stored in the Tx FIFO,
+            // with the time when it was stored, no matter if the packet was ever sent to CAN bus.
+            // Now the echo waits in legacy_echo until buf_store_tx_echo() gets the Tx event with the start of frame on CAN bus.
+            // The host recognizes the echo packet because it has the same echo_id that he has put into the Tx packet.
+            // If the packet is never sent, buf_flush_legacy_echoes() sends the echo after a timeout, so the host does not run
+            // out of echo_ids. A slot that is still waiting is sent before it is reused.
+            uint32_t slot = legacy_echo_next;
+            if (legacy_echo_mask & (1 << slot))
+                buf_send_legacy_echo(&legacy_echo[slot], system_get_timestamp());
+
+            // frame_to_can is a slot of ring_to_can, it must be copied.
+            memcpy(&legacy_echo[slot], frame_to_can, sizeof(kHostFrameLegacy));
+            legacy_echo_tick[slot] = HAL_GetTick();
+            legacy_echo_mask |= 1 << slot;
+            legacy_echo_next  = (slot + 1) % LEGACY_ECHO_SLOTS;
+            buf_release_can_frame();
+            return;
+        }
+    }
 
-            if (frame_to_host->frame.flags & FRM_FDF)
-                frame_to_host->frame.pack_FD.timestamp_us = system_get_timestamp();
-            else // classic frame
-                frame_to_host->frame.pack_classic.timestamp_us = system_get_timestamp();
+    // The new ElmSoft firmware sends an echo marker when the packet has REALLY been dispatched to CAN bus.
+    // This is when HAL_FDCAN_GetTxEvent() received the Tx event.
+    // Here is nothing to be sent now because the packet is in the Tx FIFO and may wait there eternally until an ACK is received.
+    // The legacy protocol sends the echo of a packet that could not be passed to the Tx FIFO immediately.
+    if ((USER_Flags & USR_ProtoElmue) == 0)
+        buf_send_legacy_echo(frame_to_can, system_get_timestamp());
 
-            // Send fake echo back to host.
-            list_add_tail_locked(&frame_to_host->list, &USB_BufHandle.list_to_host);
-        }
+    // give the CAN slot back to the ring.
+    buf_release_can_frame();
+}
+
+// ISO-TP: the host has sent a chunk of a Tx PDU (see isotp.c)
+// The first chunk contains the length of the PDU, the following chunks have length = 0.
+// The PDU is sent when all data has been received.
+void buf_process_isotp_data(kIsoTpDataElmue* packet)
+{
+    eFeedback e_Ret = FBK_InvalidParameter;
+    int byte_count = packet->header.size - sizeof(kIsoTpDataElmue);
+    if (byte_count >= 0)
+    {
+        e_Ret = FBK_Success;
+        if (packet->length > 0)
+            e_Ret = isotp_begin(packet->length);
+
+        if (e_Ret == FBK_Success)
+            e_Ret = isotp_append(packet->data_start, byte_count);
     }
 
-    // give the CAN frame back to where it came from.
-    list_add_tail_locked(&frame_to_can->list, &USB_BufHandle.list_can_pool);
+    if (e_Ret != FBK_Success)
+        control_report_isotp(ISO_TxRejected);
 }
 
 // a RX packet has been received from CAN bus or a Tx Packet has been successfully sent to CAN bus (echo)
 // frame_data is a 64 byte buffer with the received / sent data bytes
-// append the frame to the list_to_host
-void buf_store_rx_packet(FDCAN_RxHeaderTypeDef *rx_header, uint8_t *frame_data)
+// timestamp is the 1 s time of the start of frame on CAN bus
+// append the frame to the ring_to_host
+void buf_store_rx_packet(FDCAN_RxHeaderTypeDef *rx_header, uint8_t *frame_data, uint32_t timestamp)
 {
-    kHostFrameObject* pool_frame = buf_get_frame_locked(&USB_BufHandle.list_host_pool);
-    if (!pool_frame)
+    kHostFrameLegacy* host_slot = buf_get_host_slot();
+    if (!host_slot)
         return; // buffer overflow! buf_process() will report this error to the host
 
     uint32_t can_id;
@@ -270,16 +479,18 @@ void buf_store_rx_packet(FDCAN_RxHeaderTypeDef *rx_header, uint8_t *frame_data)
         }
         else byte_count = utils_dlc_to_byte_count(can_dlc);
 
-        kRxFrameElmue* frame = (kRxFrameElmue*)&pool_frame->frame;
+        kRxFrameElmue* frame = (kRxFrameElmue*)host_slot;
         frame->header.size     = sizeof(kRxFrameElmue) + byte_count;
         frame->header.msg_type = MSG_RxFrame;
         frame->flags           = flags;
         frame->can_id          = can_id;
-        frame->timestamp       = system_get_timestamp();
+        frame->timestamp       = timestamp;
 
         if (USER_Flags & USR_Timestamp)
         {
-            memcpy(frame->data_use_stamp, frame_data, byte_count);
+            uint8_t stamp_high = buf_store_timestamp_high(frame->data_use_stamp, timestamp);
+            frame->header.size += stamp_high;
+            memcpy(frame->data_use_stamp + stamp_high, frame_data, byte_count);
         }
         else
         {
@@ -289,7 +500,7 @@ void buf_store_rx_packet(FDCAN_RxHeaderTypeDef *rx_header, uint8_t *frame_data)
     }
     else // legacy Geschwister Schneider protocol
     {
-        kHostFrameLegacy* frame = &pool_frame->frame;
+        kHostFrameLegacy* frame = host_slot;
         frame->channel  = 0;
         frame->reserved = 0;
         frame->flags    = flags;
@@ -298,48 +509,107 @@ void buf_store_rx_packet(FDCAN_RxHeaderTypeDef *rx_header, uint8_t *frame_data)
         frame->echo_id  = ECHO_RxData;
         memcpy(frame->raw_data, frame_data, 64);
 
+        // the start of frame on CAN bus, not the time when the main loop has processed the frame
         if (rx_header->FDFormat == FDCAN_FD_CAN)
-            frame->pack_FD.timestamp_us = system_get_timestamp();
+            frame->pack_FD.timestamp_us = timestamp;
         else // classic frame
-            frame->pack_classic.timestamp_us = system_get_timestamp();
+            frame->pack_classic.timestamp_us = timestamp;
     }
 
-    // add the frame to list_to_host with IRQs disabled
-    list_add_tail_locked(&pool_frame->list, &USB_BufHandle.list_to_host);
+    // pass the frame to buf_process_host()
+    buf_commit_host_message(MSGRING_RX_FRAME | (timestamp << 8));
 }
 
-// the legacy protocol never comes here. It sends a fake echo.
+// A Tx event has been received: the packet has been sent to CAN bus.
 void buf_store_tx_echo(FDCAN_TxEventFifoTypeDef* tx_event)
 {
     if ((USER_Flags & USR_ProtoElmue) == 0)
+    {
+        // legacy: send the echo that waits in legacy_echo
+        uint32_t slot = tx_event->MessageMarker;
+        if (slot < LEGACY_ECHO_SLOTS && (legacy_echo_mask & (1 << slot)))
+            buf_send_legacy_echo(&legacy_echo[slot], system_extend_timestamp(tx_event->TxTimestamp));
         return;
+    }
 
-    kHostFrameObject* pool_frame = buf_get_frame_locked(&USB_BufHandle.list_host_pool);
-    if (!pool_frame)
+    kHostFrameLegacy* host_slot = buf_get_host_slot();
+    if (!host_slot)
         return; // buffer overflow! buf_process() will report this error to the host
 
-    kTxEchoElmue* frame = (kTxEchoElmue*)&pool_frame->frame;
+    kTxEchoElmue* frame = (kTxEchoElmue*)host_slot;
     frame->header.size     = sizeof(kTxEchoElmue);
     frame->header.msg_type = MSG_TxEcho;
     frame->marker          = tx_event->MessageMarker;
-    frame->timestamp       = system_get_timestamp();
+    frame->timestamp       = system_extend_timestamp(tx_event->TxTimestamp); // start of frame on CAN bus
 
-    if ((USER_Flags & USR_Timestamp) == 0)
+    if (USER_Flags & USR_Timestamp)
+        frame->header.size += buf_store_timestamp_high((uint8_t*)(frame + 1), frame->timestamp);
+    else
         frame->header.size -= 4;
 
-    // add the frame to list_to_host with IRQs disabled
-    list_add_tail_locked(&pool_frame->list, &USB_BufHandle.list_to_host);
+    // pass the frame to buf_process_host()
+    buf_commit_host_slot();
 }
 
-// append an error frame to the list_to_host
+// Legacy protocol: send an exactly identical copy of a Tx packet with the timestamp back to the host.
+void buf_send_legacy_echo(kHostFrameLegacy* echo, uint32_t timestamp)
+{
+    if (echo >= legacy_echo && echo < legacy_echo + LEGACY_ECHO_SLOTS)
+        legacy_echo_mask &= ~(1 << (echo - legacy_echo));
+
+    kHostFrameLegacy* frame_to_host = buf_get_host_slot();
+    if (!frame_to_host)
+        return; // buffer overflow! buf_process() will report this error to the host
+
+    memcpy(frame_to_host, echo, sizeof(kHostFrameLegacy));
+    if (frame_to_host->flags & FRM_FDF)
+        frame_to_host->pack_FD.timestamp_us = timestamp;
+    else // classic frame
+        frame_to_host->pack_classic.timestamp_us = timestamp;
+
+    buf_commit_host_slot();
+}
+
+// Legacy protocol: send the echoes of packets that did not produce a Tx event.
+// This happens if can.c has aborted the Tx requests after CAN_TX_TIMEOUT, after Bus Off or if a Tx event has been lost.
+void buf_flush_legacy_echoes(uint32_t tick_now)
+{
+    for (uint32_t slot=0; legacy_echo_mask != 0 && slot<LEGACY_ECHO_SLOTS; slot++)
+    {
+        if ((legacy_echo_mask & (1 << slot)) && tick_now - legacy_echo_tick[slot] >= LEGACY_ECHO_TIMEOUT)
+            buf_send_legacy_echo(&legacy_echo[slot], system_get_timestamp());
+    }
+}
+
+// ISO-TP: pass a chunk of a received PDU to the host (see isotp.c)
+// pdu_length = the length of the PDU for the first chunk, 0 for the following chunks
+// returns false if ring_to_host is full, isotp_process() will try again later.
+// One slot is kept free, so the Rx packets do not get lost while a long PDU is passed to the host.
+bool buf_store_isotp_data(const uint8_t* data, uint32_t count, uint32_t pdu_length)
+{
+    if (msgring_find_space(&USB_BufHandle.ring_to_host, 2 * sizeof(kHostFrameLegacy)) < 0)
+        return false;
+
+    kIsoTpDataElmue* packet = (kIsoTpDataElmue*)buf_get_host_slot();
+    packet->header.size     = sizeof(kIsoTpDataElmue) + count;
+    packet->header.msg_type = MSG_IsoTpData;
+    packet->length          = pdu_length;
+    memcpy(packet->data_start, data, count);
+
+    // pass the chunk to buf_process_host()
+    buf_commit_host_slot();
+    return true;
+}
+
+// append an error frame to the ring_to_host
 void buf_store_error()
 {
-    kHostFrameObject* pool_frame = buf_get_frame_locked(&USB_BufHandle.list_host_pool);
-    if (!pool_frame)
+    kHostFrameLegacy* host_slot = buf_get_host_slot();
+    if (!host_slot)
         return; // buffer overflow! buf_process() will report this error to the host
-
-    kHostFrameLegacy* frame_gs    = &pool_frame->frame;
-    kErrorElmue*      frame_elmue = (kErrorElmue*)&pool_frame->frame;
+
+    kHostFrameLegacy* frame_gs    = host_slot;
+    kErrorElmue*      frame_elmue = (kErrorElmue*)host_slot;
     memset(frame_gs, 0, sizeof(kHostFrameLegacy));
 
     uint8_t* frame_data;
@@ -421,7 +691,9 @@ void buf_store_error()
         frame_elmue->err_id          = can_id; // the flag CAN_ID_Error is not needed as we have MSG_Error
         frame_elmue->timestamp       = system_get_timestamp();
 
-        if ((USER_Flags & USR_Timestamp) == 0)
+        if (USER_Flags & USR_Timestamp)
+            frame_elmue->header.size += buf_store_timestamp_high((uint8_t*)(frame_elmue + 1), frame_elmue->timestamp);
+        else
             frame_elmue->header.size -= 4;
     }
     else // legacy Geschwister Schneider protocol
@@ -432,24 +704,78 @@ void buf_store_error()
         frame_gs->pack_classic.timestamp_us = system_get_timestamp();
     }
 
-    // add the frame to list_to_host with IRQs disabled
-    list_add_tail_locked(&pool_frame->list, &USB_BufHandle.list_to_host);
+    // pass the frame to buf_process_host()
+    buf_commit_host_slot();
     error_clear();
 }
 
-// get a frame and remove it from it's list whith IRQs disabled
-// returns NULL if the list is empty
-kHostFrameObject* buf_get_frame_locked(list_item* list_head)
+// ELM_DevFlagTimestamp64: write the upper 32 bit of the 64 bit timestamp to dest (unaligned).
+// timestamp is the lower 32 bit that have already been stored in the message.
+// returns the count of bytes written to dest
+uint8_t buf_store_timestamp_high(uint8_t* dest, uint32_t timestamp)
 {
-    system_disable_irq();
-    kHostFrameObject* frame_obj = list_get_head_or_null(list_head, kHostFrameObject, list);
-    if (!frame_obj)
+    if ((USER_Flags & USR_Timestamp64) == 0)
+        return 0;
+
+    uint32_t stamp_high = (uint32_t)(system_extend_timestamp64(timestamp) >> 32);
+    memcpy(dest, &stamp_high, 4);
+    return 4;
+}
+
+// Get space in ring_to_host to be filled with a message to the host.
+// The space is always large enough for a kHostFrameLegacy, but only the real length of the message will be used.
+// Must be called from the main loop only. After filling the slot call buf_commit_host_slot().
+// returns NULL if the ring is full
+kHostFrameLegacy* buf_get_host_slot()
+{
+    kHostFrameLegacy* slot = (kHostFrameLegacy*)msgring_reserve(&USB_BufHandle.ring_to_host, sizeof(kHostFrameLegacy));
+    if (!slot)
+        bufstats_drop(DRP_HostFull, 1); // the caller discards the message
+    return slot;
+}
+
+// The slot from buf_get_host_slot() has been filled --> append it to ring_to_host
+void buf_commit_host_slot()
+{
+    buf_commit_host_message(0);
+}
+
+// rx_stamp = 0 or MSGRING_RX_FRAME + the lower 24 bits of the timestamp of an Rx frame (see buffer.h)
+void buf_commit_host_message(uint32_t rx_stamp)
+{
+    kMsgRing* ring = &USB_BufHandle.ring_to_host;
+    msgring_commit(ring, buf_get_message_length(ring->buffer + ring->reserved + MSGRING_LEN_SIZE), rx_stamp);
+    bufstats_level(QUE_Host, msgring_used(ring));
+}
+
+// A message has been passed to a USB IN transfer. If it is an Rx frame, tag it with the position host_msg_taken (see latency.c).
+// The ring stores only the lower 24 bits of the timestamp. The full timestamp is restored assuming that the frame
+// has waited less than 16 seconds in ring_to_host.
+void buf_tag_latency(uint32_t rx_stamp)
+{
+    if ((rx_stamp & MSGRING_RX_FRAME) == 0)
+        return;
+
+    uint32_t now = system_get_timestamp();
+    latency_tag(host_msg_taken, now - ((now - (rx_stamp >> 8)) & 0xFFFFFF));
+}
+
+// returns the count of bytes to be sent to the host for a message in ring_to_host, either kHostFrameLegacy or kHeader
+uint16_t buf_get_message_length(void* frame)
+{
+    if (USER_Flags & USR_ProtoElmue) // new ElmSoft protocol
     {
-        system_enable_irq();
-        return NULL;
+        // Using the optimized new ElmSoft protocol reduces unnecessary USB overhead as it was sent by the legacy firmware.
+        // If a CAN frame has only 2 data bytes, send only 2 data bytes over USB.
+        // All ElmSoft messages use the same header, no matter if CAN packet or an ASCII message.
+        return ((kHeader*)frame)->size;
     }
-    list_remove(&frame_obj->list); // remove frame_obj from it's list
-    system_enable_irq();
-    return frame_obj;
-}
 
+    // legacy Geschwister Schneider protocol
+    // The legacy protocol is not intelligently designed. The timestamp is behind a fix 64 byte data array.
+    // For CAN FD it sends ALWAYS 76 or 80 bytes over USB no matter how many bytes the frame really has.
+    uint16_t len = sizeof(kHostFrameLegacy); // 80 bytes
+    if ((((kHostFrameLegacy*)frame)->flags & FRM_FDF) == 0) len -= 56;
+    if ((USER_Flags & USR_Timestamp) == 0) len -= 4;
+    return len;
+}
@@ -16,126 +16,252 @@
 
 // ----------------------------------------------------------------------------------------
 
-#define container_of(ptr, type, member) \
-	({ \
-		__typeof(((type *)0)->member) *_p = (ptr); \
-		(type *)((char *)_p - offsetof(type, member)); \
-	})
+// Single producer / single consumer ringbuffer of kHostFrameLegacy slots.
+// ring_to_can: the producer is the USB interrupt (USBD_GS_DataOut), the consumer is the main loop.
+// head is only written by the producer and tail is only written by the consumer, so no interrupts must be disabled.
+// head and tail are free running counters, the slot index is counter % size.
+typedef struct
+{
+    kHostFrameLegacy* slots;
+    uint32_t          size;      // count of slots
+    __IO uint32_t     head;      // count of frames written by the producer
+    __IO uint32_t     tail;      // count of frames read by the consumer
+    __IO uint32_t     clear_pos; // set by ring_clear(), the consumer skips all frames before this position
+    __IO uint32_t     clear_req; // incremented by ring_clear()
+    __IO uint32_t     clear_ack; // set to clear_req by the consumer when it has skipped the discarded frames
+} kFrameRing;
 
-#define list_entry(ptr, type, field)             container_of(ptr, type, field)
-#define list_get_head(ptr, type, member)         list_entry((ptr)->next, type, member)
-#define list_get_head_or_null(ptr, type, member) (!list_is_empty(ptr) ? list_get_head(ptr, type, member) : NULL)
+static inline void ring_init(kFrameRing *ring, kHostFrameLegacy *slots, uint32_t size)
+{
+    ring->slots     = slots;
+    ring->size      = size;
+    ring->head      = 0;
+    ring->tail      = 0;
+    ring->clear_pos = 0;
+    ring->clear_req = 0;
+    ring->clear_ack = 0;
+}
 
-// implements a double chained list as ringbuffer.
-typedef struct list_item
+static inline uint32_t ring_count(const kFrameRing *ring)
 {
-    struct list_item *next;
-    struct list_item *prev;
-} list_item;
+    return ring->head - ring->tail;
+}
 
-// --------------
+static inline bool ring_is_full(const kFrameRing *ring)
+{
+    return ring_count(ring) >= ring->size;
+}
 
-// set empty
-static inline void list_init(list_item *head)
+// Producer: get the slot to be filled, returns NULL if the ring is full
+static inline kHostFrameLegacy* ring_get_write_slot(kFrameRing *ring)
 {
-    head->next = head; 
-    head->prev = head;
+    if (ring_is_full(ring))
+        return NULL;
+    return &ring->slots[ring->head % ring->size];
 }
 
-static inline bool list_is_empty(const list_item *head)
+// Producer: the slot from ring_get_write_slot() has been filled --> pass it to the consumer
+static inline void ring_commit_write(kFrameRing *ring)
 {
-    return head->next == head;
+    __DMB(); // the slot must be completely written before head is incremented
+    ring->head ++;
 }
 
-// static inline bool list_is_full(const list_item *head)
-// {
-//     The list will never be full, as only items are added and removed.
-//     Items are taken from the pool and inserted into list_to_host / list_to_can as needed.
-//     When the list items are not used anymore they are given back to the pool.
-//     So after initialization the pool is full and the other list is empty.
-// }
+// Consumer: skip the frames that have been discarded by ring_clear()
+// clear_pos is only compared with tail while a clear request is pending, so the free running counters may roll over.
+// If ring_clear() is called again meanwhile, the request stays pending and the next call skips to the new position.
+// returns true if frames have been skipped
+static inline bool ring_apply_clear(kFrameRing *ring)
+{
+    uint32_t req = ring->clear_req;
+    if (req == ring->clear_ack)
+        return false;
+
+    __DMB(); // clear_pos must be read after clear_req
+    uint32_t pos = ring->clear_pos;
+    ring->clear_ack = req;
+    if ((int32_t)(pos - ring->tail) <= 0)
+        return false; // the consumer has already passed this position
+
+    ring->tail = pos;
+    return true;
+}
 
-// for debugging: returns 0 ... CAN_QUEUE_SIZE or HOST_QUEUE_SIZE
-static inline int count_free_entries(const list_item *head)
+// Consumer: get the oldest slot without removing it, returns NULL if the ring is empty
+static inline kHostFrameLegacy* ring_get_read_slot(kFrameRing *ring)
 {
-    list_item* item = head->next;
-    for (int i=0; true; i++)
-    {
-        if (item == head)
-            return i;
-        
-        item = item->next;
-    }
+    ring_apply_clear(ring);
+
+    if (ring->head == ring->tail)
+        return NULL;
+    return &ring->slots[ring->tail % ring->size];
+}
+
+// Consumer: the slot from ring_get_read_slot() is not used anymore --> give it back to the producer
+static inline void ring_commit_read(kFrameRing *ring)
+{
+    __DMB(); // the slot must be completely read before tail is incremented
+    ring->tail ++;
+}
+
+// Discard all frames in the ring.
+// This may be called from the producer (USB interrupt) or from the consumer (main loop).
+// The tail must not be modified by the producer, so the consumer skips the discarded frames in ring_apply_clear().
+static inline void ring_clear(kFrameRing *ring)
+{
+    ring->clear_pos = ring->head;
+    __DMB(); // clear_pos must be written before the request
+    ring->clear_req ++;
+}
+
+// ----------------------------------------------------------------------------------------
+
+// Single producer / single consumer ringbuffer of messages with variable length.
+// A Tx echo needs only 7 bytes, so the ring can store much more messages than a ring of 80 byte kHostFrameLegacy slots.
+// Each message is stored contiguously behind a 4 byte length field at a 4 byte aligned offset (kHostFrameLegacy is __aligned(4)).
+// The length is stored because it cannot be calculated anymore if the host switches the protocol while messages are queued.
+// Rx frames store the lower 24 bits of their 1 s timestamp in the upper bytes of the length field (see latency.c).
+// If a message does not fit at the end of the buffer, the producer continues at offset 0
+// and stores in wrap where the data at the end of the buffer ends.
+// head is only written by the producer, tail is only written by the consumer.
+// head == tail means that the ring is empty, so the producer never lets head reach tail.
+typedef struct
+{
+    uint8_t*          buffer;
+    uint32_t          size;      // size of buffer in bytes
+    __IO uint32_t     head;      // offset where the producer writes the next message
+    __IO uint32_t     tail;      // offset where the consumer reads the next message
+    __IO uint32_t     wrap;      // end of the data at the end of the buffer after the producer has continued at offset 0
+    uint32_t          reserved;  // offset of the space returned by msgring_reserve() (used by the producer only)
+} kMsgRing;
+
+#define MSGRING_LEN_SIZE            4                       // the length field in front of each message
+#define MSGRING_LEN_MASK            0x7F                    // bits 0...6 of the length field: the length of the message (maximum 80 byte)
+#define MSGRING_RX_FRAME            0x80                    // bit 7: the message is an Rx frame, bits 8...31: the lower 24 bits of it's timestamp
+#define MSGRING_ALIGN(len)          (((len) + 3) & ~3)      // round up to a multiple of 4
+#define MSGRING_ENTRY_SIZE(len)     (MSGRING_LEN_SIZE + MSGRING_ALIGN(len))
+
+static inline void msgring_init(kMsgRing *ring, uint8_t *buffer, uint32_t size)
+{
+    ring->buffer   = buffer;
+    ring->size     = size;
+    ring->head     = 0;
+    ring->tail     = 0;
+    ring->wrap     = 0;
+    ring->reserved = 0;
 }
 
-// removes entry form it's list by connecting the previous element directly to the next in both directions.
-static inline void list_remove(list_item *entry)
+static inline bool msgring_is_empty(const kMsgRing *ring)
 {
-    entry->next->prev = entry->prev;
-    entry->prev->next = entry->next;
+    return ring->head == ring->tail;
 }
 
-// insert item between prev and next. This requires to modify 4 pointers.
-static inline void list_insert(list_item *item, list_item *prev, list_item *next)
+// Producer: returns the count of bytes that are occupied by messages including their length fields
+static inline uint32_t msgring_used(const kMsgRing *ring)
 {
-    next->prev = item;
-    item->next = next;
-    item->prev = prev;
-    prev->next = item;
+    uint32_t head = ring->head;
+    uint32_t tail = ring->tail;
+    if (head >= tail)
+        return head - tail;
+
+    // the messages from tail up to wrap and from offset 0 up to head
+    return ring->wrap - tail + head;
 }
 
-// insert item at the begin of the list
-static inline void list_add_head(list_item *item, list_item *head)
+// Producer: returns the offset where a message of max_len bytes can be stored contiguously, or -1 if the ring is full
+static inline int msgring_find_space(const kMsgRing *ring, uint32_t max_len)
 {
-    list_insert(item, head, head->next);
+    uint32_t need = MSGRING_ENTRY_SIZE(max_len);
+    uint32_t head = ring->head;
+    uint32_t tail = ring->tail;
+    if (head >= tail)
+    {
+        if (ring->size - head > need) return head; // space at the end of the buffer
+        if (tail > need)              return 0;    // space at the begin of the buffer
+        return -1;
+    }
+    if (tail - head > need) return head; // space between head and tail
+    return -1;
 }
-static inline void list_add_head_locked(list_item *entry, list_item *head)
+
+// Producer: reserve space for a message with up to max_len bytes, returns NULL if the ring is full
+static inline uint8_t* msgring_reserve(kMsgRing *ring, uint32_t max_len)
 {
-    system_disable_irq();
-    list_add_head(entry, head);
-    system_enable_irq();
+    int offset = msgring_find_space(ring, max_len);
+    if (offset < 0)
+        return NULL;
+
+    ring->reserved = offset;
+    return ring->buffer + offset + MSGRING_LEN_SIZE;
 }
 
-// insert item at the end of the list
-static inline void list_add_tail(list_item *item, list_item *head)
+// Producer: the space from msgring_reserve() has been filled with a message of len bytes --> pass it to the consumer
+// rx_stamp = 0 or MSGRING_RX_FRAME + timestamp << 8 for Rx frames
+static inline void msgring_commit(kMsgRing *ring, uint32_t len, uint32_t rx_stamp)
 {
-    list_insert(item, head->prev, head);
+    *(uint32_t*)(ring->buffer + ring->reserved) = len | rx_stamp;
+
+    if (ring->reserved != ring->head)
+        ring->wrap = ring->head; // the message is stored at offset 0, the data at the end of the buffer ends at the old head
+
+    __DMB(); // the message and wrap must be completely written before head is modified
+    ring->head = ring->reserved + MSGRING_ENTRY_SIZE(len);
 }
-static inline void list_add_tail_locked(list_item *entry, list_item *head)
+
+// Consumer: get the oldest message, it's length and the Rx timestamp without removing it, returns NULL if the ring is empty
+static inline uint8_t* msgring_peek(kMsgRing *ring, uint16_t *len, uint32_t *rx_stamp)
 {
-    system_disable_irq();
-    list_add_tail(entry, head);
-    system_enable_irq();
+    uint32_t head = ring->head;
+    uint32_t tail = ring->tail;
+    if (head == tail)
+        return NULL;
+
+    // the producer has continued at offset 0 and all messages at the end of the buffer have been read
+    if (head < tail && tail == ring->wrap)
+    {
+        ring->tail = 0;
+        tail = 0;
+    }
+    uint32_t field = *(uint32_t*)(ring->buffer + tail);
+    *len      = field & MSGRING_LEN_MASK;
+    *rx_stamp = field & ~MSGRING_LEN_MASK;
+    return ring->buffer + tail + MSGRING_LEN_SIZE;
+}
+
+// Consumer: the message from msgring_peek() is not used anymore --> give the space back to the producer
+static inline void msgring_release(kMsgRing *ring)
+{
+    uint32_t len = *(uint32_t*)(ring->buffer + ring->tail) & MSGRING_LEN_MASK;
+
+    __DMB(); // the message must be completely read before tail is modified
+    ring->tail += MSGRING_ENTRY_SIZE(len);
 }
 
 // ----------------------------------------------------------------------------------------
 
-typedef struct 
-{
-    list_item        list;
-    kHostFrameLegacy frame;
-} kHostFrameObject;
-
+// With ELM_DevFlagBatchMessages multiple messages are packed into one USB IN transfer of up to 4 USB packets.
+#define HOST_BATCH_SIZE     256
+// With the ElmSoft protocol the host can send multiple kTxFrameElmue in one USB OUT transfer of up to 4 USB packets.
+#define CAN_BATCH_SIZE      256
+
+// The OUT data of ELM_ReqSetCyclic (kCyclic + 64 data bytes) is received in 2 packets of Endpoint 0.
+#define EP0_BUF_SIZE        128
+
 // several buffer
 typedef struct 
 {
-    // 64 byte buffer for Endpoint 0 data (SETUP requests)
+    // 128 byte buffer for Endpoint 0 data (SETUP requests)
     // This buffer contains OUT data from the host in the second stage of SETUP requests.
-    uint8_t __aligned(4)    ep0_buf[USB_MAX_EP0_SIZE];
+    uint8_t __aligned(4)    ep0_buf[EP0_BUF_SIZE];
 
     // Currently a USB packet is sent to the host --> wait until the bus is free for the next packet.
     __IO bool               TxBusy;
     // Send a Zero Length Packet after the IN transfer
     __IO bool               SendZLP;
 
-    // The frame pool contains 64 kHostFrameObject's
-    // These can be taken and appended to list_to_can or list_to_host.
-    // When they are not used anymore they must be given back to the pool.
-    // When the frame pool is empty no more data can be sent, a buffer overflow error is generated.
-    list_item               list_can_pool;          // initialized to point to can_pool_buffer
-    list_item               list_host_pool;         // initialized to point to host_pool_buffer
-    list_item               list_to_can;            // FIFO for packtes USB --> CAN bus
-    list_item               list_to_host;           // FIFO for packtes CAN bus --> USB
+    // When a ring is full no more data can be stored, a buffer overflow error is generated.
+    kFrameRing              ring_to_can;            // FIFO for packtes USB --> CAN bus, slots in can_ring_buffer
+    kMsgRing                ring_to_host;           // FIFO for messages CAN bus --> USB, stored in host_ring_buffer
     
     // ATTENTION:
     // The legacy Candlelight firmware from Github was competely buggy.
@@ -143,8 +269,8 @@ typedef struct
     // The result was an adapter not sending anymore and even crashes when the buffer got full!
     // Nobody ever noticed that because of a complete lack of proper error handling.
     // The legacy firmware did not even set an error flag when a buffer overflow occurred.
-    uint8_t                 to_host_buf  [sizeof(kHostFrameLegacy)]; // stores USB IN  data during transmission (fixed by ElmSoft)
-    uint8_t                 from_host_buf[sizeof(kHostFrameLegacy)]; // stores USB OUT data after reception     (fixed by ElmSoft)
+    uint8_t                 to_host_buf  [HOST_BATCH_SIZE];          // stores the packed USB IN messages during transmission (ELM_DevFlagBatchMessages)
+    uint8_t                 from_host_buf[CAN_BATCH_SIZE];           // stores USB OUT data after reception     (fixed by ElmSoft)
     
     // SETUP requests with OUT data are executed in two stages, 
     // the first stage uses this variable to pass the request to the second stage.
@@ -156,8 +282,13 @@ typedef struct
 void buf_init();
 void buf_process(uint32_t tick_now);
 void buf_clear_can_buffer();
+uint32_t buf_get_can_count();
 void buf_store_error();
-void buf_store_rx_packet(FDCAN_RxHeaderTypeDef *rx_header, uint8_t *frame_data);
+void buf_store_rx_packet(FDCAN_RxHeaderTypeDef *rx_header, uint8_t *frame_data, uint32_t timestamp);
 void buf_store_tx_echo(FDCAN_TxEventFifoTypeDef* tx_event);
-kHostFrameObject* buf_get_frame_locked(list_item* list_head);
+bool buf_store_isotp_data(const uint8_t* data, uint32_t count, uint32_t pdu_length);
+kHostFrameLegacy* buf_get_host_slot();
+void buf_commit_host_slot();
+uint16_t buf_get_message_length(void* frame);
+eFeedback buf_set_batch_deadline(uint32_t deadline_us);
      
@@ -13,6 +13,15 @@
 #include "dfu.h"
 #include "control.h"
 #include "usb_ioreq.h"
+#include "cyclic.h"
+#include "isotp.h"
+#include "responder.h"
+#include "reduce.h"
+#include "busload.h"
+#include "idstats.h"
+#include "profiler.h"
+#include "latency.h"
+#include "bufstats.h"
 
 extern USB_BufHandleTypeDef  USB_BufHandle;
 extern eUserFlags            USER_Flags;
@@ -23,6 +32,17 @@ kDeviceVersion               GS_DeviceVersion = {0};
 // new ELmSoft protocol
 kBoardInfo                   ELM_BoardInfo    = {0};
 eFeedback                    ELM_LastError    = FBK_Success;
+kIdStatisticsPage            ELM_IdStatsPage;
+kProfilerStats               ELM_ProfilerStats;
+kLatencyStats                ELM_LatencyStats;
+kQueueStats                  ELM_QueueStats;
+
+eFeedback control_set_cyclic(kCyclic* cyclic, int byte_count);
+eFeedback control_set_responder(kResponder* responder, int byte_count);
+int       control_get_id_statistics(uint32_t slot);
+bool      control_get_profiler_stats(uint32_t stage);
+void      control_get_latency_stats();
+void      control_get_queue_stats();
 
 void control_init()
 {
@@ -42,7 +62,10 @@ void control_init()
                                    GS_DevFlagCAN_FD         |
                                    GS_DevFlagBitTimingFD    |
                                    ELM_DevFlagProtocolElmue |
-                                   ELM_DevFlagDisableTxEcho;
+                                   ELM_DevFlagDisableTxEcho |
+                                   ELM_DevFlagBatchMessages |
+                                   ELM_DevFlagTimestamp64   |
+                                   ELM_DevFlagTxPriority;
     if (TERMINATOR_Pin > 0)
         GS_CapabilityClassic.feature |= GS_DevFlagTermination;
 
@@ -135,6 +158,27 @@ bool control_setup_request(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
         case ELM_ReqSetPinStatus:
             len = sizeof(kPinStatus);
             break;
+        case ELM_ReqSetBatchDeadline:
+            len = sizeof(uint32_t);
+            break;
+        case ELM_ReqSetCyclic:
+            len = sizeof(kCyclic); // + 0...64 data bytes
+            break;
+        case ELM_ReqSetIsoTp:
+            len = sizeof(kIsoTp);
+            break;
+        case ELM_ReqSetResponder:
+            len = sizeof(kResponder); // + 0...8 data bytes
+            break;
+        case ELM_ReqSetReduction:
+            len = sizeof(kReduction);
+            break;
+        case ELM_ReqSetIdStatistics:
+            len = sizeof(uint8_t);
+            break;
+        case ELM_ReqSetStatistics:
+            len = sizeof(uint8_t);
+            break;
 
         // -------- Device -> Host (error checking here) --------
         case GS_ReqGetCapabilities:
@@ -193,6 +237,43 @@ bool control_setup_request(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
             len = sizeof(uint16_t);
             break;
         }
+        case ELM_ReqGetResponderStats:
+            src = responder_get_stats();
+            len = sizeof(kResponderStats);
+            break;
+        case ELM_ReqGetIdStatistics:
+            src = &ELM_IdStatsPage;
+            len = control_get_id_statistics(req->wValue);
+            break;
+        case ELM_ReqGetStatistics:
+        {
+            switch (req->wValue >> 8) // eStatisticsType
+            {
+                case STAT_Profiler: // low byte = eProfStage
+                    if (!control_get_profiler_stats(req->wValue & 0xFF))
+                    {
+                        ELM_LastError = FBK_InvalidParameter;
+                        return false;
+                    }
+                    src = &ELM_ProfilerStats;
+                    len = sizeof(kProfilerStats);
+                    break;
+                case STAT_Latency:
+                    control_get_latency_stats();
+                    src = &ELM_LatencyStats;
+                    len = sizeof(kLatencyStats);
+                    break;
+                case STAT_Queues:
+                    control_get_queue_stats();
+                    src = &ELM_QueueStats;
+                    len = sizeof(kQueueStats);
+                    break;
+                default:
+                    ELM_LastError = FBK_InvalidParameter;
+                    return false;
+            }
+            break;
+        }
         default:
             ELM_LastError = FBK_InvalidCommand;
             return false;
@@ -214,6 +295,18 @@ bool control_setup_request(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
         case ELM_ReqSetFilter:
         case ELM_ReqSetBusLoadReport:
         case ELM_ReqSetPinStatus:
+        case ELM_ReqSetBatchDeadline:
+        case ELM_ReqSetCyclic:
+        case ELM_ReqSetIsoTp:
+        case ELM_ReqSetResponder:
+        case ELM_ReqSetReduction:
+        case ELM_ReqSetIdStatistics:
+        case ELM_ReqSetStatistics:
+            if (req->wLength > sizeof(hcan->ep0_buf))
+            {
+                ELM_LastError = FBK_InvalidParameter;
+                return false;
+            }
             // provide the buffer ep0_buf in which the data from the host is passed to control_setup_OUT_data()
             hcan->last_setup_request = *req;
             USBD_CtlPrepareRx(pdev, hcan->ep0_buf, req->wLength);
@@ -228,6 +321,9 @@ bool control_setup_request(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
         case ELM_ReqGetBoardInfo:
         case ELM_ReqGetLastError:
         case ELM_ReqGetPinStatus:
+        case ELM_ReqGetResponderStats:
+        case ELM_ReqGetIdStatistics:
+        case ELM_ReqGetStatistics:
             // return the requested data
             USBD_CtlSendData(pdev, (uint8_t*)src, len);
             return true;
@@ -287,6 +383,13 @@ void control_setup_OUT_data(USBD_HandleTypeDef *pdev)
                 ELM_LastError = FBK_InvalidParameter;
                 return;
             }
+            // Batches are split by the host using kHeader.size which does not exist in the legacy protocol.
+            // The legacy protocol has no space for the upper 32 bit of the timestamp.
+            if ((dev_Mode->flags & (ELM_DevFlagBatchMessages | ELM_DevFlagTimestamp64)) > 0 && (dev_Mode->flags & ELM_DevFlagProtocolElmue) == 0)
+            {
+                ELM_LastError = FBK_InvalidParameter;
+                return;
+            }
             if (dev_Mode->mode == GS_ModeStart)
             {
                 if (can_is_opened())
@@ -308,6 +411,9 @@ void control_setup_OUT_data(USBD_HandleTypeDef *pdev)
             if (dev_Mode->flags &  GS_DevFlagTimestamp)     USER_Flags |=  USR_Timestamp;
             if (dev_Mode->flags & ELM_DevFlagDisableTxEcho) USER_Flags &= ~USR_ReportTX;
             if (dev_Mode->flags & ELM_DevFlagProtocolElmue) USER_Flags |= (USR_ProtoElmue | USR_DebugReport);
+            if (dev_Mode->flags & ELM_DevFlagBatchMessages) USER_Flags |=  USR_BatchIN;
+            if (dev_Mode->flags & ELM_DevFlagTimestamp64)   USER_Flags |= (USR_Timestamp | USR_Timestamp64);
+            if (dev_Mode->flags & ELM_DevFlagTxPriority)    USER_Flags |=  USR_TxPriority;
 
             // ------------------------- 3.) Start / Reset ----------------------------------
             if (dev_Mode->mode == GS_ModeStart)
@@ -359,6 +465,12 @@ void control_setup_OUT_data(USBD_HandleTypeDef *pdev)
                 case FIL_AcceptMask29bit:
                     ELM_LastError = can_set_mask_filter(filter->Operation == FIL_AcceptMask29bit, filter->Filter, filter->Mask);
                     return;
+                case FIL_SetElement:
+                    ELM_LastError = can_set_filter(filter->Index, filter->Type, filter->Filter, filter->Mask);
+                    return;
+                case FIL_RemoveElement:
+                    ELM_LastError = can_remove_filter(filter->Index);
+                    return;
                 default:
                     ELM_LastError = FBK_InvalidParameter;
                     return;
@@ -366,11 +478,13 @@ void control_setup_OUT_data(USBD_HandleTypeDef *pdev)
         }
         case ELM_ReqSetBusLoadReport:
         {
+            // The averaging window is optional, old applications send only the interval.
             uint8_t interval = hcan->ep0_buf[0];
+            uint8_t window   = (hcan->last_setup_request.wLength >= 2) ? hcan->ep0_buf[1] : 0;
             if ((USER_Flags & USR_ProtoElmue) == 0) // the ElmSoft protocol must be enabled for busload reports
                 ELM_LastError = FBK_InvalidParameter;
             else
-                ELM_LastError = can_enable_busload(interval); // interval in 100ms steps
+                ELM_LastError = busload_enable(interval, window); // interval and window in 100ms steps
             return;
         }
         case ELM_ReqSetPinStatus:
@@ -387,9 +501,328 @@ void control_setup_OUT_data(USBD_HandleTypeDef *pdev)
             ELM_LastError = FBK_InvalidParameter;
             return;
         }
+        case ELM_ReqSetBatchDeadline:
+        {
+            uint32_t* deadline_us = (uint32_t*)hcan->ep0_buf;
+            ELM_LastError = buf_set_batch_deadline(*deadline_us);
+            return;
+        }
+        case ELM_ReqSetCyclic:
+        {
+            kCyclic* cyclic = (kCyclic*)hcan->ep0_buf;
+            ELM_LastError = control_set_cyclic(cyclic, (int)hcan->last_setup_request.wLength - (int)sizeof(kCyclic));
+            return;
+        }
+        case ELM_ReqSetIsoTp:
+        {
+            kIsoTp* iso_tp = (kIsoTp*)hcan->ep0_buf;
+            if ((USER_Flags & USR_ProtoElmue) == 0) // the PDUs are transferred with MSG_IsoTpData
+            {
+                ELM_LastError = FBK_InvalidParameter;
+                return;
+            }
+            switch (iso_tp->Operation)
+            {
+                case ISO_Close:
+                    isotp_close();
+                    ELM_LastError = FBK_Success;
+                    return;
+                case ISO_Open:
+                    ELM_LastError = isotp_open(iso_tp->TxID, iso_tp->RxID, iso_tp->Flags, iso_tp->BlockSize, iso_tp->STmin, iso_tp->PadByte);
+                    return;
+                default:
+                    ELM_LastError = FBK_InvalidParameter;
+                    return;
+            }
+        }
+        case ELM_ReqSetResponder:
+        {
+            kResponder* responder = (kResponder*)hcan->ep0_buf;
+            ELM_LastError = control_set_responder(responder, (int)hcan->last_setup_request.wLength - (int)sizeof(kResponder));
+            return;
+        }
+        case ELM_ReqSetReduction:
+        {
+            kReduction* reduction = (kReduction*)hcan->ep0_buf;
+            switch (reduction->Operation)
+            {
+                case REDU_ClearAll:
+                    reduce_clear();
+                    ELM_LastError = FBK_Success;
+                    return;
+                case REDU_Remove:
+                    ELM_LastError = reduce_remove_rule(reduction->Index);
+                    return;
+                case REDU_Set:
+                {
+                    bool     extended = (reduction->CanID & CAN_ID_29Bit) > 0;
+                    uint32_t id_mask  = extended ? CAN_MASK_29 : CAN_MASK_11;
+                    ELM_LastError = reduce_set_rule(reduction->Index, reduction->CanID & id_mask, reduction->Mask & id_mask,
+                                                    extended, reduction->Mode, reduction->Param);
+                    return;
+                }
+                default:
+                    ELM_LastError = FBK_InvalidParameter;
+                    return;
+            }
+        }
+        case ELM_ReqSetIdStatistics:
+        {
+            uint8_t enable = hcan->ep0_buf[0];
+            if (enable > 1)
+            {
+                ELM_LastError = FBK_InvalidParameter;
+                return;
+            }
+            idstats_enable(enable == 1);
+            return;
+        }
+        case ELM_ReqSetStatistics:
+        {
+            switch (hcan->ep0_buf[0]) // eStatisticsOperation
+            {
+                case STATOP_ProfilerOff:
+                    profiler_enable(false);
+                    return;
+                case STATOP_ProfilerOn:
+                    profiler_enable(true);
+                    return;
+                case STATOP_LatencyReset:
+                    latency_reset();
+                    return;
+                case STATOP_QueueReset:
+                    bufstats_reset();
+                    return;
+                case STATOP_QueueReport:
+                {
+                    // The second byte is the interval. The ElmSoft protocol must be enabled for the reports.
+                    uint8_t interval = hcan->ep0_buf[1];
+                    if (hcan->last_setup_request.wLength < 2 || (USER_Flags & USR_ProtoElmue) == 0)
+                        ELM_LastError = FBK_InvalidParameter;
+                    else
+                        ELM_LastError = bufstats_enable_report(interval); // interval in 100ms steps
+                    return;
+                }
+                default:
+                    ELM_LastError = FBK_InvalidParameter;
+                    return;
+            }
+        }
     }
 }
 
+// ELM_ReqGetIdStatistics: copy up to 8 IDs from the table slot 'slot' on into ELM_IdStatsPage (see idstats.c)
+// returns the length of the response
+int control_get_id_statistics(uint32_t slot)
+{
+    kIdStatisticsPage* page = &ELM_IdStatsPage;
+    page->EntryCount = 0;
+    page->Reserved   = 0;
+    page->IdCount    = idstats_get_count();
+    page->Overflow   = idstats_get_overflow();
+
+    while (page->EntryCount < ID_STATS_PER_PAGE)
+    {
+        kIdStats* entry = idstats_get_next(&slot);
+        if (entry == NULL)
+            break;
+
+        kIdStatistics* stats = &page->Entries[page->EntryCount ++];
+        stats->Slot          = slot;
+        stats->DLC           = entry->dlc;
+        stats->Reserved      = 0;
+        stats->CanID         = (entry->key & CAN_MASK_29) | ((entry->key & IDT_Extended) ? CAN_ID_29Bit : 0);
+        stats->Count         = entry->count;
+        stats->LastTimestamp = entry->last_us;
+        stats->MinPeriod     = entry->min_us;
+        stats->MaxPeriod     = entry->max_us;
+        stats->AvgPeriod     = entry->avg_us;
+        slot ++;
+    }
+    return sizeof(kIdStatisticsPage) - (ID_STATS_PER_PAGE - page->EntryCount) * sizeof(kIdStatistics);
+}
+
+// ELM_ReqGetStatistics: copy the profiler statistics of one stage into ELM_ProfilerStats (see profiler.c)
+// returns false if the stage is invalid
+bool control_get_profiler_stats(uint32_t stage)
+{
+    kProfStage* prof = profiler_get_stage(stage);
+    if (prof == NULL)
+        return false;
+
+    kProfilerStats* stats = &ELM_ProfilerStats;
+    stats->Stage      = stage;
+    stats->StageCount = PRF_StageCount;
+    stats->Enabled    = profiler_enabled ? 1 : 0;
+    stats->Reserved   = 0;
+    stats->CpuClock   = SystemCoreClock;
+    stats->Count      = prof->count;
+    stats->MinCycles  = prof->min;
+    stats->AvgCycles  = profiler_get_average(prof);
+    stats->MaxCycles  = prof->max;
+    for (int i=0; i<PROFILER_BINS; i++)
+    {
+        stats->Histogram[i] = prof->bins[i];
+    }
+    return true;
+}
+
+// ELM_ReqGetStatistics: copy the latency histogram and its percentiles into ELM_LatencyStats (see latency.c)
+void control_get_latency_stats()
+{
+    kLatencyStats* stats = &ELM_LatencyStats;
+    stats->Count    = latency_get_count();
+    stats->Merged   = latency_get_merged();
+    stats->Min      = latency_get_min();
+    stats->P50      = latency_get_percentile(500);
+    stats->P90      = latency_get_percentile(900);
+    stats->P99      = latency_get_percentile(990);
+    stats->P999     = latency_get_percentile(999);
+    stats->Max      = latency_get_max();
+    for (uint32_t bin=0; bin<LATENCY_BINS; bin++)
+    {
+        uint32_t low_us;
+        stats->Histogram[bin] = latency_get_bin(bin, &low_us);
+    }
+}
+
+// ELM_ReqGetStatistics: copy the drop counters, peak levels and sizes of the queues into ELM_QueueStats (see bufstats.c)
+void control_get_queue_stats()
+{
+    kQueueStats* stats = &ELM_QueueStats;
+    for (uint32_t i=0; i<DRP_Count; i++)
+    {
+        stats->Drops[i] = bufstats_get_drops(i);
+    }
+    for (uint32_t i=0; i<QUE_Count; i++)
+    {
+        stats->Peaks[i] = bufstats_get_peak(i);
+        stats->Sizes[i] = bufstats_get_size(i);
+    }
+}
+
+// ELM_ReqSetCyclic: pass a cyclic message to the scheduler in cyclic.c or remove it.
+// byte_count = count of data bytes that the host has appended to kCyclic.
+eFeedback control_set_cyclic(kCyclic* cyclic, int byte_count)
+{
+    if (byte_count < 0 || byte_count > 64)
+        return FBK_InvalidParameter;
+
+    if (cyclic->Period == 0)
+    {
+        if (cyclic->Index != 0xFF)
+            return cyclic_remove(cyclic->Index);
+
+        cyclic_clear();
+        return FBK_Success;
+    }
+
+    FDCAN_TxHeaderTypeDef tx_header;
+    tx_header.TxFrameType         = FDCAN_DATA_FRAME;
+    tx_header.FDFormat            = FDCAN_CLASSIC_CAN;
+    tx_header.IdType              = FDCAN_STANDARD_ID;
+    tx_header.BitRateSwitch       = FDCAN_BRS_OFF;
+    tx_header.ErrorStateIndicator = can_is_passive() ? FDCAN_ESI_PASSIVE : FDCAN_ESI_ACTIVE;
+
+    if (cyclic->CanID & CAN_ID_29Bit)
+    {
+         tx_header.IdType     = FDCAN_EXTENDED_ID;
+         tx_header.Identifier = cyclic->CanID & CAN_MASK_29;
+    }
+    else tx_header.Identifier = cyclic->CanID & CAN_MASK_11;
+
+    if (cyclic->Flags & FRM_FDF)
+    {
+        tx_header.FDFormat = FDCAN_FD_CAN;
+        if (cyclic->Flags & FRM_BRS)
+            tx_header.BitRateSwitch = FDCAN_BRS_ON;
+    }
+    else if (byte_count > 8)
+        return FBK_InvalidParameter; // classic frames allow 0...8 bytes
+
+    uint8_t tx_data[64];
+    if (cyclic->CanID & CAN_ID_RTR)
+    {
+        if (tx_header.FDFormat == FDCAN_FD_CAN)
+            return FBK_InvalidParameter; // remote frames do not exist in CAN FD
+
+        tx_header.TxFrameType = FDCAN_REMOTE_FRAME;
+        tx_header.DataLength  = (byte_count > 0) ? MIN(cyclic->DataStart[0], 8) : 0;
+    }
+    else
+    {
+        // A byte count that is not a valid CAN FD length (e.g. 10) is padded with zeroes to the next DLC (12).
+        tx_header.DataLength = utils_byte_count_to_dlc(byte_count);
+        memcpy(tx_data, cyclic->DataStart, byte_count);
+        memset(tx_data + byte_count, 0, utils_dlc_to_byte_count(tx_header.DataLength) - byte_count);
+    }
+
+    return cyclic_set(cyclic->Index, &tx_header, tx_data, cyclic->Period, cyclic->Phase, cyclic->CounterByte, cyclic->ChecksumByte);
+}
+
+// ELM_ReqSetResponder: pass an automatic response to responder.c or remove it.
+// byte_count = count of data bytes that the host has appended to kResponder.
+eFeedback control_set_responder(kResponder* responder, int byte_count)
+{
+    switch (responder->Operation)
+    {
+        case RESP_ClearAll:
+            responder_clear();
+            return FBK_Success;
+        case RESP_Remove:
+            return responder_remove(responder->Index);
+        case RESP_Set:
+            break;
+        default:
+            return FBK_InvalidParameter;
+    }
+
+    if (byte_count < 0 || byte_count > RESPONDER_MAX_DATA)
+        return FBK_InvalidParameter;
+
+    FDCAN_TxHeaderTypeDef tx_header;
+    tx_header.TxFrameType         = FDCAN_DATA_FRAME;
+    tx_header.FDFormat            = FDCAN_CLASSIC_CAN;
+    tx_header.IdType              = FDCAN_STANDARD_ID;
+    tx_header.BitRateSwitch       = FDCAN_BRS_OFF;
+    tx_header.ErrorStateIndicator = FDCAN_ESI_ACTIVE;
+
+    if (responder->ResponseID & CAN_ID_29Bit)
+    {
+         tx_header.IdType     = FDCAN_EXTENDED_ID;
+         tx_header.Identifier = responder->ResponseID & CAN_MASK_29;
+    }
+    else tx_header.Identifier = responder->ResponseID & CAN_MASK_11;
+
+    if (responder->Flags & FRM_FDF)
+    {
+        tx_header.FDFormat = FDCAN_FD_CAN;
+        if (responder->Flags & FRM_BRS)
+            tx_header.BitRateSwitch = FDCAN_BRS_ON;
+    }
+
+    uint8_t tx_data[RESPONDER_MAX_DATA];
+    if (responder->ResponseID & CAN_ID_RTR)
+    {
+        if (tx_header.FDFormat == FDCAN_FD_CAN)
+            return FBK_InvalidParameter; // remote frames do not exist in CAN FD
+
+        tx_header.TxFrameType = FDCAN_REMOTE_FRAME;
+        tx_header.DataLength  = (byte_count > 0) ? MIN(responder->DataStart[0], 8) : 0;
+    }
+    else
+    {
+        tx_header.DataLength = utils_byte_count_to_dlc(byte_count);
+        memcpy(tx_data, responder->DataStart, byte_count);
+    }
+
+    bool     match_extended = (responder->MatchID & CAN_ID_29Bit) > 0;
+    uint32_t id_mask        = match_extended ? CAN_MASK_29 : CAN_MASK_11;
+    return responder_set(responder->Index, responder->MatchID & id_mask, responder->MatchMask & id_mask, match_extended,
+                         responder->Pattern, responder->PatternMask, responder->PatternLength, &tx_header, tx_data,
+                         responder->CopySource, responder->CopyTarget, responder->CopyCount);
+}
+
 // ========================= Errors ===========================
 
 // This function is called approx 100 times in one millisecond from the main loop
@@ -404,18 +837,56 @@ void control_process(uint32_t tick_now)
     can_recover_bus_off();
 }
 
-void control_report_busload(uint8_t busload_percent)
+void control_report_busload(uint32_t busload_ppm)
 {
-    kHostFrameObject* pool_frame = buf_get_frame_locked(&USB_BufHandle.list_host_pool);
-    if (!pool_frame)
+    kHostFrameLegacy* host_slot = buf_get_host_slot();
+    if (!host_slot)
         return; // buffer overflow! buf_process() will report this error to  the host
 
-    kBusloadElmue* packet = (kBusloadElmue*)&pool_frame->frame;
+    kBusloadElmue* packet = (kBusloadElmue*)host_slot;
     packet->header.size     = sizeof(kBusloadElmue);
     packet->header.msg_type = MSG_Busload;
-    packet->bus_load        = busload_percent;
+    packet->bus_load        = MIN(99, busload_ppm / 10000);
+    packet->bus_load_ppm    = busload_ppm;
+
+    buf_commit_host_slot();
+}
+
+// Send the drop counters and the peak levels of the queues in the interval of STATOP_QueueReport (see bufstats.c)
+void control_report_queues()
+{
+    kHostFrameLegacy* host_slot = buf_get_host_slot();
+    if (!host_slot)
+        return; // buffer overflow! buf_process() will report this error to  the host
+
+    kQueueStatsElmue* packet = (kQueueStatsElmue*)host_slot;
+    packet->header.size     = sizeof(kQueueStatsElmue);
+    packet->header.msg_type = MSG_QueueStats;
+    for (uint32_t i=0; i<DRP_Count; i++)
+    {
+        packet->drops[i] = bufstats_get_drops(i);
+    }
+    for (uint32_t i=0; i<QUE_Count; i++)
+    {
+        packet->peaks[i] = bufstats_get_peak(i);
+    }
+
+    buf_commit_host_slot();
+}
+
+// ISO-TP: report an eIsoTpEvent to the host (see isotp.c)
+void control_report_isotp(uint8_t event)
+{
+    kHostFrameLegacy* host_slot = buf_get_host_slot();
+    if (!host_slot)
+        return; // buffer overflow! buf_process() will report this error to  the host
+
+    kIsoTpEventElmue* packet = (kIsoTpEventElmue*)host_slot;
+    packet->header.size     = sizeof(kIsoTpEventElmue);
+    packet->header.msg_type = MSG_IsoTpEvent;
+    packet->event           = event;
 
-    list_add_tail_locked(&pool_frame->list, &USB_BufHandle.list_to_host);
+    buf_commit_host_slot();
 }
 
 // Send a debug message. Maximum length is 78 characters.
@@ -430,8 +901,8 @@ bool control_send_debug_mesg(const char* message)
     if ((USER_Flags & USR_DebugReport) == 0)
         return false;
 
-    kHostFrameObject* pool_frame = buf_get_frame_locked(&USB_BufHandle.list_host_pool);
-    if (!pool_frame)
+    kHostFrameLegacy* host_slot = buf_get_host_slot();
+    if (!host_slot)
         return false; // buffer overflow! buf_process() will report this error to  the host
 
     // ------------------------------
@@ -443,11 +914,11 @@ bool control_send_debug_mesg(const char* message)
         len = 20;
     }
 
-    kStringElmue* packet = (kStringElmue*)&pool_frame->frame;
+    kStringElmue* packet = (kStringElmue*)host_slot;
     packet->header.size     = sizeof(kStringElmue) + len;
     packet->header.msg_type = MSG_String;
     memcpy(packet->ascii_msg, message, len);
 
-    list_add_tail_locked(&pool_frame->list, &USB_BufHandle.list_to_host);
+    buf_commit_host_slot();
     return true;
 }
@@ -11,7 +11,9 @@
 
 void control_init();
 void control_process(uint32_t tick_now);
-void control_report_busload(uint8_t busload_percent);
+void control_report_busload(uint32_t busload_ppm);
+void control_report_queues();
+void control_report_isotp(uint8_t event);
 bool control_send_debug_mesg(const char* message);
 bool control_setup_request (USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req);
 void control_setup_OUT_data(USBD_HandleTypeDef *pdev);
@@ -15,6 +15,8 @@
 #include "utils.h"
 #include "dfu.h"
 #include "can.h"
+#include "latency.h"
+#include "bufstats.h"
 
 #define GSUSB_ENDPOINT_IN           0x81
 #define GSUSB_ENDPOINT_OUT          0x02
@@ -44,6 +46,7 @@ static uint8_t* USBD_GS_GetUserStringDescr(USBD_HandleTypeDef *pdev, uint8_t ind
 static void     USBD_GS_Vendor_Request(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req);
 static bool     USBD_GS_DFU_Request(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req);
 static bool     USBD_GS_CustomRequest(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req);
+static bool     USBD_GS_StoreFrameFromHost(USB_BufHandleTypeDef *hcan, void *frame, uint32_t len);
 /*
 // not used for Full speed USB device
 static uint8_t  *USBD_GS_GetHSCfgDesc(uint16_t *length);
@@ -236,9 +239,12 @@ __ALIGN_BEGIN uint8_t USBD_MicrosoftExtPropertyDescr[] __ALIGN_END =
 void USBD_ConfigureEndpoints(USBD_HandleTypeDef *pdev)
 {
     // Configue Packet Memory Area (PMA) for all endpoints
+    // The bulk endpoints are double buffered: while the host reads / writes one buffer, the firmware fills / empties the other one.
+    // So the IN endpoint has the next 64 byte packet of a transfer already staged when the host polls it.
+    // A double buffered endpoint uses the Rx and the Tx buffer descriptor, so it can only be used in one direction (EP 1 IN, EP 2 OUT).
     HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData, 0x00, PCD_SNG_BUF, 0x18);       // EP 0 OUT (max packet size = 64 byte)
     HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData, 0x80, PCD_SNG_BUF, 0x58);       // EP 0 IN  (max packet size = 64 byte)
-    HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData, 0x81, PCD_SNG_BUF, 0xd8);       // EP 1 IN  (max packet size = 64 byte)
+    HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData, 0x81, PCD_DBL_BUF, 0x025800d8); // EP 1 IN  (max packet size = 64 byte, double buffer addr D8 + 258)
     HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData, 0x02, PCD_DBL_BUF, 0x015801d8); // EP 2 OUT (max packet size = 64 byte, double buffer addr 158 + 1D8)
 }
 
@@ -354,17 +360,32 @@ static bool USBD_GS_DFU_Request(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *
 static uint8_t USBD_GS_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum) 
 {
     USB_BufHandleTypeDef *hcan = (USB_BufHandleTypeDef*)pdev->pClassData;
+    uint32_t rx_len = USBD_LL_GetRxDataSize(pdev, epnum);
 
-    kHostFrameObject* pool_frame = buf_get_frame_locked(&hcan->list_can_pool);
-    if (pool_frame)
+    if (USER_Flags & USR_ProtoElmue) // new ElmSoft protocol
     {
-        memcpy(&pool_frame->frame, hcan->from_host_buf, sizeof(hcan->from_host_buf));
-        list_add_tail_locked(&pool_frame->list, &hcan->list_to_can);
+        // The host may send multiple kTxFrameElmue back-to-back in one transfer --> split them using header.size.
+        uint32_t offset = 0;
+        while (offset + sizeof(kHeader) <= rx_len)
+        {
+            kHeader* header = (kHeader*)(hcan->from_host_buf + offset);
+            if (header->size < sizeof(kTxFrameElmue) || header->size > sizeof(kHostFrameLegacy) || offset + header->size > rx_len)
+            {
+                // The host has sent an invalid message. The rest of the transfer cannot be split anymore.
+                error_assert(APP_CanTxFail, true);
+                bufstats_drop(DRP_CanTxFail, 1);
+                break;
+            }
+
+            // If ring_to_can is full, all the following frames of the transfer are also dropped and counted.
+            USBD_GS_StoreFrameFromHost(hcan, header, header->size);
+
+            offset += header->size;
+        }
     }
-    else // CAN buffer overflow
+    else // legacy Geschwister Schneider protocol (one frame per transfer)
     {
-        // in case of buffer overflow inform the host immediately, so the host stops sending more packets and displays an error to the user.
-        error_assert(APP_CanTxOverflow, true);
+        USBD_GS_StoreFrameFromHost(hcan, hcan->from_host_buf, sizeof(kHostFrameLegacy));
     }
 
     // pass the buffer from_host_buf to the HAL for the next frame to receive
@@ -372,6 +393,26 @@ static uint8_t USBD_GS_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum)
     return USBD_OK; // ignored
 }
 
+// called from inside an interrupt callback
+// Copy one frame from from_host_buf into the next slot of ring_to_can.
+// returns false on buffer overflow
+static bool USBD_GS_StoreFrameFromHost(USB_BufHandleTypeDef *hcan, void *frame, uint32_t len)
+{
+    kHostFrameLegacy* slot = ring_get_write_slot(&hcan->ring_to_can);
+    if (!slot) // CAN buffer overflow
+    {
+        // in case of buffer overflow inform the host immediately, so the host stops sending more packets and displays an error to the user.
+        error_assert(APP_CanTxOverflow, true);
+        bufstats_drop(DRP_CanTxFull, 1);
+        return false;
+    }
+
+    memcpy(slot, frame, len);
+    ring_commit_write(&hcan->ring_to_can);
+    bufstats_level(QUE_CanTx, ring_count(&hcan->ring_to_can));
+    return true;
+}
+
 // interrupt callback
 static uint8_t *USBD_GS_GetFSConfigDesc(uint16_t *length)
 {
@@ -463,37 +504,29 @@ bool USBD_GS_CustomRequest(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
 
 // This function is called from the main loop only after USBD_IsTxBusy() has returned false.
 // Send a frame to the host on IN endpoint 81, either kHostFrameLegacy or kHeader
-void USBD_SendFrameToHost(void *frame)
+// len is calculated by buf_get_message_length()
+// IMPORTANT:
+// USBD_LL_Transmit does not copy the frame data to another buffer.
+// It copies each 64 byte USB packet into the packet memory when the previous packet has been sent.
+// The frame must stay unchanged until USBD_IsTxBusy() returns false. buf_process_host() keeps it in ring_to_host until then.
+void USBD_SendFrameToHost(void *frame, uint16_t len)
 {   
-    uint16_t len;
-    if (USER_Flags & USR_ProtoElmue) // new ElmSoft protocol
-    {
-        // Using the optimized new ElmSoft protocol reduces unnecessary USB overhead as it was sent by the legacy firmware.
-        // If a CAN frame has only 2 data bytes, send only 2 data bytes over USB.
-        // All ElmSoft messages use the same header, no matter if CAN packet or an ASCII message.
-        len = ((kHeader*)frame)->size;
-    }
-    else // legacy Geschwister Schneider protocol
-    {
-        // The legacy protocol is not intelligently designed. The timestamp is behind a fix 64 byte data array.
-        // For CAN FD it sends ALWAYS 76 or 80 bytes over USB no matter how many bytes the frame really has.
-        len = sizeof(kHostFrameLegacy); // 80 bytes
-        if ((((kHostFrameLegacy*)frame)->flags & FRM_FDF) == 0) len -= 56;
-        if ((USER_Flags & USR_Timestamp) == 0) len -= 4;
-    }
- 
     USB_BufHandleTypeDef *hcan = (USB_BufHandleTypeDef*)USB_Device.pClassData; 
     hcan->TxBusy  = true;   
     hcan->SendZLP = len > 0 && (len % CAN_DATA_MAX_PACKET_SIZE) == 0;
-   
-    // IMPORTANT:
-    // USBD_LL_Transmit does not copy the frame data to another buffer.
-    // The HAL needs a pointer to a buffer that stays unchanged until all data has been sent.
+
     // If the data exceeds the USB endpoint maximum packet size (64 byte), it will be sent in multiple USB packets.
-    memcpy(hcan->to_host_buf, frame, len);  
-      
     // always returns HAL_OK
-    USBD_LL_Transmit(&USB_Device, GSUSB_ENDPOINT_IN, hcan->to_host_buf, len);
+    USBD_LL_Transmit(&USB_Device, GSUSB_ENDPOINT_IN, (uint8_t*)frame, len);
+}
+
+// This function is called from the main loop only after USBD_IsTxBusy() has returned false.
+// Send the first len bytes of to_host_buf to the host on IN endpoint 81.
+// With ELM_DevFlagBatchMessages buf_process_host() has packed multiple messages into to_host_buf.
+void USBD_SendBufferToHost(uint16_t len)
+{
+    USB_BufHandleTypeDef *hcan = (USB_BufHandleTypeDef*)USB_Device.pClassData; 
+    USBD_SendFrameToHost(hcan->to_host_buf, len);
 }
 
 // interrupt callback
@@ -519,6 +552,8 @@ static uint8_t USBD_GS_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum)
     }
     else
     {
+        // The transfer has completed --> measure the latency of the Rx frames in it
+        latency_end_transfer();
         hcan->TxBusy = false;
     }
     return USBD_OK;
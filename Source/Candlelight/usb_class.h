@@ -10,7 +10,8 @@
 #include "usb_def.h"
 #include "usb_core.h"
 
-void    USBD_SendFrameToHost(void *frame);
+void    USBD_SendFrameToHost(void *frame, uint16_t len);
+void    USBD_SendBufferToHost(uint16_t len);
 bool    USBD_IsTxBusy();
 void    USBD_ConfigureEndpoints(USBD_HandleTypeDef *pdev);
 bool    USBD_SetupStageRequest(PCD_HandleTypeDef *hpcd);
@@ -11,170 +11,404 @@
 #include "control.h"
 #include "system.h"
 #include "utils.h"
+#include "slcan_def.h"
+#include "hexcodec.h"
+#include "isotp.h"
+#include "latency.h"
+#include "bufstats.h"
 
 extern eUserFlags USER_Flags;
 
 volatile struct buf_cdc_tx buf_cdc_tx = {0};
 volatile struct buf_cdc_rx buf_cdc_rx = {0};
 static   struct buf_can_tx buf_can_tx = {0};
+static   FDCAN_TxHeaderTypeDef can_dest_header; // control.c writes the header here, buf_comit_can_dest() packs it into the slot
 static uint8_t slcan_str[SLCAN_MTU];
 static uint8_t slcan_str_index = 0;
+static uint32_t cdc_rx_pos = 0; // read position in the oldest CDC receive buffer
+static bool     cdc_cmd_held = false; // a complete Tx frame command waits in slcan_str until buf_can_tx has a free slot
+static uint32_t credit_returned = 0; // credit mode: Tx slots that have been freed since the last report
 
 int32_t buf_frame_to_ascii(uint8_t *buf, bool b_TX, FDCAN_RxHeaderTypeDef *rx_header, uint8_t *frame_data);
+void    buf_process_cdc_rx();
+void    buf_process_cdc_tx();
+void    buf_report_credit();
+void    buf_write_cdc(const uint8_t* src, uint32_t len);
+uint32_t buf_get_cdc_free();
+void    buf_parse_byte(uint8_t byte);
+void    buf_parse_record_byte(uint8_t byte);
+void    buf_execute_command();
+bool    buf_is_frame_command();
+void    buf_store_rx_record(kRxFrameElmue* record, FDCAN_RxHeaderTypeDef *rx_header, uint8_t *frame_data);
+void    buf_unpack_tx_header(kTxSlotHeader* slot_header, FDCAN_TxHeaderTypeDef* tx_header);
 
 // Initializes
 void buf_init()
 {
     buf_cdc_rx.head = 0;
     buf_cdc_rx.tail = 0;
+    buf_cdc_rx.paused = false;
+    cdc_rx_pos = 0;
+    cdc_cmd_held = false;
 
-    buf_cdc_tx.head = 1;
-    buf_cdc_tx.msglen[buf_cdc_tx.head] = 0;
-    buf_cdc_tx.tail = 0;
-    buf_cdc_tx.msglen[buf_cdc_tx.tail] = 0;
+    buf_cdc_tx.head    = 0;
+    buf_cdc_tx.tail    = 0;
+    buf_cdc_tx.sending = 0;
+    latency_clear_tags();
 
-    buf_can_tx.head = 0;
-    buf_can_tx.send = 0;
-    buf_can_tx.tail = 0;
-    buf_can_tx.full = 0;
+    buf_clear_can_buffer();
+    credit_returned = 0;
+
+    bufstats_set_size(QUE_CanTx, BUF_CAN_TXQUEUE_LEN);
+    bufstats_set_size(QUE_Host,  BUF_CDC_TX_SIZE - 1);
+    bufstats_set_size(QUE_UsbRx, BUF_CDC_RX_NUM_BUFS - 1);
 }
 
 // Clear can tx buffer
 void buf_clear_can_buffer()
 {
-    buf_can_tx.tail = buf_can_tx.head;
-    buf_can_tx.send = buf_can_tx.head;
-    buf_can_tx.full = 0;
+    // The discarded frames give their credits back to the host
+    buf_return_credit(buf_can_tx.queue.count);
+
+    for (int i = 0; i < BUF_CAN_TXQUEUE_LEN; i++)
+    {
+        buf_can_tx.free[i] = i;
+    }
+    buf_can_tx.free_count = BUF_CAN_TXQUEUE_LEN;
+    txheap_clear(&buf_can_tx.queue);
+}
+
+// returns the count of frames in buf_can_tx
+uint32_t buf_get_can_count()
+{
+    return buf_can_tx.queue.count;
 }
 
 // This function is called approx 100 times in one millisecond from the main loop
 void buf_process(uint32_t tick_now)
 {
-    // disable interrupts because buf_cdc_rx.head is modified in the interrupt callback CDC_Receive_FS()
-    system_disable_irq();
-    uint32_t tmp_head = buf_cdc_rx.head;
-    system_enable_irq();
+    buf_process_cdc_rx();
+    buf_process_cdc_tx();
+
+    // Process can transmit buffer
+    while (buf_can_tx.queue.count > 0 && can_get_tx_free_level() > 0)
+    {
+        // Transmit the frame with the smallest key (FIFO: the oldest, priority mode: the lowest CAN ID)
+        // In priority mode it must wait while an earlier frame with the same ID is in a hardware Tx buffer.
+        uint8_t slot = txheap_top(&buf_can_tx.queue);
+        FDCAN_TxHeaderTypeDef tx_header;
+        buf_unpack_tx_header(&buf_can_tx.header[slot], &tx_header);
+        if (can_is_tx_id_pending(&tx_header))
+            break;
+
+        can_send_packet(&tx_header, buf_can_tx.data[slot]);
+        
+        // At this point the Tx packet is in the CAN Tx FIFO, but it has not yet been transmitted to CAN bus.
+
+        txheap_pop(&buf_can_tx.queue);
+        buf_can_tx.free[buf_can_tx.free_count ++] = slot;
+        credit_returned ++;
+    }
+
+    buf_report_credit();
     
-    if (buf_cdc_rx.tail != tmp_head)
+    // report buffer full always --> green + blue LED are permanently ON
+    if (buf_can_tx.free_count == 0)
+        error_assert(APP_CanTxOverflow, false);
+}
+
+// Parse all CDC receive buffers that the host has sent, not only one buffer per main loop pass.
+// Parsing stops at a command boundary when the time budget is exhausted, so the main loop still services CAN and USB IN.
+// A Tx frame command that arrives while the CAN Tx buffer is full is held back in slcan_str and parsing stops.
+// The following commands stay in buf_cdc_rx and the host is throttled with NAK instead of losing a Tx frame with FBK_TxBufferFull.
+// All other commands are executed immediately, also while the CAN Tx buffer is full.
+void buf_process_cdc_rx()
+{
+    uint32_t start = system_get_timestamp();
+
+    if (cdc_cmd_held)
+    {
+        if (buf_can_tx.free_count == 0)
+            return;
+
+        cdc_cmd_held = false;
+        buf_execute_command();
+    }
+
+    // buf_cdc_rx.head is modified in the interrupt callback CDC_Receive_FS(), buf_cdc_rx.tail only here.
+    while (buf_cdc_rx.tail != buf_cdc_rx.head)
     {
-        // Process one whole buffer
-        for (uint32_t i = 0; i < buf_cdc_rx.msglen[buf_cdc_rx.tail]; i++)
-	    {
-            if (buf_cdc_rx.data[buf_cdc_rx.tail][i] == '\r')
-            {
-                control_parse_command((char*)slcan_str, slcan_str_index);
-                slcan_str_index = 0;
-            }
-            else
-            {
-                // Check for overflow of buffer
-                if (slcan_str_index >= SLCAN_MTU)
-                {
-                    // TODO: Return here and discard this CDC buffer?
-                    slcan_str_index = 0;
-                }
-                slcan_str[slcan_str_index++] = buf_cdc_rx.data[buf_cdc_rx.tail][i];
-            }
+        uint32_t tail = buf_cdc_rx.tail;
+        while (cdc_rx_pos < buf_cdc_rx.msglen[tail])
+        {
+            // Only interrupt between two commands. A partially received command is always completed.
+            if (slcan_str_index == 0 && system_get_timestamp() - start >= BUF_CDC_RX_BUDGET_US)
+                return;
+
+            buf_parse_byte(buf_cdc_rx.data[tail][cdc_rx_pos++]);
+            if (cdc_cmd_held)
+                return;
         }
 
         // Move on to next buffer
-        system_disable_irq();
-        buf_cdc_rx.tail = (buf_cdc_rx.tail + 1) % BUF_CDC_RX_NUM_BUFS;
-        system_enable_irq();
+        cdc_rx_pos = 0;
+        __DMB(); // the buffer must be completely read before the interrupt can reuse it
+        buf_cdc_rx.tail = (tail + 1) % BUF_CDC_RX_NUM_BUFS;
+
+        // If CDC_Receive_FS() has left the OUT endpoint NAKing, accept data from the host again.
+        CDC_ResumeReceive();
+    }
+}
+
+// Credit mode ("MC"): sliding window flow control for Tx frames.
+// Enabling credit mode grants BUF_CAN_TXQUEUE_LEN credits to the host. Each Tx frame command costs one credit.
+// The firmware returns the credits with the event "Cxx\r" (xx = hex count) when frames have moved from buf_can_tx
+// into the CAN Tx FIFO, when a Tx frame command has failed, or when the buffer has been cleared.
+// Reporting freed slots instead of the absolute free count is immune to frames that are still travelling over USB.
+// So the host can keep the buffer topped up without waiting for each feedback and without ever getting FBK_TxBufferFull.
+void buf_report_credit()
+{
+    if ((USER_Flags & USR_Credit) == 0)
+    {
+        credit_returned = 0;
+        return;
     }
 
-    // Process CDC transmit buffer
-    uint32_t new_head = (buf_cdc_tx.head + 1) % BUF_CDC_TX_NUM_BUFS;
-    if (new_head != buf_cdc_tx.tail)
+    bool tx_empty = buf_can_tx.queue.count == 0;
+    if (credit_returned == 0 || (credit_returned < BUF_CREDIT_STEP && !tx_empty))
+        return;
+
+    char report[4];
+    report[0] = 'C';
+    hex_encode_byte(report + 1, (uint8_t)credit_returned);
+    report[3] = '\r';
+    buf_enqueue_cdc(report, 4);
+    credit_returned = 0;
+}
+
+// Called when a Tx frame command has failed or when the host enables credit mode
+void buf_return_credit(uint32_t count)
+{
+    credit_returned += count;
+}
+
+// Pass the data in the CDC transmit ring to the IN endpoint.
+// Full USB packets are sent immediately. A remaining short packet is sent when no more data has arrived within
+// BUF_CDC_TX_DEADLINE_US. So a burst of Rx frames goes out in full packets and a single frame is not delayed longer.
+void buf_process_cdc_tx()
+{
+    static bool     short_waiting = false;
+    static uint32_t short_since   = 0;
+
+    if (CDC_IsTransmitBusy())
+        return;
+
+    // The previous transfer has completed --> free its bytes
+    buf_cdc_tx.tail    = (buf_cdc_tx.tail + buf_cdc_tx.sending) % BUF_CDC_TX_SIZE;
+    buf_cdc_tx.sending = 0;
+
+    uint32_t pending = (buf_cdc_tx.head - buf_cdc_tx.tail + BUF_CDC_TX_SIZE) % BUF_CDC_TX_SIZE;
+    if (pending == 0)
+        return;
+
+    // A transfer must be contiguous --> stop at the end of the ring
+    uint32_t chunk = MIN(pending, BUF_CDC_TX_SIZE - buf_cdc_tx.tail);
+    chunk = MIN(chunk, BUF_CDC_TX_MAX_CHUNK);
+
+    if (chunk >= CDC_DATA_FS_MAX_PACKET_SIZE)
     {
-        if (0 < buf_cdc_tx.msglen[buf_cdc_tx.head])
+        chunk -= chunk % CDC_DATA_FS_MAX_PACKET_SIZE;
+    }
+    else if (chunk == pending) // less than one packet is available
+    {
+        uint32_t now = system_get_timestamp();
+        if (!short_waiting)
         {
-            buf_cdc_tx.head = new_head;
-            buf_cdc_tx.msglen[new_head] = 0;
+            short_waiting = true;
+            short_since   = now;
+            return;
         }
+        if (now - short_since < BUF_CDC_TX_DEADLINE_US)
+            return;
     }
-    
-    system_disable_irq();
-    uint32_t new_tail = (buf_cdc_tx.tail + 1) % BUF_CDC_TX_NUM_BUFS;
-    if (new_tail != buf_cdc_tx.head)
+    short_waiting = false;
+
+    // The Rx frames that end in this transfer are measured when it has completed (see latency.c)
+    latency_begin_transfer(buf_cdc_tx.written - pending + chunk);
+
+    if (CDC_Transmit_FS((uint8_t*)&buf_cdc_tx.data[buf_cdc_tx.tail], chunk) == USBD_OK)
+        buf_cdc_tx.sending = chunk;
+}
+
+// Process one byte received from the host
+void buf_parse_byte(uint8_t byte)
+{
+    // The mode may change within the same buffer when the command "MB" or "C" is executed.
+    if (USER_Flags & USR_Binary)
+    {
+        buf_parse_record_byte(byte);
+    }
+    else if (byte == '\r')
+    {
+        if (buf_can_tx.free_count == 0 && buf_is_frame_command())
+            cdc_cmd_held = true; // see buf_process_cdc_rx()
+        else
+            buf_execute_command();
+    }
+    else
     {
-        if (CDC_Transmit_FS((uint8_t *)buf_cdc_tx.data[new_tail], buf_cdc_tx.msglen[new_tail]) == USBD_OK)
+        // Check for overflow of buffer
+        if (slcan_str_index >= SLCAN_MTU)
         {
-            buf_cdc_tx.tail = new_tail;
+            // TODO: Return here and discard this CDC buffer?
+            slcan_str_index = 0;
         }
+        slcan_str[slcan_str_index++] = byte;
     }
-    system_enable_irq();
+}
 
-    // Process can transmit buffer
-    while ((buf_can_tx.send != buf_can_tx.head || buf_can_tx.full) && (HAL_FDCAN_GetTxFifoFreeLevel(can_get_handle()) > 0))
+// Binary mode: collect the bytes of one record in slcan_str. The first byte is the size of the record.
+// When the record is complete it is passed to control_parse_record().
+void buf_parse_record_byte(uint8_t byte)
+{
+    // The record must fit into slcan_str including the zero termination of a command string.
+    if (slcan_str_index == 0 && (byte < sizeof(kHeader) || byte >= SLCAN_MTU))
     {
-        // Transmit can frame
-        can_send_packet(&buf_can_tx.header[buf_can_tx.send], buf_can_tx.data[buf_can_tx.send]);
-        
-        // At this point the Tx packet is in the CAN Tx FIFO, but it has not yet been transmitted to CAN bus.
+        // The host has sent an invalid record size or the stream is out of sync --> skip the byte.
+        error_assert(APP_CanTxFail, false);
+        return;
+    }
+
+    slcan_str[slcan_str_index++] = byte;
+    if (slcan_str_index == slcan_str[0])
+    {
+        if (buf_can_tx.free_count == 0 && buf_is_frame_command())
+            cdc_cmd_held = true; // see buf_process_cdc_rx()
+        else
+            buf_execute_command();
+    }
+}
+
+// Execute the complete command or record in slcan_str
+void buf_execute_command()
+{
+    uint32_t len = slcan_str_index;
+    slcan_str_index = 0;
 
-        buf_can_tx.send = (buf_can_tx.send + 1) % BUF_CAN_TXQUEUE_LEN;
-        buf_can_tx.tail = (buf_can_tx.tail + 1) % BUF_CAN_TXQUEUE_LEN;
-        buf_can_tx.full = 0;
+    if (USER_Flags & USR_Binary) control_parse_record(slcan_str);
+    else                         control_parse_command((char*)slcan_str, len);
+}
+
+// returns true if the complete command or record in slcan_str sends a CAN frame ("t", "T", "r", "R", "d", "D", "b", "B" or MSG_TxFrame)
+bool buf_is_frame_command()
+{
+    char cmd = (char)slcan_str[0];
+    if (USER_Flags & USR_Binary)
+    {
+        kHeader* header = (kHeader*)slcan_str;
+        if (header->msg_type == MSG_TxFrame)
+            return true;
+
+        if (header->msg_type != MSG_String || header->size <= sizeof(kStringElmue))
+            return false;
+
+        cmd = ((kStringElmue*)slcan_str)->ascii_msg[0];
     }
-    
-    // report buffer full always --> green + blue LED are permanently ON
-    if (buf_can_tx.full)
-        error_assert(APP_CanTxOverflow, false);
+    else if (slcan_str_index == 0)
+    {
+        return false;
+    }
+    return cmd != 0 && strchr("tTrRdDbB", cmd) != NULL;
 }
 
 // Enqueue data for transmission over USB CDC to host 
+// In binary mode the ASCII response is packed into a MSG_String record.
 void buf_enqueue_cdc(char* buf, uint16_t len)
 {
-    if (BUF_CDC_TX_BUF_SIZE - len < buf_cdc_tx.msglen[buf_cdc_tx.head])
+    uint16_t head_len = (USER_Flags & USR_Binary) ? sizeof(kHeader) : 0;
+    if (buf_get_cdc_free() < head_len + len)
     {
         error_assert(APP_UsbInOverflow, false); // The data does not fit in the buffer
+        bufstats_drop(DRP_HostFull, 1);
+        return;
     }
-    else
+
+    if (head_len > 0)
     {
-        // Copy data
-        memcpy((uint8_t *)&buf_cdc_tx.data[buf_cdc_tx.head][buf_cdc_tx.msglen[buf_cdc_tx.head]], buf, len);
-        buf_cdc_tx.msglen[buf_cdc_tx.head] += len;
+        kStringElmue record;
+        record.header.size     = sizeof(kStringElmue) + len;
+        record.header.msg_type = MSG_String;
+        buf_write_cdc((uint8_t*)&record, head_len);
     }
+
+    // Copy data
+    buf_write_cdc((uint8_t*)buf, len);
+}
+
+// Copy data into the CDC transmit ring. The caller has checked that there is enough space.
+void buf_write_cdc(const uint8_t* src, uint32_t len)
+{
+    uint32_t first = MIN(len, BUF_CDC_TX_SIZE - buf_cdc_tx.head);
+    memcpy((uint8_t*)&buf_cdc_tx.data[buf_cdc_tx.head], src, first);
+    memcpy((uint8_t*)buf_cdc_tx.data, src + first, len - first);
+    buf_cdc_tx.head = (buf_cdc_tx.head + len) % BUF_CDC_TX_SIZE;
+    buf_cdc_tx.written += len;
+    bufstats_level(QUE_Host, BUF_CDC_TX_SIZE - 1 - buf_get_cdc_free());
+}
+
+// Returns the free bytes in the CDC transmit ring.
+// One byte stays unused, otherwise a full ring could not be distinguished from an empty ring.
+uint32_t buf_get_cdc_free()
+{
+    return (buf_cdc_tx.tail - buf_cdc_tx.head - 1 + BUF_CDC_TX_SIZE) % BUF_CDC_TX_SIZE;
 }
 
 // Get destination pointer of cdc buffer (Start position of write access)
+// The caller may write up to SLCAN_MTU bytes. Bytes written behind the end of the ring land in the spill area.
 uint8_t *buf_get_cdc_dest()
 {
-    if (BUF_CDC_TX_BUF_SIZE - SLCAN_MTU < buf_cdc_tx.msglen[buf_cdc_tx.head])
+    if (buf_get_cdc_free() < SLCAN_MTU)
     {
         error_assert(APP_UsbInOverflow, false); // The data will not fit in the buffer
+        bufstats_drop(DRP_HostFull, 1); // the caller discards the message
         return NULL;
     }
-    return (uint8_t *)&buf_cdc_tx.data[buf_cdc_tx.head][buf_cdc_tx.msglen[buf_cdc_tx.head]];
+    return (uint8_t *)&buf_cdc_tx.data[buf_cdc_tx.head];
 }
 
 // Send the data bytes in destination area over USB CDC to host
 void buf_comit_cdc_dest(uint32_t len)
 {
-    buf_cdc_tx.msglen[buf_cdc_tx.head] += len;
+    // Move the bytes from the spill area to the start of the ring
+    uint32_t end = buf_cdc_tx.head + len;
+    if (end > BUF_CDC_TX_SIZE)
+        memcpy((uint8_t*)buf_cdc_tx.data, (uint8_t*)&buf_cdc_tx.data[BUF_CDC_TX_SIZE], end - BUF_CDC_TX_SIZE);
+
+    buf_cdc_tx.head = end % BUF_CDC_TX_SIZE;
+    buf_cdc_tx.written += len;
+    bufstats_level(QUE_Host, BUF_CDC_TX_SIZE - 1 - buf_get_cdc_free());
 }
 
 // Get destination pointer of can tx frame header
 FDCAN_TxHeaderTypeDef *buf_get_can_dest_header()
 {
-    if (buf_can_tx.full)
+    if (buf_can_tx.free_count == 0)
     {
         error_assert(APP_CanTxOverflow, false);
         return NULL;
     }
-    return &buf_can_tx.header[buf_can_tx.head];
+    return &can_dest_header;
 }
 
 // Get destination pointer of can tx frame data bytes
 uint8_t *buf_get_can_dest_data()
 {
-    if (buf_can_tx.full)
+    if (buf_can_tx.free_count == 0)
     {
         error_assert(APP_CanTxOverflow, false);
         return NULL;
     }
-    return buf_can_tx.data[buf_can_tx.head];
+    return buf_can_tx.data[buf_can_tx.free[buf_can_tx.free_count - 1]];
 }
 
 // Append the message in destination slot to the buffer.
@@ -184,29 +418,75 @@ eFeedback buf_comit_can_dest()
     if (e_Feedback != FBK_Success)
         return e_Feedback;
     
-    if (buf_can_tx.full)
+    if (buf_can_tx.free_count == 0)
     {
         error_assert(APP_CanTxOverflow, false);
         return FBK_TxBufferFull;
     }
 
-    // Increment the head pointer
-    buf_can_tx.head = (buf_can_tx.head + 1) % BUF_CAN_TXQUEUE_LEN;
-    if (buf_can_tx.head == buf_can_tx.tail) 
-        buf_can_tx.full = 1;
-    
+    // The sequence restarts whenever the queue is empty, so it practically never rolls over.
+    if (buf_can_tx.queue.count == 0)
+        buf_can_tx.sequence = 0;
+
+    // Move the slot from the free stack into the queue
+    uint8_t  slot = buf_can_tx.free[-- buf_can_tx.free_count];
+    uint64_t key  = buf_can_tx.sequence ++;
+    if (USER_Flags & USR_TxPriority)
+    {
+        uint32_t priority = can_get_tx_priority(can_dest_header.Identifier, can_dest_header.IdType == FDCAN_EXTENDED_ID,
+                                                can_dest_header.TxFrameType == FDCAN_REMOTE_FRAME);
+        key |= (uint64_t)priority << 32;
+    }
+
+    kTxSlotHeader* slot_header = &buf_can_tx.header[slot];
+    slot_header->identifier = can_dest_header.Identifier;
+    slot_header->dlc        = (uint8_t)can_dest_header.DataLength;
+    slot_header->marker     = (uint8_t)can_dest_header.MessageMarker;
+    slot_header->flags      = 0;
+    if (can_dest_header.IdType              == FDCAN_EXTENDED_ID)     slot_header->flags |= TXS_Extended;
+    if (can_dest_header.TxFrameType         == FDCAN_REMOTE_FRAME)    slot_header->flags |= TXS_Remote;
+    if (can_dest_header.ErrorStateIndicator == FDCAN_ESI_PASSIVE)     slot_header->flags |= TXS_Passive;
+    if (can_dest_header.BitRateSwitch       == FDCAN_BRS_ON)          slot_header->flags |= TXS_BRS;
+    if (can_dest_header.FDFormat            == FDCAN_FD_CAN)          slot_header->flags |= TXS_FD;
+    if (can_dest_header.TxEventFifoControl  == FDCAN_STORE_TX_EVENTS) slot_header->flags |= TXS_TxEvent;
+
+    txheap_push(&buf_can_tx.queue, key, slot);
+    bufstats_level(QUE_CanTx, buf_can_tx.queue.count);
     return FBK_Success;
 }
 
+// Restore the HAL header of a waiting Tx frame
+void buf_unpack_tx_header(kTxSlotHeader* slot_header, FDCAN_TxHeaderTypeDef* tx_header)
+{
+    uint8_t flags = slot_header->flags;
+    tx_header->Identifier          = slot_header->identifier;
+    tx_header->DataLength          = slot_header->dlc;
+    tx_header->MessageMarker       = slot_header->marker;
+    tx_header->IdType              = (flags & TXS_Extended) ? FDCAN_EXTENDED_ID     : FDCAN_STANDARD_ID;
+    tx_header->TxFrameType         = (flags & TXS_Remote)   ? FDCAN_REMOTE_FRAME    : FDCAN_DATA_FRAME;
+    tx_header->ErrorStateIndicator = (flags & TXS_Passive)  ? FDCAN_ESI_PASSIVE     : FDCAN_ESI_ACTIVE;
+    tx_header->BitRateSwitch       = (flags & TXS_BRS)      ? FDCAN_BRS_ON          : FDCAN_BRS_OFF;
+    tx_header->FDFormat            = (flags & TXS_FD)       ? FDCAN_FD_CAN          : FDCAN_CLASSIC_CAN;
+    tx_header->TxEventFifoControl  = (flags & TXS_TxEvent)  ? FDCAN_STORE_TX_EVENTS : FDCAN_NO_TX_EVENTS;
+}
+
 // ===========================================================================
 
 // a RX packet has been received from CAN bus or a Tx Packet has been successfully sent to CAN bus
 // frame_data is a 64 byte buffer with the received / sent data bytes
-void buf_store_rx_packet(FDCAN_RxHeaderTypeDef *rx_header, uint8_t *frame_data)
+// timestamp is the 1 s time of the start of frame on CAN bus
+void buf_store_rx_packet(FDCAN_RxHeaderTypeDef *rx_header, uint8_t *frame_data, uint32_t timestamp)
 {
     uint8_t *buf = buf_get_cdc_dest();
     if (buf == NULL) 
         return; // buffer is full
+
+    if (USER_Flags & USR_Binary)
+    {
+        buf_store_rx_record((kRxFrameElmue*)buf, rx_header, frame_data);
+        latency_tag(buf_cdc_tx.written, timestamp);
+        return;
+    }
     
     if (rx_header->FDFormat == FDCAN_CLASSIC_CAN)
     {
@@ -227,28 +507,19 @@ void buf_store_rx_packet(FDCAN_RxHeaderTypeDef *rx_header, uint8_t *frame_data)
     }
     
     // Add identifier 
-    uint32_t ident = rx_header->Identifier;    
-    for (uint8_t j = id_len; j > 0; j--)
-    {
-        buf[j] = utils_nibble_to_ascii(ident & 0xF);
-        ident >>= 4;
-    }
-    uint8_t pos = 1 + id_len;
+    char* dest = hex_encode_value((char*)buf + 1, rx_header->Identifier, id_len);
     
     // Add DLC
     uint32_t dlc_code = rx_header->DataLength;
-    buf[pos++]        = utils_nibble_to_ascii(dlc_code);
+    dest = hex_encode_value(dest, dlc_code, 1);
 
     // Add data bytes (not for remote frames)
     if (rx_header->RxFrameType != FDCAN_REMOTE_FRAME)
     {
         int8_t byte_count = utils_dlc_to_byte_count(dlc_code); // returns -1 if invalid
-        for (uint8_t j = 0; j < byte_count; j++)
-        {
-            buf[pos++] = utils_nibble_to_ascii(frame_data[j] >> 4);
-            buf[pos++] = utils_nibble_to_ascii(frame_data[j] & 0x0F);
-        }
+        dest = hex_encode_bytes(dest, frame_data, byte_count);
     }
+    uint8_t pos = dest - (char*)buf;
     
     if (USER_Flags & USR_ReportESI) // Append ESI Error Passive status if enabled by the user
     {
@@ -259,6 +530,47 @@ void buf_store_rx_packet(FDCAN_RxHeaderTypeDef *rx_header, uint8_t *frame_data)
 
     buf[pos++] = '\r';
     buf_comit_cdc_dest(pos);
+    latency_tag(buf_cdc_tx.written, timestamp);
+}
+
+// Binary mode: store a MSG_RxFrame record for a packet received from CAN bus
+void buf_store_rx_record(kRxFrameElmue* record, FDCAN_RxHeaderTypeDef *rx_header, uint8_t *frame_data)
+{
+    uint32_t can_id = rx_header->Identifier;
+    if (rx_header->IdType == FDCAN_EXTENDED_ID)
+        can_id |= CAN_ID_29Bit;
+
+    uint8_t flags = 0;
+    if (rx_header->FDFormat == FDCAN_FD_CAN)
+    {
+        flags |= FRM_FDF;
+        if (rx_header->BitRateSwitch == FDCAN_BRS_ON)
+            flags |= FRM_BRS;
+
+        // Report ESI Error Passive status if enabled by the user
+        if ((USER_Flags & USR_ReportESI) && rx_header->ErrorStateIndicator == FDCAN_ESI_PASSIVE)
+            flags |= FRM_ESI;
+    }
+
+    uint8_t byte_count;
+    if (rx_header->RxFrameType == FDCAN_REMOTE_FRAME)
+    {
+        // For remote frames the DLC from the Rx packet is transmitted in the first data byte to the host.
+        can_id |= CAN_ID_RTR;
+        record->data_start[0] = rx_header->DataLength;
+        byte_count = 1;
+    }
+    else
+    {
+        byte_count = utils_dlc_to_byte_count(rx_header->DataLength);
+        memcpy(record->data_start, frame_data, byte_count);
+    }
+
+    record->header.size     = sizeof(kRxFrameElmue) + byte_count;
+    record->header.msg_type = MSG_RxFrame;
+    record->flags           = flags;
+    record->can_id          = can_id;
+    buf_comit_cdc_dest(record->header.size);
 }
 
 // Send the same message marker to the host that has been sent4 with the Tx packet
@@ -268,6 +580,43 @@ void buf_store_tx_echo(FDCAN_TxEventFifoTypeDef* tx_event)
     if (buf == NULL) 
         return; // buffer is full
 
-    sprintf(buf, "M%02X\r", (uint8_t)tx_event->MessageMarker);
+    if (USER_Flags & USR_Binary)
+    {
+        kTxEchoElmue* record    = (kTxEchoElmue*)buf;
+        record->header.size     = sizeof(kTxEchoElmue);
+        record->header.msg_type = MSG_TxEcho;
+        record->marker          = (uint8_t)tx_event->MessageMarker;
+        buf_comit_cdc_dest(sizeof(kTxEchoElmue));
+        return;
+    }
+
+    buf[0] = 'M';
+    hex_encode_byte(buf + 1, (uint8_t)tx_event->MessageMarker);
+    buf[3] = '\r';
     buf_comit_cdc_dest(4);
+}
+
+// ISO-TP: pass a chunk of a received PDU to the host (see isotp.c)
+// The first chunk contains the PDU length in 3 hex digits: "i00A0102030405060708\r" (10 bytes, 8 bytes in this chunk)
+// The following chunks start with a plus: "i+090A\r"
+// pdu_length = the length of the PDU for the first chunk, 0 for the following chunks
+// returns false if the CDC buffer is full, isotp_process() will try again later.
+// One SLCAN_MTU is kept free, so the Rx packets and responses do not get lost while a long PDU is passed to the host.
+bool buf_store_isotp_data(const uint8_t* data, uint32_t count, uint32_t pdu_length)
+{
+    char  chunk[1 + 3 + 2 * ISOTP_CHUNK_SIZE + 1];
+    char* dest = chunk;
+    *dest++ = 'i';
+    if (pdu_length > 0) dest = hex_encode_value(dest, pdu_length, 3);
+    else                *dest++ = '+';
+
+    dest = hex_encode_bytes(dest, data, count);
+    *dest++ = '\r';
+
+    uint32_t len = dest - chunk;
+    if (buf_get_cdc_free() < sizeof(kHeader) + len + SLCAN_MTU)
+        return false;
+
+    buf_enqueue_cdc(chunk, len);
+    return true;
 }
\ No newline at end of file
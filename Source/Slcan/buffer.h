@@ -7,6 +7,7 @@
 #pragma once
 #include "can.h"
 #include "usb_class.h"
+#include "txheap.h"
 
 // Maximum command buffer len (z/Z plus frame 138 plus timestamp 8 plus ESI plus \r plus some padding
 #define SLCAN_MTU (1 + 138 + 8 + 1 + 1 + 16) 
@@ -14,46 +15,75 @@
 // CDC receive buffering
 #define BUF_CDC_RX_NUM_BUFS    8
 #define BUF_CDC_RX_BUF_SIZE    CDC_DATA_FS_MAX_PACKET_SIZE // = 64 Size of RX buffer item
+#define BUF_CDC_RX_BUDGET_US   200  // maximum microseconds that buf_process() spends parsing commands in one main loop pass
 
 // CDC transmit buffering (packets + debug messages)
-#define BUF_CDC_TX_NUM_BUFS    3
-#define BUF_CDC_TX_BUF_SIZE    4096 // Set to 64 * 64 for max single packet size
+// A 12 kB ring would absorb longer USB stalls, but it does not fit into the 32 kB RAM next to the cyclic table.
+#define BUF_CDC_TX_SIZE        (96  * CDC_DATA_FS_MAX_PACKET_SIZE) // = 6144 byte ring
+#define BUF_CDC_TX_MAX_CHUNK   (16  * CDC_DATA_FS_MAX_PACKET_SIZE) // maximum bytes in one USB IN transfer
+#define BUF_CDC_TX_DEADLINE_US 100  // maximum microseconds that less than one USB packet waits for more data
 
 // CAN transmit buffering
 #define BUF_CAN_TXQUEUE_LEN    64   // Number of buffers allocated
 #define CAN_MAX_DATALEN        64   // CAN maximum data length. Must be 64 for canfd.
+#define BUF_CREDIT_STEP        8    // credit mode: report freed Tx slots when at least 8 are available or the buffer is empty
 
 // Receive buffering: circular buffer FIFO
 // buf_cdc_rx is written in the interrupt handler CDC_Receive_FS() where ASCII characters are received
 // when a Crarriage Return is found they are passed to control_parse_command()
+// When all buffers are full the OUT endpoint is not re-armed (paused) and the host gets NAK until buf_process() frees a buffer.
 struct buf_cdc_rx
 {
 	uint8_t  data  [BUF_CDC_RX_NUM_BUFS][BUF_CDC_RX_BUF_SIZE];
 	uint32_t msglen[BUF_CDC_RX_NUM_BUFS];
 	uint32_t head;
 	uint32_t tail;
+	bool     paused;
 };
 
-// Transmit buffering: triple buffers
-// buf_cdc_tx is written in buf_enqueue_cdc() when the firmware sends ASCII characters to the host
+// Transmit buffering: circular byte buffer
+// buf_cdc_tx is written in buf_enqueue_cdc() and buf_comit_cdc_dest() when the firmware sends ASCII characters to the host
+// and read in buf_process() which passes the data to the IN endpoint as soon as one USB packet is available.
+// The SLCAN_MTU bytes behind the ring are a spill area, so buf_get_cdc_dest() can always return a contiguous destination.
 struct buf_cdc_tx
 {
-	uint8_t  data  [BUF_CDC_TX_NUM_BUFS][BUF_CDC_TX_BUF_SIZE];
-	uint32_t msglen[BUF_CDC_TX_NUM_BUFS];
-	uint32_t head;
-	uint32_t tail;
+	uint8_t  data[BUF_CDC_TX_SIZE + SLCAN_MTU];
+	uint32_t head;    // write position
+	uint32_t tail;    // start of the data that has not yet been transmitted completely
+	uint32_t sending; // byte count of the running IN transfer that starts at tail
+	uint32_t written; // free running count of bytes written into the ring (positions for latency.c)
 };
 
-// Cirbuf structure for CAN TX frames
+typedef enum // 8 bit
+{
+    TXS_Extended = 0x01, // FDCAN_EXTENDED_ID
+    TXS_Remote   = 0x02, // FDCAN_REMOTE_FRAME
+    TXS_Passive  = 0x04, // FDCAN_ESI_PASSIVE
+    TXS_BRS      = 0x08, // FDCAN_BRS_ON
+    TXS_FD       = 0x10, // FDCAN_FD_CAN
+    TXS_TxEvent  = 0x20, // FDCAN_STORE_TX_EVENTS
+} eTxSlotFlags;
+
+// The header of a waiting Tx frame packed into 8 bytes instead of the 36 bytes of FDCAN_TxHeaderTypeDef
+typedef struct
+{
+    uint32_t identifier;
+    uint8_t  dlc;       // DLC code 0...15
+    uint8_t  flags;     // eTxSlotFlags
+    uint8_t  marker;    // MessageMarker
+} kTxSlotHeader;
+
+// Buffer for CAN TX frames
 // buf_can_tx is written in control_parse_command() -> buf_comit_can_dest() when a frame has been received from the host
+// The waiting frames are ordered in a heap: in FIFO order by default, in CAN bus priority order with "MP" (see txheap.h)
 struct buf_can_tx
 {
-    FDCAN_TxHeaderTypeDef header[BUF_CAN_TXQUEUE_LEN];   // Header buffer
+    kTxSlotHeader header[BUF_CAN_TXQUEUE_LEN];           // Header buffer
     uint8_t  data[BUF_CAN_TXQUEUE_LEN][CAN_MAX_DATALEN]; // Data buffer
-    uint16_t head;                                       // Head pointer
-    uint16_t send;                                       // Send pointer
-    uint16_t tail;                                       // Tail pointer
-    uint8_t  full;                                       // Set this when we are full, clear when the tail moves one.
+    uint8_t  free[BUF_CAN_TXQUEUE_LEN];                  // Stack of the unused slot indexes
+    uint32_t free_count;                                 // Count of unused slots. Zero means the buffer is full.
+    kTxHeap  queue;                                      // Slots waiting for the CAN Tx FIFO
+    uint32_t sequence;                                   // Incremented for each frame, keeps the order of frames with the same CAN ID
 };
 
 extern volatile struct buf_cdc_tx buf_cdc_tx;
@@ -70,7 +100,10 @@ FDCAN_TxHeaderTypeDef *buf_get_can_dest_header();
 uint8_t *buf_get_can_dest_data();
 eFeedback buf_comit_can_dest();
 void buf_clear_can_buffer();
+uint32_t buf_get_can_count();
+void buf_return_credit(uint32_t count);
 void buf_store_tx_echo(FDCAN_TxEventFifoTypeDef* tx_event);
-void buf_store_rx_packet(FDCAN_RxHeaderTypeDef *frame_header, uint8_t *frame_data);
+void buf_store_rx_packet(FDCAN_RxHeaderTypeDef *frame_header, uint8_t *frame_data, uint32_t timestamp);
+bool buf_store_isotp_data(const uint8_t* data, uint32_t count, uint32_t pdu_length);
 
 
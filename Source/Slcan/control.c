@@ -12,13 +12,39 @@
 #include "led.h"
 #include "dfu.h"
 #include "control.h"
+#include "slcan_def.h"
+#include "hexcodec.h"
+#include "cyclic.h"
+#include "isotp.h"
+#include "responder.h"
+#include "reduce.h"
+#include "busload.h"
+#include "idstats.h"
+#include "profiler.h"
+#include "latency.h"
+#include "bufstats.h"
 
 extern eUserFlags USER_Flags;
 
 uint32_t can_mode = FDCAN_MODE_NORMAL; // normal, silent, loopback modes
+bool     busload_precise = false;      // report the bus load with 4 decimals (command "L7,8")
 
 eFeedback control_parse_str (char buf[], int len);
 eFeedback control_set_filter(char buf[], uint8_t len);
+eFeedback control_set_mask_filters(char buf[]);
+eFeedback control_set_cyclic(char buf[], int len);
+eFeedback control_set_isotp (char buf[], int len);
+eFeedback control_send_isotp(char buf[], int len);
+eFeedback control_set_responder(char buf[], int len);
+eFeedback control_set_reduction(char buf[], int len);
+eFeedback control_id_statistics(char buf[], int len);
+eFeedback control_profiler(char buf[], int len);
+eFeedback control_latency(char buf[], int len);
+eFeedback control_queues(char buf[], int len);
+int       control_format_queues(char* resp, char prefix);
+eFeedback control_parse_frame(char buf[], int len, FDCAN_TxHeaderTypeDef* tx_header, uint8_t* tx_data, bool marker);
+eFeedback control_send_record(kTxFrameElmue* record);
+void      control_send_feedback(eFeedback e_Ret);
 
 // ==================================================================================================================
 
@@ -31,6 +57,48 @@ void control_init()
 void control_parse_command(char buf[], int len)
 {
     eFeedback e_Ret = control_parse_str(buf, len);
+
+    // Credit mode: a Tx frame command that has not been stored in the Tx buffer gives its credit back.
+    if (e_Ret != FBK_Success && len > 0 && buf[0] != 0 && strchr("tTrRdDbB", buf[0]) != NULL)
+    {
+        buf_return_credit(1);
+        bufstats_drop((e_Ret == FBK_TxBufferFull) ? DRP_CanTxFull : DRP_CanTxFail, 1);
+    }
+
+    control_send_feedback(e_Ret);
+}
+
+// Binary mode: execute a complete record that has been received from the host.
+// The record buffer has space for the zero termination of a command string.
+void control_parse_record(uint8_t* record)
+{
+    kHeader* header = (kHeader*)record;
+    switch (header->msg_type)
+    {
+        case MSG_String: // an ASCII command without '\r'
+            control_parse_command(((kStringElmue*)record)->ascii_msg, header->size - sizeof(kStringElmue));
+            break;
+        case MSG_TxFrame:
+        {
+            eFeedback e_Ret = control_send_record((kTxFrameElmue*)record);
+            if (e_Ret != FBK_Success)
+            {
+                buf_return_credit(1); // see control_parse_command()
+                bufstats_drop((e_Ret == FBK_TxBufferFull) ? DRP_CanTxFull : DRP_CanTxFail, 1);
+            }
+
+            control_send_feedback(e_Ret);
+            break;
+        }
+        default:
+            control_send_feedback(FBK_InvalidCommand);
+            break;
+    }
+}
+
+// Send the execution status of a command to the host if Feedback mode is enabled.
+void control_send_feedback(eFeedback e_Ret)
+{
     if ((USER_Flags & USR_Feedback) == 0)
         return;
 
@@ -99,6 +167,25 @@ eFeedback control_parse_str(char buf[], int len)
                 // Timestamps should be generated in the host application instead of slowing down the USB traffic.
                 switch (buf[i])
                 {
+                    case 'B': USER_Flags |=  USR_Binary;      break; // "MB"  Enable binary mode (see slcan_def.h)
+                    case 'b': USER_Flags &= ~USR_Binary;      break; // "Mb"  Return to ASCII mode
+                    case 'C':                                        // "MC"  Enable credit mode (see buf_report_credit())
+                        if (can_is_opened()) return FBK_AdapterMustBeClosed;
+                        if ((USER_Flags & USR_Credit) == 0)
+                        {
+                            USER_Flags |= USR_Credit;
+                            buf_return_credit(BUF_CAN_TXQUEUE_LEN); // the Tx buffer is empty while the adapter is closed
+                        }
+                        break;
+                    case 'c': USER_Flags &= ~USR_Credit;      break; // "Mc"  Disable credit mode
+                    case 'P':                                        // "MP"  Send Tx frames in priority order (see txheap.h)
+                        if (can_is_opened()) return FBK_AdapterMustBeClosed;
+                        USER_Flags |=  USR_TxPriority;
+                        break;
+                    case 'p':                                        // "Mp"  Send Tx frames in FIFO order
+                        if (can_is_opened()) return FBK_AdapterMustBeClosed;
+                        USER_Flags &= ~USR_TxPriority;
+                        break;
                     case 'A':                                        // "MA"  Enable Auto re-transmit (same as legacy "A1")
                         if (can_is_opened()) return FBK_AdapterMustBeClosed;
                         USER_Flags |=  USR_Retransmit; 
@@ -247,19 +334,54 @@ eFeedback control_parse_str(char buf[], int len)
             if (len == 1) return can_clear_filters(); // "f"
             return e_Ret;
 
+        // Set or remove a cyclic message that the firmware sends without involvement of the host (see cyclic.c)
+        case 'P':
+            return control_set_cyclic(buf, len); // "P3,10000,2500,0,8,t12380102030405060700"
+
+        // Open or close the ISO-TP channel that segments and reassembles PDUs in the firmware (see isotp.c)
+        case 'I':
+            return control_set_isotp(buf, len); // "It7E0,7E8,00,00"
+        // Send a chunk of an ISO-TP PDU
+        case 'i':
+            return control_send_isotp(buf, len); // "i0140102030405060708090A0B0C0D0E0F1011121314"
+
+        // Set or remove a response that the firmware sends automatically when a request is received (see responder.c)
+        case 'Q':
+            return control_set_responder(buf, len); // "Q0,7E0,7FF,023E,FFFF,0,0,0,t7E88027E005555555555"
+
+        // Set or remove a rule that reduces the Rx packets passed to the host (see reduce.c)
+        case 'G':
+            return control_set_reduction(buf, len); // "G0,000,000,1,1000"
+
+        // Enable or read the statistics of each CAN ID on the bus (see idstats.c)
+        case 'U':
+            return control_id_statistics(buf, len); // "U1", "U?", "U#0"
+
         // ----------------------------
 
-        // Enable bus load report in percent (the precision is approx +/- 10%)
+        // Enable bus load report in percent (see busload.c)
         // The firmware will send the current bus load in user defined intervals.
-        // Command "L7\r" --> send busload every 700 ms
+        // Command "L7\r"    --> send busload every 700 ms as integer percent "L27\r", averaged over 800 ms
+        // Command "L7,16\r" --> send busload every 700 ms as percent with 4 decimals "L27.0425\r", averaged over 1.6 seconds
         case 'L':
         {
             uint32_t interval;
+            uint32_t window = 0;
             int pos = 1;
-            if (!utils_parse_next_decimal(buf, &pos, 0, &interval)) // "L0", "L7", "L30"
-                return FBK_InvalidParameter;
+            if (utils_parse_next_decimal(buf, &pos, ',', &interval)) // "L7,16"
+            {
+                if (!utils_parse_next_decimal(buf, &pos, 0, &window) || window == 0)
+                    return FBK_InvalidParameter;
+            }
+            else
+            {
+                pos = 1;
+                if (!utils_parse_next_decimal(buf, &pos, 0, &interval)) // "L0", "L7", "L30"
+                    return FBK_InvalidParameter;
+            }
 
-            return can_enable_busload(interval); // interval in 100ms steps
+            busload_precise = (window > 0);
+            return busload_enable(interval, window); // interval and window in 100ms steps
         }
 
         // ----------------------------
@@ -290,64 +412,60 @@ eFeedback control_parse_str(char buf[], int len)
             }
             return FBK_InvalidParameter;
         }
-        // Debug command
+
+        // ----------------------------
+
+        // Profiler: execution time of the main loop stages and interrupts in CPU cycles (see profiler.c)
+        // Command "?1\r" --> reset and enable the profiler, "?0\r" --> disable the profiler
+        // Command "??\r" --> returns the count of stages and the CPU clock in MHz "+9,160\r"
+        // Command "?#0\r" --> returns the statistics of stage 0 "+Loop,count,min,avg,max,bin0,...,bin7\r"
         case '?':
-        {
-            return FBK_InvalidCommand;
-            /*
-            // This code was written by Nakanishi Kiyomaro.
-
-            char* dbgstr = (char*)buf_get_cdc_dest();
-            snprintf(dbgstr, SLCAN_MTU - 1, ">%02X-%02X-%01X-%04X%04X-%04X\r",
-                                        (uint8_t)(can_get_cycle_ave_time_ns() >= 255000 ? 255 : can_get_cycle_ave_time_ns() / 1000),
-                                        (uint8_t)(can_get_cycle_max_time_ns() >= 255000 ? 255 : can_get_cycle_max_time_ns() / 1000),
-                                        (uint8_t)(HAL_FDCAN_GetState(can_get_handle())),
-                                        (uint16_t)(HAL_FDCAN_GetError(can_get_handle()) >> 16),
-                                        (uint16_t)(HAL_FDCAN_GetError(can_get_handle()) & 0xFFFF),
-                                        (uint16_t)(error_get_register()));
-            buf_comit_cdc_dest(23);
-            */
-
-            /*
-            uint8_t cycle_ave = (uint8_t)(can_get_cycle_ave_time_ns() >= 255000 ? 255 : can_get_cycle_ave_time_ns() / 1000);
-            uint8_t cycle_max = (uint8_t)(can_get_cycle_max_time_ns() >= 255000 ? 255 : can_get_cycle_max_time_ns() / 1000);
-
-            char dbgstr[7];
-            dbgstr[0] = '>'; // debug message
-            dbgstr[1] = cycle_ave >> 4;
-            dbgstr[2] = cycle_ave & 0xF;
-            for (uint8_t j = 1; j <= 2; j++)
-            {
-                if (dbgstr[j] < 0xA) dbgstr[j] += 0x30;
-                else                 dbgstr[j] += 0x37;
-            }
-            dbgstr[3] = '-';
-            dbgstr[4] = cycle_max >> 4;
-            dbgstr[5] = cycle_max & 0xF;
-            for (uint8_t j = 4; j <= 5; j++)
-            {
-                if (dbgstr[j] < 0xA) dbgstr[j] += 0x30;
-                else                 dbgstr[j] += 0x37;
-            }
-            dbgstr[6] = '\r';
-            can_clear_cycle_time();
+            return control_profiler(buf, len);
 
-            buf_enqueue_cdc(dbgstr, 7);
-            return FBK_RetString;
-            */
-        }
+        // ----------------------------
+
+        // Latency from the start of an Rx frame on CAN bus until the USB transfer to the host has completed (see latency.c)
+        // Command "H0\r"    --> reset the histogram
+        // Command "H?\r"    --> returns "+count,merged,min,p50,p90,p99,p99.9,max\r" in microseconds
+        // Command "H%995\r" --> returns the 99.5 % percentile in microseconds "+870\r"
+        // Command "H#3\r"   --> returns the lower bound in microseconds and the count of bin 3 "+32,1520\r" or "+\r" after the last bin
+        case 'H':
+            return control_latency(buf, len);
+
+        // ----------------------------
+
+        // Queue statistics: drop counters and peak fill levels of all buffers (see bufstats.c)
+        // Command "W5\r" --> send the report "W0,0,0,0,0,0,0,3,2,1,4,260,1\r" every 500 ms while the adapter is open, "W0\r" --> off
+        // The report has the 7 drop counters (eDropReason) followed by the 6 peak levels (eQueue).
+        // Command "W?\r" --> returns the same values immediately "+0,0,0,0,0,0,0,3,2,1,4,260,1\r"
+        // Command "WS\r" --> returns the capacity of the 6 queues "+64,3,3,32,6143,7\r"
+        // Command "WC\r" --> clear the drop counters and peak levels
+        case 'W':
+            return control_queues(buf, len);
     }
 
     // ================ Transmit Packet =================
     // "t600801020304050607083A\r"
 
-    // Set default header. All values overridden below as needed.
     FDCAN_TxHeaderTypeDef* tx_header = buf_get_can_dest_header();
     uint8_t*               tx_data   = buf_get_can_dest_data();
 
     if (tx_header == NULL || tx_data == NULL)
         return FBK_TxBufferFull;
 
+    e_Ret = control_parse_frame(buf, len, tx_header, tx_data, USER_Flags & USR_ReportTX);
+    if (e_Ret != FBK_Success)
+        return e_Ret;
+
+    // Store the message in the buffer
+    return buf_comit_can_dest();
+}
+
+// Parse the ASCII commands "t", "T", "r", "R", "d", "D", "b", "B" into the Tx header and the data bytes.
+// marker = true --> the command ends with a 2 digit Tx echo marker ("MM")
+eFeedback control_parse_frame(char buf[], int len, FDCAN_TxHeaderTypeDef* tx_header, uint8_t* tx_data, bool marker)
+{
+    // Set default header. All values overridden below as needed.
     tx_header->TxFrameType         = FDCAN_DATA_FRAME;
     tx_header->FDFormat            = FDCAN_CLASSIC_CAN;
     tx_header->IdType              = FDCAN_STANDARD_ID;
@@ -410,8 +528,9 @@ eFeedback control_parse_str(char buf[], int len)
     uint8_t id_len = (tx_header->IdType == FDCAN_EXTENDED_ID) ? 8 : 3;
 
     // parse CAN ID
-    if (!utils_parse_hex_value(buf, &parse_loc, id_len, &tx_header->Identifier))
+    if (!hex_decode_value(buf + parse_loc, id_len, &tx_header->Identifier))
         return FBK_InvalidParameter;
+    parse_loc += id_len;
 
     // check CAN ID
     if (tx_header->IdType == FDCAN_STANDARD_ID && tx_header->Identifier > 0x7FF)
@@ -422,8 +541,9 @@ eFeedback control_parse_str(char buf[], int len)
 
     // parse DLC
     uint32_t dlc_code;
-    if (!utils_parse_hex_value(buf, &parse_loc, 1, &dlc_code))
+    if (!hex_decode_value(buf + parse_loc, 1, &dlc_code))
         return FBK_InvalidParameter;
+    parse_loc += 1;
 
     // classic frames allow a DLC of 0...8
     if (tx_header->FDFormat == FDCAN_CLASSIC_CAN && dlc_code > 8)
@@ -435,30 +555,104 @@ eFeedback control_parse_str(char buf[], int len)
     if (tx_header->TxFrameType != FDCAN_REMOTE_FRAME)
     {
         int8_t byte_count = utils_dlc_to_byte_count(dlc_code);
-        // Parse data bytes
-        for (uint8_t i = 0; i < byte_count && parse_loc < len; i++)
-        {
-            uint32_t byte_val;
-            if (!utils_parse_hex_value(buf, &parse_loc, 2, &byte_val))
-                return FBK_InvalidParameter;
+        // Parse data bytes. The host may send less data bytes than the DLC specifies.
+        // An odd count of characters reads the zero termination, which is invalid.
+        int avail = (len - parse_loc + 1) / 2;
+        if (byte_count > avail)
+            byte_count = avail;
 
-            tx_data[i] = byte_val;
-        }
+        if (!hex_decode_bytes(buf + parse_loc, tx_data, byte_count))
+            return FBK_InvalidParameter;
+        parse_loc += 2 * byte_count;
     }
 
     // The host must generate a unique one-byte marker for each sent packet using a counter that increments with each Tx message.
     // The Tx FIFO can store 3 packets and the buffer can store 64 waiting messages.
     // So 3 + 64 different values are sufficient that each message that is waiting for an ACK has it's own unique marker.
-    if (USER_Flags & USR_ReportTX)
+    if (marker)
     {
-        if (!utils_parse_hex_value(buf, &parse_loc, 2, &tx_header->MessageMarker))
+        if (!hex_decode_value(buf + parse_loc, 2, &tx_header->MessageMarker))
             return FBK_InvalidParameter;
+        parse_loc += 2;
     }
 
     // If there are any remaining bytes at the end, this is a syntax error.
     if (parse_loc != len)
         return FBK_InvalidParameter;
 
+    return FBK_Success;
+}
+
+// Binary mode: store a MSG_TxFrame record in the buffer to be sent to CAN bus.
+// This is the binary equivalent of the ASCII commands "t", "T", "r", "R", "d", "D", "b", "B".
+eFeedback control_send_record(kTxFrameElmue* record)
+{
+    if (record->header.size < sizeof(kTxFrameElmue))
+        return FBK_InvalidParameter;
+
+    int byte_count = record->header.size - sizeof(kTxFrameElmue);
+    if (byte_count > CAN_MAX_DATALEN)
+        return FBK_InvalidParameter;
+
+    FDCAN_TxHeaderTypeDef* tx_header = buf_get_can_dest_header();
+    uint8_t*               tx_data   = buf_get_can_dest_data();
+
+    if (tx_header == NULL || tx_data == NULL)
+        return FBK_TxBufferFull;
+
+    tx_header->TxFrameType         = FDCAN_DATA_FRAME;
+    tx_header->FDFormat            = FDCAN_CLASSIC_CAN;
+    tx_header->IdType              = FDCAN_STANDARD_ID;
+    tx_header->BitRateSwitch       = FDCAN_BRS_OFF;
+    tx_header->ErrorStateIndicator = can_is_passive() ? FDCAN_ESI_PASSIVE : FDCAN_ESI_ACTIVE;
+    tx_header->TxEventFifoControl  = FDCAN_STORE_TX_EVENTS; // always! Tx Event flashes the green LED
+    tx_header->MessageMarker       = record->marker;
+
+    // An ID that does not fit into 11 or 29 bits is an error, like in the ASCII commands. It must not be truncated.
+    uint32_t can_id = record->can_id;
+    uint32_t id_bits = can_id & ~(CAN_ID_29Bit | CAN_ID_RTR);
+    if (can_id & CAN_ID_29Bit)
+    {
+        if (id_bits > CAN_MASK_29)
+            return FBK_InvalidParameter;
+
+        tx_header->IdType = FDCAN_EXTENDED_ID;
+    }
+    else if (id_bits > CAN_MASK_11)
+        return FBK_InvalidParameter;
+
+    tx_header->Identifier = id_bits;
+
+    if (record->flags & FRM_FDF)
+    {
+        // Sending a message with FDF flag requires a data baudrate to be set.
+        if (!can_using_FD())
+            return FBK_BaudrateNotSet;
+
+        tx_header->FDFormat = FDCAN_FD_CAN;
+        if (record->flags & FRM_BRS)
+            tx_header->BitRateSwitch = FDCAN_BRS_ON;
+    }
+    else if (byte_count > 8)
+        return FBK_InvalidParameter; // classic frames allow 0...8 bytes
+
+    if (can_id & CAN_ID_RTR)
+    {
+        // Remote frames never send data bytes. The host can write the DLC value into the first data byte, otherwise DLC = 0 is sent.
+        if (tx_header->FDFormat == FDCAN_FD_CAN)
+            return FBK_InvalidParameter; // remote frames do not exist in CAN FD
+
+        tx_header->TxFrameType = FDCAN_REMOTE_FRAME;
+        tx_header->DataLength  = (byte_count > 0) ? MIN(record->data_start[0], 8) : 0;
+    }
+    else
+    {
+        // A byte count that is not a valid CAN FD length (e.g. 10) is padded with zeroes to the next DLC (12).
+        tx_header->DataLength = utils_byte_count_to_dlc(byte_count);
+        memcpy(tx_data, record->data_start, byte_count);
+        memset(tx_data + byte_count, 0, utils_dlc_to_byte_count(tx_header->DataLength) - byte_count);
+    }
+
     // Store the message in the buffer
     return buf_comit_can_dest();
 }
@@ -466,8 +660,54 @@ eFeedback control_parse_str(char buf[], int len)
 // ================================================================================================================
 
 // Command: "F7E0,7FF;1F005000,1FFFFFFF\r" --> set 11 bit filter: 0x7E0, mask: 0x7FF and 29 bit filter 0x1F005000.
+// Command: "FM3,7E0,7FF\r"  --> set filter element 3 to an acceptance mask filter 0x7E0, mask 0x7FF
+// Command: "FR4,700,7FF\r"  --> set filter element 4 to accept the range 0x700...0x7FF
+// Command: "FL30,18DAF110,18DB33F1\r" --> set filter element 30 (29 bit) to accept the list of two CAN IDs (dual ID filter)
+// Command: "Fr0,7DF,7DF\r"  --> lowercase type: reject filter, packets of CAN ID 0x7DF are not sent to the host
+// Command: "FX3\r"          --> disable filter element 3
+// The elements 0...27 are for 11 bit CAN IDs (3 digits), 28...35 for 29 bit CAN IDs (8 digits).
 // see comment for can_set_filter()
 eFeedback control_set_filter(char buf[], uint8_t len)
+{
+    uint32_t type = 0;
+    switch (buf[1])
+    {
+        case 'M': case 'm': type = FLT_Mask;  break;
+        case 'R': case 'r': type = FLT_Range; break;
+        case 'L': case 'l': type = FLT_Dual;  break;
+        case 'X':
+        {
+            int pos = 2;
+            uint32_t index;
+            if (!utils_parse_next_decimal(buf, &pos, 0, &index))
+                return FBK_InvalidParameter;
+
+            return can_remove_filter(index);
+        }
+        default: // legacy command "F7E0,7FF;..."
+            return control_set_mask_filters(buf);
+    }
+
+    if (buf[1] >= 'a')
+        type |= FLT_Reject;
+
+    int pos = 2;
+    int digits1, digits2;
+    uint32_t index, id1, id2;
+    if (!utils_parse_next_decimal  (buf, &pos, ',', &index) ||
+        !utils_parse_hex_delimiter (buf, &pos, ',', &digits1, &id1) ||
+        !utils_parse_hex_delimiter (buf, &pos,  0,  &digits2, &id2))
+            return FBK_InvalidParameter;
+
+    int digits = (index >= 28) ? 8 : 3;
+    if (digits1 != digits || digits2 != digits)
+        return FBK_InvalidParameter;
+
+    return can_set_filter(index, type, id1, id2);
+}
+
+// Command: "F7E0,7FF;1F005000,1FFFFFFF\r" --> add the acceptance mask filters in the first unused elements
+eFeedback control_set_mask_filters(char buf[])
 {
     int  pos = 1;
     bool abort = false;
@@ -502,6 +742,123 @@ eFeedback control_set_filter(char buf[], uint8_t len)
     return FBK_Success;
 }
 
+// Command "P\r"  --> remove all cyclic messages
+// Command "P3\r" --> remove cyclic message 3
+// Command "P3,10000,2500,0,8,t12380102030405060700\r" --> send the frame "t1238..." as cyclic message 3 every 10 ms
+// with a phase offset of 2.5 ms, no counter byte and the checksum of all other data bytes in data byte 8.
+// The fields are: index (0...31), period (microseconds), phase (microseconds), counter byte (1...64 or 0), checksum byte (1...64 or 0), frame command
+// The frame command is the same as for sending a single frame, but without Tx echo marker.
+eFeedback control_set_cyclic(char buf[], int len)
+{
+    if (len == 1)
+    {
+        cyclic_clear();
+        return FBK_Success;
+    }
+
+    int pos = 1;
+    uint32_t index, period_us, phase_us, counter_byte, checksum_byte;
+    if (utils_parse_next_decimal(buf, &pos, 0, &index))
+        return cyclic_remove(index); // "P3"
+
+    pos = 1;
+    if (!utils_parse_next_decimal(buf, &pos, ',', &index)        ||
+        !utils_parse_next_decimal(buf, &pos, ',', &period_us)    ||
+        !utils_parse_next_decimal(buf, &pos, ',', &phase_us)     ||
+        !utils_parse_next_decimal(buf, &pos, ',', &counter_byte) ||
+        !utils_parse_next_decimal(buf, &pos, ',', &checksum_byte))
+            return FBK_InvalidParameter;
+
+    FDCAN_TxHeaderTypeDef tx_header;
+    uint8_t               tx_data[64];
+    eFeedback e_Ret = control_parse_frame(buf + pos, len - pos, &tx_header, tx_data, false);
+    if (e_Ret != FBK_Success)
+        return e_Ret;
+
+    return cyclic_set(index, &tx_header, tx_data, period_us, phase_us, counter_byte, checksum_byte);
+}
+
+// Command "I\r"                  --> close the ISO-TP channel
+// Command "It7E0,7E8,00,00\r"    --> open the ISO-TP channel with Tx ID 0x7E0, Rx ID 0x7E8, block size 0, STmin 0
+// Command "It7E0,7E8,08,0A,CC\r" --> the same with block size 8, STmin 10 ms and all Tx frames padded to 8 bytes with 0xCC
+// The character after "I" defines the frame type in the same way as for sending a single frame:
+// "t" = 11 bit, "T" = 29 bit, "d" / "D" = CAN FD, "b" / "B" = CAN FD with baudrate switch.
+// Block size and STmin are sent to the peer in the Flow Control frames of the adapter (all values are hexadecimal).
+eFeedback control_set_isotp(char buf[], int len)
+{
+    if (len == 1)
+    {
+        isotp_close();
+        return FBK_Success;
+    }
+
+    uint8_t flags;
+    switch (buf[1])
+    {
+        case 't': flags = 0;                                   break;
+        case 'T': flags = ISO_Extended;                        break;
+        case 'd': flags = ISO_FD;                              break;
+        case 'D': flags = ISO_FD | ISO_Extended;               break;
+        case 'b': flags = ISO_FD | ISO_BRS;                    break;
+        case 'B': flags = ISO_FD | ISO_BRS | ISO_Extended;     break;
+        default:  return FBK_InvalidParameter;
+    }
+
+    int pos = 2;
+    int digitsT, digitsR, digitsB, digitsS, digitsP;
+    uint32_t tx_id, rx_id, block_size, st_min, pad_byte = 0;
+    if (!utils_parse_hex_delimiter(buf, &pos, ',', &digitsT, &tx_id) ||
+        !utils_parse_hex_delimiter(buf, &pos, ',', &digitsR, &rx_id) ||
+        !utils_parse_hex_delimiter(buf, &pos, ',', &digitsB, &block_size))
+            return FBK_InvalidParameter;
+
+    if (utils_parse_hex_delimiter(buf, &pos, ',', &digitsS, &st_min))
+    {
+        if (!utils_parse_hex_delimiter(buf, &pos, 0, &digitsP, &pad_byte) || digitsP != 2)
+            return FBK_InvalidParameter;
+
+        flags |= ISO_Padding;
+    }
+    else if (buf[pos] != 0) // invalid character after STmin
+        return FBK_InvalidParameter;
+
+    if (digitsT == 0 || digitsR == 0 || digitsB != 2 || digitsS != 2)
+        return FBK_InvalidParameter;
+
+    return isotp_open(tx_id, rx_id, flags, block_size, st_min, pad_byte);
+}
+
+// Command "i0140102030405060708090A0B0C0D0E0F1011121314\r" --> start a PDU of 0x014 bytes and append the first 20 bytes
+// Command "i+1516171819\r" --> append more bytes to the PDU
+// The first chunk starts with the 3 digit hexadecimal length of the entire PDU (1...FFF), each chunk contains up to 64 bytes.
+// The PDU is sent when all bytes have been appended. The host receives "I01\r" when the PDU has been sent completely.
+eFeedback control_send_isotp(char buf[], int len)
+{
+    int pos = 2;
+    if (buf[1] != '+')
+    {
+        uint32_t length;
+        if (len < 4 || !hex_decode_value(buf + 1, 3, &length))
+            return FBK_InvalidParameter;
+
+        eFeedback e_Ret = isotp_begin(length);
+        if (e_Ret != FBK_Success)
+            return e_Ret;
+
+        pos = 4;
+    }
+
+    int count = (len - pos) / 2;
+    if (count * 2 != len - pos || count > ISOTP_CHUNK_SIZE)
+        return FBK_InvalidParameter;
+
+    uint8_t data[ISOTP_CHUNK_SIZE];
+    if (!hex_decode_bytes(buf + pos, data, count))
+        return FBK_InvalidParameter;
+
+    return isotp_append(data, count);
+}
+
 // This function is called approx 100 times in one millisecond from the main loop
 // if the error state has changed, report it every 100 ms
 // if the error state did not change, report the same state only every 3000 ms.
@@ -514,11 +871,13 @@ void control_process(uint32_t tick_now)
     kCanErrorState* state = error_get_state();
 
     // Bus status and last protocol error (FDCAN_PROTOCOL_ERROR_ACK) have few values --> pack both into one byte
-    char tempbuf[20];
-    sprintf(tempbuf, "E%02X%02X%02X%02X\r", (uint8_t)(state->bus_status | state->last_proto_err),
-                                            (uint8_t)state->app_flags,
-                                            (uint8_t)state->tx_err_count,
-                                            (uint8_t)state->rx_err_count);
+    char tempbuf[10];
+    tempbuf[0] = 'E';
+    hex_encode_byte(tempbuf + 1, (uint8_t)(state->bus_status | state->last_proto_err));
+    hex_encode_byte(tempbuf + 3, (uint8_t)state->app_flags);
+    hex_encode_byte(tempbuf + 5, (uint8_t)state->tx_err_count);
+    hex_encode_byte(tempbuf + 7, (uint8_t)state->rx_err_count);
+    tempbuf[9] = '\r';
     buf_enqueue_cdc(tempbuf, 10);
     error_clear();
     
@@ -527,13 +886,340 @@ void control_process(uint32_t tick_now)
 }
 
 // send the busload in percet to the host in the user defined interval
-void control_report_busload(uint8_t busload_percent)
+void control_report_busload(uint32_t busload_ppm)
 {
-    char buf[10];
-    sprintf(buf, "L%u\r", busload_percent);
+    char buf[16];
+    if (busload_precise) sprintf(buf, "L%lu.%04lu\r", busload_ppm / 10000, busload_ppm % 10000);
+    else                 sprintf(buf, "L%u\r", (unsigned)MIN(99, busload_ppm / 10000));
     buf_enqueue_cdc(buf, strlen(buf));
 }
 
+// Parse hex data bytes up to the next comma: "023E," --> 0x02, 0x3E
+// returns the count of bytes or -1 on error. pos is set behind the comma.
+int control_parse_hex_bytes(char buf[], int* pos, uint8_t* dest, int max_count)
+{
+    int start = *pos;
+    int end   = start;
+    while (buf[end] != ',')
+    {
+        if (buf[end] == 0)
+            return -1;
+        end ++;
+    }
+
+    int count = (end - start) / 2;
+    if (count * 2 != end - start || count > max_count || !hex_decode_bytes(buf + start, dest, count))
+        return -1;
+
+    *pos = end + 1;
+    return count;
+}
+
+// Command "Q\r"  --> remove all automatic responses and reset the statistics
+// Command "Q3\r" --> remove automatic response 3
+// Command "Q?\r" --> returns "+count,dropped,last,max\r": the count of responses sent, the count of responses that could not be sent,
+//                    the latency of the last response and the maximum latency in microseconds (decimal values)
+// Command "Q0,7E0,7FF,023E,FFFF,0,0,0,t7E88027E005555555555\r" --> when a frame with ID 7E0 and the data bytes 02 3E is received,
+// send the response "t7E8..." immediately (UDS Tester Present).
+// The fields are: index (0...7), ID, mask (3 or 8 hex digits), pattern (0...8 hex bytes), pattern mask (same length as pattern),
+// copy source, copy target, copy count (decimal, 0 based byte positions), response frame command without Tx echo marker (0...8 data bytes).
+// The bytes "copy source" to "copy source + copy count - 1" of the request are copied into the response at "copy target".
+eFeedback control_set_responder(char buf[], int len)
+{
+    if (len == 1)
+    {
+        responder_clear();
+        return FBK_Success;
+    }
+
+    if (len == 2 && buf[1] == '?')
+    {
+        kResponderStats* stats = responder_get_stats();
+        char resp[50];
+        int  resp_len = sprintf(resp, "+%lu,%lu,%lu,%lu\r", stats->count, stats->dropped, stats->last_us, stats->max_us);
+        buf_enqueue_cdc(resp, resp_len);
+        return FBK_RetString;
+    }
+
+    int pos = 1;
+    uint32_t index, match_id, match_mask, copy_source, copy_target, copy_count;
+    if (utils_parse_next_decimal(buf, &pos, 0, &index))
+        return responder_remove(index); // "Q3"
+
+    pos = 1;
+    int digitsI, digitsM;
+    if (!utils_parse_next_decimal  (buf, &pos, ',', &index) ||
+        !utils_parse_hex_delimiter(buf, &pos, ',', &digitsI, &match_id) ||
+        !utils_parse_hex_delimiter(buf, &pos, ',', &digitsM, &match_mask))
+            return FBK_InvalidParameter;
+
+    bool match_extended;
+         if (digitsI == 3 && digitsM == 3) match_extended = false;
+    else if (digitsI == 8 && digitsM == 8) match_extended = true;
+    else return FBK_InvalidParameter;
+
+    uint8_t pattern[RESPONDER_MAX_DATA], pattern_mask[RESPONDER_MAX_DATA];
+    int pattern_len = control_parse_hex_bytes(buf, &pos, pattern,      RESPONDER_MAX_DATA);
+    int mask_len    = control_parse_hex_bytes(buf, &pos, pattern_mask, RESPONDER_MAX_DATA);
+    if (pattern_len < 0 || mask_len != pattern_len)
+        return FBK_InvalidParameter;
+
+    if (!utils_parse_next_decimal(buf, &pos, ',', &copy_source) ||
+        !utils_parse_next_decimal(buf, &pos, ',', &copy_target) ||
+        !utils_parse_next_decimal(buf, &pos, ',', &copy_count))
+            return FBK_InvalidParameter;
+
+    FDCAN_TxHeaderTypeDef tx_header;
+    uint8_t               tx_data[64];
+    eFeedback e_Ret = control_parse_frame(buf + pos, len - pos, &tx_header, tx_data, false);
+    if (e_Ret != FBK_Success)
+        return e_Ret;
+
+    return responder_set(index, match_id, match_mask, match_extended, pattern, pattern_mask, pattern_len,
+                         &tx_header, tx_data, copy_source, copy_target, copy_count);
+}
+
+// Command "G\r"  --> remove all reduction rules
+// Command "G3\r" --> remove reduction rule 3
+// Command "G?\r" --> returns "+suppressed\r": the count of Rx packets that have not been passed to the host (decimal)
+// Command "G0,100,700,1,1000\r" --> pass the packets with the IDs 100...1FF only if DLC or data have changed or 1000 ms have elapsed.
+// The fields are: index (0...7), ID, mask (3 or 8 hex digits), mode (eReduceMode), parameter (decimal)
+// Mode 0 = no reduction, 1 = on change (parameter = ms, 0 = never send unchanged packets), 2 = at most every parameter ms, 3 = every parameter'th packet
+eFeedback control_set_reduction(char buf[], int len)
+{
+    if (len == 1)
+    {
+        reduce_clear();
+        return FBK_Success;
+    }
+
+    if (len == 2 && buf[1] == '?')
+    {
+        char resp[20];
+        int  resp_len = sprintf(resp, "+%lu\r", reduce_get_suppressed());
+        buf_enqueue_cdc(resp, resp_len);
+        return FBK_RetString;
+    }
+
+    int pos = 1;
+    uint32_t index, can_id, mask, mode, param;
+    if (utils_parse_next_decimal(buf, &pos, 0, &index))
+        return reduce_remove_rule(index); // "G3"
+
+    pos = 1;
+    int digitsI, digitsM;
+    if (!utils_parse_next_decimal  (buf, &pos, ',', &index) ||
+        !utils_parse_hex_delimiter(buf, &pos, ',', &digitsI, &can_id) ||
+        !utils_parse_hex_delimiter(buf, &pos, ',', &digitsM, &mask)   ||
+        !utils_parse_next_decimal  (buf, &pos, ',', &mode)  ||
+        !utils_parse_next_decimal  (buf, &pos, 0,   &param))
+            return FBK_InvalidParameter;
+
+    bool extended;
+         if (digitsI == 3 && digitsM == 3) extended = false;
+    else if (digitsI == 8 && digitsM == 8) extended = true;
+    else return FBK_InvalidParameter;
+
+    return reduce_set_rule(index, can_id, mask, extended, mode, param);
+}
+
+// Command "U1\r" --> enable the statistics of each CAN ID and reset them
+// Command "U0\r" --> disable the statistics
+// Command "U?\r" --> returns "+ids,overflow\r": the count of IDs in the table and the count of packets that did not fit into the table
+// Command "U#0\r" --> returns the first ID at a table slot >= 0 as "+slot,ID,DLC,count,last,min,max,avg\r" or "+\r" if there are no more IDs.
+// The host continues with "U#" + slot + 1 until "+\r" is returned.
+// The ID has 3 or 8 hex digits, DLC is hex, all other fields are decimal, timestamp and periods in microseconds.
+eFeedback control_id_statistics(char buf[], int len)
+{
+    if (len == 2 && (buf[1] == '0' || buf[1] == '1'))
+    {
+        idstats_enable(buf[1] == '1');
+        return FBK_Success;
+    }
+
+    char resp[80];
+    int  resp_len;
+    if (len == 2 && buf[1] == '?')
+    {
+        resp_len = sprintf(resp, "+%lu,%lu\r", idstats_get_count(), idstats_get_overflow());
+        buf_enqueue_cdc(resp, resp_len);
+        return FBK_RetString;
+    }
+
+    int pos = 2;
+    uint32_t slot;
+    if (buf[1] != '#' || !utils_parse_next_decimal(buf, &pos, 0, &slot))
+        return FBK_InvalidParameter;
+
+    kIdStats* entry = idstats_get_next(&slot);
+    if (entry == NULL)
+    {
+        resp_len = sprintf(resp, "+\r");
+    }
+    else
+    {
+        uint32_t can_id = entry->key & 0x1FFFFFFF;
+        resp_len = sprintf(resp, (entry->key & IDT_Extended) ? "+%lu,%08lX,%X,%lu,%lu,%lu,%lu,%lu\r" : "+%lu,%03lX,%X,%lu,%lu,%lu,%lu,%lu\r",
+                           slot, can_id, entry->dlc, entry->count, entry->last_us, entry->min_us, entry->max_us, entry->avg_us);
+    }
+    buf_enqueue_cdc(resp, resp_len);
+    return FBK_RetString;
+}
+
+// Profiler: "?1", "?0", "??", "?#0" (see profiler.c)
+eFeedback control_profiler(char buf[], int len)
+{
+    if (len == 2 && (buf[1] == '0' || buf[1] == '1'))
+    {
+        profiler_enable(buf[1] == '1');
+        return FBK_Success;
+    }
+
+    char resp[160];
+    int  resp_len;
+    if (len == 2 && buf[1] == '?')
+    {
+        resp_len = sprintf(resp, "+%u,%lu\r", PRF_StageCount, SystemCoreClock / 1000000);
+        buf_enqueue_cdc(resp, resp_len);
+        return FBK_RetString;
+    }
+
+    int pos = 2;
+    uint32_t stage;
+    if (buf[1] != '#' || !utils_parse_next_decimal(buf, &pos, 0, &stage))
+        return FBK_InvalidParameter;
+
+    kProfStage* prof = profiler_get_stage(stage);
+    if (prof == NULL)
+        return FBK_InvalidParameter;
+
+    resp_len = sprintf(resp, "+%s,%lu,%lu,%lu,%lu", profiler_get_name(stage), prof->count, prof->min, profiler_get_average(prof), prof->max);
+    for (int i=0; i<PROFILER_BINS; i++)
+    {
+        resp_len += sprintf(resp + resp_len, ",%lu", prof->bins[i]);
+    }
+    resp[resp_len ++] = '\r';
+    buf_enqueue_cdc(resp, resp_len);
+    return FBK_RetString;
+}
+
+// Latency histogram: "H0", "H?", "H%995", "H#3" (see latency.c)
+eFeedback control_latency(char buf[], int len)
+{
+    if (len == 2 && buf[1] == '0')
+    {
+        latency_reset();
+        return FBK_Success;
+    }
+
+    char resp[100];
+    int  resp_len;
+    if (len == 2 && buf[1] == '?')
+    {
+        resp_len = sprintf(resp, "+%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu\r", latency_get_count(), latency_get_merged(), latency_get_min(),
+                           latency_get_percentile(500), latency_get_percentile(900), latency_get_percentile(990),
+                           latency_get_percentile(999), latency_get_max());
+        buf_enqueue_cdc(resp, resp_len);
+        return FBK_RetString;
+    }
+
+    int pos = 2;
+    uint32_t value;
+    if ((buf[1] != '%' && buf[1] != '#') || !utils_parse_next_decimal(buf, &pos, 0, &value))
+        return FBK_InvalidParameter;
+
+    if (buf[1] == '%')
+    {
+        if (value > 1000)
+            return FBK_InvalidParameter;
+
+        resp_len = sprintf(resp, "+%lu\r", latency_get_percentile(value));
+    }
+    else if (value < LATENCY_BINS)
+    {
+        uint32_t low_us;
+        uint32_t count = latency_get_bin(value, &low_us);
+        resp_len = sprintf(resp, "+%lu,%lu\r", low_us, count);
+    }
+    else resp_len = sprintf(resp, "+\r");
+
+    buf_enqueue_cdc(resp, resp_len);
+    return FBK_RetString;
+}
+
+// Queue statistics: "W5", "W0", "W?", "WS", "WC" (see bufstats.c)
+eFeedback control_queues(char buf[], int len)
+{
+    char resp[160];
+    int  resp_len;
+    if (len == 2 && buf[1] == 'C')
+    {
+        bufstats_reset();
+        return FBK_Success;
+    }
+    if (len == 2 && buf[1] == '?')
+    {
+        resp_len = control_format_queues(resp, '+');
+        buf_enqueue_cdc(resp, resp_len);
+        return FBK_RetString;
+    }
+    if (len == 2 && buf[1] == 'S')
+    {
+        resp_len = 0;
+        for (int i=0; i<QUE_Count; i++)
+        {
+            resp_len += sprintf(resp + resp_len, i ? ",%lu" : "+%lu", bufstats_get_size(i));
+        }
+        resp[resp_len ++] = '\r';
+        buf_enqueue_cdc(resp, resp_len);
+        return FBK_RetString;
+    }
+
+    int pos = 1;
+    uint32_t interval;
+    if (!utils_parse_next_decimal(buf, &pos, 0, &interval)) // "W0", "W5"
+        return FBK_InvalidParameter;
+
+    return bufstats_enable_report(interval); // interval in 100ms steps
+}
+
+// Write the drop counters and the peak levels as decimal values behind the prefix 'W' or '+'
+// returns the length of the string including '\r'
+int control_format_queues(char* resp, char prefix)
+{
+    int resp_len = 0;
+    resp[resp_len ++] = prefix;
+    for (int i=0; i<DRP_Count; i++)
+    {
+        resp_len += sprintf(resp + resp_len, i ? ",%lu" : "%lu", bufstats_get_drops(i));
+    }
+    for (int i=0; i<QUE_Count; i++)
+    {
+        resp_len += sprintf(resp + resp_len, ",%lu", bufstats_get_peak(i));
+    }
+    resp[resp_len ++] = '\r';
+    return resp_len;
+}
+
+// send the queue statistics to the host in the user defined interval
+void control_report_queues()
+{
+    char resp[160];
+    int  resp_len = control_format_queues(resp, 'W');
+    buf_enqueue_cdc(resp, resp_len);
+}
+
+// ISO-TP: send an eIsoTpEvent to the host (see isotp.c)
+// "I01\r" = the Tx PDU has been sent, "I05\r" = Rx timeout, etc.
+void control_report_isotp(uint8_t event)
+{
+    char buf[4];
+    buf[0] = 'I';
+    hex_encode_byte(buf + 1, event);
+    buf[3] = '\r';
+    buf_enqueue_cdc(buf, 4);
+}
+
 // Send a debug message. Maximum length is 80 characters.
 // The message may contain "\n" for multi-line output
 // You will see this message in the Trace pane of HUD ECU Hacker if USR_DebugReport is enabled.
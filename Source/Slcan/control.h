@@ -8,8 +8,11 @@
 
 void control_init();
 void control_parse_command (char *buf, int len);
+void control_parse_record  (uint8_t *record);
 void control_process(uint32_t tick_now);
-void control_report_busload(uint8_t busload_percent);
+void control_report_busload(uint32_t busload_ppm);
+void control_report_queues();
+void control_report_isotp(uint8_t event);
 bool control_send_debug_mesg(const char* message);
 
 
@@ -0,0 +1,93 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#pragma once
+
+// ###############################################################################
+//                 Slcan Binary Mode (enabled with command "MB")
+// ###############################################################################
+
+// In binary mode the ASCII hex encoding is replaced by length-prefixed records in both directions.
+// A 64 byte CAN FD frame needs 71 bytes instead of 140 characters.
+// The records have exactly the same layout as the ElmSoft protocol of the Candlelight firmware (see candlelight_def.h)
+// with the only difference that Slcan never sends timestamps.
+// ASCII commands, feedbacks and events are packed into a MSG_String record.
+// Commands from the host do not need the terminating '\r'. Responses to the host contain the same '\r' as in ASCII mode.
+// Command "C" returns to ASCII mode because it resets all modes to their default.
+
+// These flags are OR'ed with the CAN ID
+typedef enum // 3 bit
+{
+    CAN_ID_RTR   = 0x40000000, // the frame is a Remote Transmission Request
+    CAN_ID_29Bit = 0x80000000, // the frame has an extended CAN ID with 29 bit
+    CAN_MASK_11  = 0x000007FF, // Mask for standard 11 bit ID
+    CAN_MASK_29  = 0x1FFFFFFF, // Mask for extended 29 bit ID
+} eCanIdFlags;
+
+typedef enum // 8 bit
+{
+    FRM_FDF      = 0x02, // The CAN frame has the FDF (Flexible Datarate Frame) flag set. It is a CAN FD frame.
+    FRM_BRS      = 0x04, // The CAN frame has the BRS (Bit Rate Switch) flag set. The data is transmitted with a higher baudrate
+    FRM_ESI      = 0x08, // The CAN frame has the ESI (Error State Indicator) flag set. Only reported if "MS" is enabled.
+} eFrameFlags;
+
+typedef enum // 8 bit
+{
+    // received from host
+    MSG_TxFrame = 10, // the record contains a CAN frame to be sent to CAN bus (kTxFrameElmue)
+    // sent to host
+    MSG_TxEcho,       // the record contains the echo marker of a Tx CAN frame (kTxEchoElmue, enabled with "MM")
+    MSG_RxFrame,      // the record contains a received CAN frame from CAN bus (kRxFrameElmue)
+    MSG_Error,        // not used by Slcan, the error report "Exxxxxxxx\r" is sent as MSG_String
+    // sent in both directions
+    MSG_String,       // the record contains an ASCII command, feedback, response or event (kStringElmue)
+} eMessageType;
+
+// common header for all records
+typedef struct
+{
+    uint8_t  size;      // the total length of this record (struct + the appended data bytes)
+    uint8_t  msg_type;  // eMessageType
+} __packed __aligned(1) kHeader;
+
+// received from the host
+// A DLC byte is not required. The count of data bytes is calculated as: header.size - sizeof(kTxFrameElmue)
+// For remote frames the host can write the DLC value into the first data byte, otherwise DLC = 0 is sent.
+// see control_send_record()
+typedef struct
+{
+    kHeader  header;        // MSG_TxFrame
+    uint8_t  flags;         // eFrameFlags
+    uint32_t can_id;        // CAN ID + eCanIdFlags
+    uint8_t  marker;        // one-byte marker that is sent back to the host with MSG_TxEcho when the packet has been ACKnowledged
+    uint8_t  data_start[0]; // data start
+} __packed __aligned(1) kTxFrameElmue;
+
+// sent to the host
+// A DLC byte is not required. The count of data bytes is calculated as: header.size - sizeof(kRxFrameElmue)
+// For remote frames the DLC from the Rx packet is transmitted in the first data byte to the host.
+// see buf_store_rx_packet()
+typedef struct
+{
+    kHeader  header;        // MSG_RxFrame
+    uint8_t  flags;         // eFrameFlags
+    uint32_t can_id;        // CAN ID + eCanIdFlags
+    uint8_t  data_start[0]; // data start
+} __packed __aligned(1) kRxFrameElmue;
+
+// see buf_store_tx_echo()
+typedef struct
+{
+    kHeader  header;        // MSG_TxEcho
+    uint8_t  marker;        // the same marker that was sent in kTxFrameElmue
+} __packed __aligned(1) kTxEchoElmue;
+
+// see buf_enqueue_cdc()
+typedef struct
+{
+    kHeader  header;        // MSG_String
+    char     ascii_msg[0];  // string data (not zero terminated)
+} __packed __aligned(1) kStringElmue;
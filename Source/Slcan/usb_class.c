@@ -54,6 +54,7 @@ EndBSPDependencies */
 #include "usb_class.h"
 #include "usb_ctrlreq.h"
 #include "usb_interface.h" 
+#include "latency.h"
 
 static uint8_t  USBD_CDC_Init(USBD_HandleTypeDef *pdev,  uint8_t cfgidx);
 static uint8_t  USBD_CDC_DeInit(USBD_HandleTypeDef *pdev, uint8_t cfgidx);
@@ -427,11 +428,18 @@ __ALIGN_BEGIN static uint8_t USBD_CDC_DeviceQualifierDesc[USB_LEN_DEV_QUALIFIER_
 void USBD_ConfigureEndpoints(USBD_HandleTypeDef *pdev)
 {
     // Configue Packet Memory Area (PMA) for all endpoints
-    HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData, 0x00, PCD_SNG_BUF, 0x18);  // EP 0 OUT (SETUP,                 max packet size = 64 bytes)
-    HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData, 0x80, PCD_SNG_BUF, 0x58);  // EP 0 IN  (SETUP,                 max packet size = 64 bytes)
-    HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData, 0x81, PCD_SNG_BUF, 0xC0);  // EP 1 IN  (CDC Data Interface,    max packet size = 64 bytes)
-    HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData, 0x82, PCD_SNG_BUF, 0x100); // EP 2 IN  (CDC Control Interface, max packet size =  8 bytes)    
-    HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData, 0x01, PCD_SNG_BUF, 0x110); // EP 1 OUT (CDC Data Interface,    max packet size = 64 bytes)
+    // The buffer table at address 0 needs 8 bytes for each endpoint number 0...3, so the buffers start at 0x20.
+    // The bulk IN endpoint is double buffered: while the host reads one buffer, the firmware fills the other one.
+    // A double buffered endpoint uses the Rx and the Tx buffer descriptor, so it can only be used in one direction.
+    // This is the reason why the OUT endpoint is EP 3 and not EP 1.
+    // The bulk OUT endpoint must be single buffered because CDC_Receive_FS() throttles the host by not re-arming it when
+    // all buffers in buf_cdc_rx are full. The HAL releases the second buffer of a double buffered OUT endpoint immediately,
+    // so the hardware would accept one more packet without a destination buffer.
+    HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData, 0x00,       PCD_SNG_BUF, 0x20);       // EP 0 OUT (SETUP,                 max packet size = 64 bytes)
+    HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData, 0x80,       PCD_SNG_BUF, 0x60);       // EP 0 IN  (SETUP,                 max packet size = 64 bytes)
+    HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData, CDC_IN_EP,  PCD_DBL_BUF, 0x00E000A0); // EP 1 IN  (CDC Data Interface,    max packet size = 64 bytes, double buffer addr A0 + E0)
+    HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData, CDC_CMD_EP, PCD_SNG_BUF, 0x1A0);      // EP 2 IN  (CDC Control Interface, max packet size =  8 bytes)
+    HAL_PCDEx_PMAConfig((PCD_HandleTypeDef*)pdev->pData, CDC_OUT_EP, PCD_SNG_BUF, 0x120);      // EP 3 OUT (CDC Data Interface,    max packet size = 64 bytes)
 }
 
 // ============================================================================================================
@@ -648,6 +656,8 @@ static uint8_t USBD_CDC_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum)
     }
     else
     {
+      // The transfer has completed --> measure the latency of the Rx frames in it
+      latency_end_transfer();
       hcdc->TxState = 0U;
     }
     return USBD_OK;
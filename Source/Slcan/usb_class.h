@@ -26,7 +26,7 @@ extern "C" {
 #include  "usb_ioreq.h"
 
 #define CDC_IN_EP                                   0x81U  /* EP1 for data IN */
-#define CDC_OUT_EP                                  0x01U  /* EP1 for data OUT */
+#define CDC_OUT_EP                                  0x03U  /* EP3 for data OUT (EP1 cannot be used because EP1 IN is double buffered) */
 #define CDC_CMD_EP                                  0x82U  /* EP2 for CDC commands */
 
 #ifndef CDC_HS_BINTERVAL
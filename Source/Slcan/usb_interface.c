@@ -18,6 +18,7 @@
 #include "buffer.h"
 #include "error.h"
 #include "system.h"
+#include "bufstats.h"
 
 extern USBD_HandleTypeDef USB_Device;
 
@@ -37,7 +38,7 @@ USBD_CDC_ItfTypeDef USBD_InterfaceCallbacks =
 // Initializes the CDC media low layer over the FS USB IP
 static int8_t CDC_Init_FS(void)
 {
-    USBD_CDC_SetTxBuffer(&USB_Device, (uint8_t *)buf_cdc_tx.data[buf_cdc_tx.tail], 0);
+    USBD_CDC_SetTxBuffer(&USB_Device, (uint8_t *)buf_cdc_tx.data, 0);
     USBD_CDC_SetRxBuffer(&USB_Device, (uint8_t *)buf_cdc_rx.data[buf_cdc_rx.head]);
     return (USBD_OK);
 }
@@ -131,28 +132,44 @@ static int8_t CDC_Control_FS(uint8_t cmd, uint8_t* pbuf, uint16_t length)
   */
 static int8_t CDC_Receive_FS(uint8_t* Buf, uint32_t *Len)
 {
-    // Check for overflow!
-    uint32_t new_head = (buf_cdc_rx.head + 1) % BUF_CDC_RX_NUM_BUFS;
-    if (new_head == buf_cdc_rx.tail)
+    // Save off length. The buffer at head was free when it has been armed, so nothing is overwritten here.
+    buf_cdc_rx.msglen[buf_cdc_rx.head] = *Len;
+    buf_cdc_rx.head = (buf_cdc_rx.head + 1) % BUF_CDC_RX_NUM_BUFS;
+    bufstats_level(QUE_UsbRx, (buf_cdc_rx.head - buf_cdc_rx.tail + BUF_CDC_RX_NUM_BUFS) % BUF_CDC_RX_NUM_BUFS);
+
+    // All buffers are full --> do not re-arm the OUT endpoint.
+    // The hardware answers the next packets of the host with NAK until buf_process() has freed a buffer.
+    if ((buf_cdc_rx.head + 1) % BUF_CDC_RX_NUM_BUFS == buf_cdc_rx.tail)
     {
-        error_assert(APP_CanTxOverflow, false);
-
-        // Listen again on the same buffer. Old data will be overwritten.
-        USBD_CDC_SetRxBuffer(&USB_Device, (uint8_t *)buf_cdc_rx.data[buf_cdc_rx.head]);
-        USBD_CDC_ReceivePacket(&USB_Device);
-        return HAL_ERROR;
+        buf_cdc_rx.paused = true;
+        return (USBD_OK);
     }
-    else
-    {
-        // Save off length
-        buf_cdc_rx.msglen[buf_cdc_rx.head] = *Len;
-        buf_cdc_rx.head = new_head;
 
-        // Start listening on next buffer. Previous buffer will be processed in main loop.
+    // Start listening on next buffer. Previous buffer will be processed in main loop.
+    USBD_CDC_SetRxBuffer(&USB_Device, (uint8_t *)buf_cdc_rx.data[buf_cdc_rx.head]);
+    USBD_CDC_ReceivePacket(&USB_Device);
+    return (USBD_OK);
+}
+
+// Called from buf_process() after a receive buffer has been freed.
+// Re-arms the OUT endpoint if CDC_Receive_FS() has paused the host.
+void CDC_ResumeReceive()
+{
+    system_disable_irq();
+    if (buf_cdc_rx.paused)
+    {
+        buf_cdc_rx.paused = false;
         USBD_CDC_SetRxBuffer(&USB_Device, (uint8_t *)buf_cdc_rx.data[buf_cdc_rx.head]);
         USBD_CDC_ReceivePacket(&USB_Device);
-        return (USBD_OK);
     }
+    system_enable_irq();
+}
+
+// returns true while the IN endpoint has not yet completed the last CDC_Transmit_FS() or the device is not configured
+bool CDC_IsTransmitBusy()
+{
+    USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)USB_Device.pClassData;
+    return hcdc == NULL || hcdc->TxState != 0;
 }
 
 uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len)
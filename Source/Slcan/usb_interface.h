@@ -11,5 +11,7 @@
 extern USBD_CDC_ItfTypeDef USBD_InterfaceCallbacks;
 
 uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len);
+void    CDC_ResumeReceive();
+bool    CDC_IsTransmitBusy();
 
 
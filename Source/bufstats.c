@@ -0,0 +1,79 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#include "settings.h"
+#include "bufstats.h"
+#include "control.h"
+
+// High-water marks and drop counters of all queues between CAN bus and USB.
+// The peak fill level of each queue shows how close it has come to an overflow, long before a frame is lost.
+// The drop counters count each lost frame or message by the reason, while the APP_xxx error flags only report that something was lost.
+// Both are updated from the main loop and from the interrupt handlers. Each queue level is always measured in the same context.
+// A drop counter may miss one count if the main loop and an interrupt count the same reason at the same time, this is negligible.
+// The statistics are not cleared when the adapter is closed, so the host can still read them after closing.
+// A periodic report can be enabled while the adapter is open, like the bus load report.
+
+uint32_t bufstats_drops[DRP_Count];
+uint16_t bufstats_peaks[QUE_Count];
+uint16_t bufstats_sizes[QUE_Count]; // capacity of each queue, 0 = not used in this firmware
+uint32_t bufstats_interval = 0;     // report interval in 100 ms steps, 0 = off
+uint32_t bufstats_counter  = 0;
+
+// Clear all drop counters and peak levels
+void bufstats_reset()
+{
+    memset(bufstats_drops, 0, sizeof(bufstats_drops));
+    memset(bufstats_peaks, 0, sizeof(bufstats_peaks));
+}
+
+// Called once at startup from the modules that own the queues
+void bufstats_set_size(eQueue queue, uint32_t size)
+{
+    bufstats_sizes[queue] = size;
+}
+
+// Send the statistics to the host every 'interval' * 100 ms (0 = off, maximum 10 seconds)
+eFeedback bufstats_enable_report(uint32_t interval)
+{
+    if (interval > 100)
+        return FBK_InvalidParameter;
+
+    bufstats_interval = interval;
+    bufstats_counter  = 0;
+    return FBK_Success;
+}
+
+// Called every 100 ms from can_timer_100ms() while the adapter is open
+void bufstats_timer_100ms()
+{
+    if (bufstats_interval == 0)
+        return;
+
+    bufstats_counter ++;
+    if (bufstats_counter >= bufstats_interval)
+    {
+        bufstats_counter = 0;
+        control_report_queues(); // send the report to the host
+    }
+}
+
+// returns the count of frames or messages that have been lost for the eDropReason
+uint32_t bufstats_get_drops(uint32_t reason)
+{
+    return (reason < DRP_Count) ? bufstats_drops[reason] : 0;
+}
+
+// returns the highest fill level of the eQueue since the last reset
+uint32_t bufstats_get_peak(uint32_t queue)
+{
+    return (queue < QUE_Count) ? bufstats_peaks[queue] : 0;
+}
+
+// returns the capacity of the eQueue (frames, packets or bytes)
+uint32_t bufstats_get_size(uint32_t queue)
+{
+    return (queue < QUE_Count) ? bufstats_sizes[queue] : 0;
+}
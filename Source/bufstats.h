@@ -0,0 +1,57 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#pragma once
+#include "settings.h"
+
+// The queues between CAN bus and USB (see bufstats.c)
+typedef enum // 8 bit
+{
+    QUE_CanTx = 0, // frames in the CAN Tx buffer (Candlelight: ring_to_can, Slcan: buf_can_tx)
+    QUE_TxFifo,    // frames in the 3 hardware Tx buffers of the FDCAN
+    QUE_RxFifo,    // frames in a hardware Rx FIFO when the interrupt handler reads it
+    QUE_RxRing,    // frames in rx_ring that wait for can_process()
+    QUE_Host,      // bytes in the USB IN buffer (Candlelight: ring_to_host, Slcan: buf_cdc_tx)
+    QUE_UsbRx,     // Slcan: USB OUT packets in buf_cdc_rx, Candlelight: unused (the OUT transfers are copied directly into ring_to_can)
+    QUE_Count,
+} eQueue;
+
+// The reasons why a frame or a message is lost
+typedef enum // 8 bit
+{
+    DRP_CanTxFull = 0, // a Tx frame from the host was discarded because the CAN Tx buffer was full
+    DRP_CanTxFail,     // a Tx frame from the host was invalid or not allowed (silent mode, bus off, FD frame without data baudrate)
+    DRP_CanTxTimeout,  // a Tx frame was discarded because it was not acknowledged within CAN_TX_TIMEOUT
+    DRP_TxEventLost,   // a Tx event was lost, the host gets no echo for the frame
+    DRP_RxFifoLost,    // a hardware Rx FIFO has lost frames (the FDCAN reports only a flag, so this counts at least one frame)
+    DRP_RxRingFull,    // an Rx frame was discarded because rx_ring was full
+    DRP_HostFull,      // a message to the host was discarded because the USB IN buffer was full
+    DRP_Count,
+} eDropReason;
+
+extern uint32_t bufstats_drops[DRP_Count];
+extern uint16_t bufstats_peaks[QUE_Count];
+
+void      bufstats_reset();
+void      bufstats_set_size(eQueue queue, uint32_t size);
+eFeedback bufstats_enable_report(uint32_t interval);
+void      bufstats_timer_100ms();
+uint32_t  bufstats_get_drops(uint32_t reason);
+uint32_t  bufstats_get_peak(uint32_t queue);
+uint32_t  bufstats_get_size(uint32_t queue);
+
+// Store the current fill level of a queue if it is the highest since the last reset
+static inline void bufstats_level(eQueue queue, uint32_t level)
+{
+    if (level > bufstats_peaks[queue])
+        bufstats_peaks[queue] = level;
+}
+
+// Count 'count' frames or messages that have been lost
+static inline void bufstats_drop(eDropReason reason, uint32_t count)
+{
+    bufstats_drops[reason] += count;
+}
@@ -0,0 +1,361 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#include "settings.h"
+#include "busload.h"
+#include "control.h"
+#include "system.h"
+#include "utils.h"
+
+// Exact calculation of the bus load.
+// The duration of each frame on the CAN bus is calculated in CAN clock cycles from the real bits of the frame:
+// - The dynamic stuff bits are counted from the bit sequence of ID, control field, data and (classic CAN) the CRC.
+// - CAN FD frames have a stuff count field, a CRC of 17 bits (up to 16 data bytes) or 21 bits and fixed stuff bits.
+// - The data phase of BRS frames (ESI bit ... CRC) is counted with the data bit time.
+// CRC delimiter, ACK slot, ACK delimiter, EOF and intermission are 13 nominal bits for all frames.
+// Error frames, overload frames and retransmissions of frames that were not acknowledged are not counted.
+// The load of each 100 ms slot is stored and averaged over a sliding window of 1...32 slots.
+
+// Bit count of the frame parts that are not stuffed
+#define BITS_TRAILER        13 // CRC delimiter, ACK slot, ACK delimiter, EOF, intermission
+#define BITS_FD_CRC17       (4 + 17 + 6) // stuff count, CRC 17, fixed stuff bits
+#define BITS_FD_CRC21       (4 + 21 + 7) // stuff count, CRC 21, fixed stuff bits
+#define CRC15_POLYNOMIAL    0x4599
+#define TX_PENDING_COUNT    4  // the processor has 3 Tx buffers
+
+// The state of the bit stuffing: bit 3 = value of the last bit, bit 0...2 = count of equal bits in a row (5 = stuff bit pending)
+// The start state 0x08 means that the bus was recessive before SOF.
+#define STUFF_START_STATE   0x08
+
+// stuff state + 4 bits (MSB first) --> high nibble = count of inserted stuff bits, low nibble = new stuff state
+// generated from the same algorithm as busload_feed_bits()
+static const uint8_t STUFF_NIBBLE[14][16] =
+{
+    { 0x04, 0x09, 0x01, 0x0A, 0x02, 0x09, 0x01, 0x0B, 0x03, 0x09, 0x01, 0x0A, 0x02, 0x09, 0x01, 0x0C },
+    { 0x05, 0x09, 0x01, 0x0A, 0x02, 0x09, 0x01, 0x0B, 0x03, 0x09, 0x01, 0x0A, 0x02, 0x09, 0x01, 0x0C },
+    { 0x11, 0x1A, 0x01, 0x0A, 0x02, 0x09, 0x01, 0x0B, 0x03, 0x09, 0x01, 0x0A, 0x02, 0x09, 0x01, 0x0C },
+    { 0x12, 0x19, 0x11, 0x1B, 0x02, 0x09, 0x01, 0x0B, 0x03, 0x09, 0x01, 0x0A, 0x02, 0x09, 0x01, 0x0C },
+    { 0x13, 0x19, 0x11, 0x1A, 0x12, 0x19, 0x11, 0x1C, 0x03, 0x09, 0x01, 0x0A, 0x02, 0x09, 0x01, 0x0C },
+    { 0x14, 0x19, 0x11, 0x1A, 0x12, 0x19, 0x11, 0x1B, 0x13, 0x19, 0x11, 0x1A, 0x12, 0x19, 0x11, 0x1D },
+    { 0 }, { 0 }, // invalid states
+    { 0x04, 0x09, 0x01, 0x0A, 0x02, 0x09, 0x01, 0x0B, 0x03, 0x09, 0x01, 0x0A, 0x02, 0x09, 0x01, 0x0C },
+    { 0x04, 0x09, 0x01, 0x0A, 0x02, 0x09, 0x01, 0x0B, 0x03, 0x09, 0x01, 0x0A, 0x02, 0x09, 0x01, 0x0D },
+    { 0x04, 0x09, 0x01, 0x0A, 0x02, 0x09, 0x01, 0x0B, 0x03, 0x09, 0x01, 0x0A, 0x02, 0x09, 0x12, 0x19 },
+    { 0x04, 0x09, 0x01, 0x0A, 0x02, 0x09, 0x01, 0x0B, 0x03, 0x09, 0x01, 0x0A, 0x13, 0x19, 0x11, 0x1A },
+    { 0x04, 0x09, 0x01, 0x0A, 0x02, 0x09, 0x01, 0x0B, 0x14, 0x19, 0x11, 0x1A, 0x12, 0x19, 0x11, 0x1B },
+    { 0x15, 0x19, 0x11, 0x1A, 0x12, 0x19, 0x11, 0x1B, 0x13, 0x19, 0x11, 0x1A, 0x12, 0x19, 0x11, 0x1C },
+};
+
+// CRC 15 of classic CAN for 4 bits (MSB first)
+static const uint16_t CRC15_NIBBLE[16] =
+{
+    0x0000, 0x4599, 0x4EAB, 0x0B32, 0x58CF, 0x1D56, 0x1664, 0x53FD, 0x7407, 0x319E, 0x3AAC, 0x7F35, 0x2CC8, 0x6951, 0x6263, 0x27FA
+};
+
+typedef struct
+{
+    uint32_t state; // stuff state (see STUFF_START_STATE)
+    uint32_t stuff; // count of stuff bits
+    uint32_t crc;   // CRC 15 (only classic frames)
+} kBitStream;
+
+// The Tx Event does not contain the data bytes, so the duration is calculated when the frame is passed to the Tx FIFO
+typedef struct
+{
+    uint32_t key;    // CAN ID + IDT_Extended
+    uint32_t cycles; // duration of the frame on the bus
+    uint8_t  marker; // the message marker of the Tx Event
+    bool     used;
+} kTxPending;
+
+uint32_t   busload_interval    = 0; // report interval in 100 ms steps, 0 = disabled
+uint32_t   busload_counter     = 0;
+uint32_t   busload_window      = BUSLOAD_DEFAULT_WINDOW;
+uint32_t   busload_nom_cycles  = 0; // CAN clock cycles of one nominal bit
+uint32_t   busload_data_cycles = 0; // CAN clock cycles of one data bit
+uint64_t   busload_cycles      = 0; // CAN clock cycles of all frames in the current slot (160 MHz --> 16e9 in 100 ms at 100% load)
+uint32_t   busload_last_tick   = 0;
+uint32_t   busload_slots[BUSLOAD_MAX_WINDOW]; // bus load of the last slots in ppm
+uint32_t   busload_slot_pos    = 0;
+uint32_t   busload_slot_count  = 0;
+uint32_t   busload_slot_sum    = 0;
+uint32_t   busload_ppm         = 0;
+uint32_t   busload_old_ppm     = 0;
+kTxPending busload_tx_pending[TX_PENDING_COUNT];
+uint32_t   busload_tx_pos      = 0;
+
+// Private methods
+void busload_reset_window();
+
+// Called from can_open() with the CAN clock cycles of one nominal and one data bit
+void busload_open(uint32_t nom_cycles, uint32_t data_cycles)
+{
+    busload_nom_cycles  = nom_cycles;
+    busload_data_cycles = data_cycles;
+    busload_clear_tx();
+    busload_reset_window();
+}
+
+// interval =   0 --> disable busload report
+// interval =   1 --> report busload every 100 ms     (minimum)
+// interval =   7 --> report busload every 700 ms
+// interval = 100 --> report busload every 10 seconds (maximum)
+// window   =   0 --> default averaging window of 800 ms
+// window   =   1 --> no averaging, the report shows the load of the last 100 ms
+// window   =  32 --> the report shows the average load of the last 3.2 seconds (maximum)
+eFeedback busload_enable(uint32_t interval, uint32_t window)
+{
+    if (interval > 100 || window > BUSLOAD_MAX_WINDOW)
+        return FBK_InvalidParameter;
+
+    busload_interval = interval;
+    busload_window   = (window == 0) ? BUSLOAD_DEFAULT_WINDOW : window;
+    busload_reset_window();
+    return FBK_Success;
+}
+
+void busload_reset_window()
+{
+    busload_cycles     = 0;
+    busload_counter    = 0;
+    busload_slot_pos   = 0;
+    busload_slot_count = 0;
+    busload_slot_sum   = 0;
+    busload_ppm        = 0;
+    busload_last_tick  = HAL_GetTick();
+}
+
+// Pass 'count' bits (MSB first) through bit stuffing and optionally CRC 15.
+// Full nibbles are processed with the tables, the remaining bits one by one.
+static void busload_feed_bits(kBitStream* stream, uint32_t bits, int count, bool calc_crc)
+{
+    uint32_t state = stream->state;
+    while (count >= 4)
+    {
+        count -= 4;
+        uint32_t nibble = (bits >> count) & 0xF;
+        uint32_t entry  = STUFF_NIBBLE[state][nibble];
+        stream->stuff  += entry >> 4;
+        state           = entry & 0xF;
+
+        if (calc_crc)
+            stream->crc = ((stream->crc << 4) ^ CRC15_NIBBLE[((stream->crc >> 11) ^ nibble) & 0xF]) & 0x7FFF;
+    }
+    while (count > 0)
+    {
+        count --;
+        uint32_t bit = (bits >> count) & 1;
+        if ((state & 7) == 5) // insert a stuff bit with the inverted value
+        {
+            stream->stuff ++;
+            state = ((state ^ 8) & 8) | 1;
+        }
+        if ((state >> 3) == bit) state ++;
+        else                     state = (bit << 3) | 1;
+
+        if (calc_crc)
+        {
+            bool top    = ((stream->crc >> 14) ^ bit) & 1;
+            stream->crc = (stream->crc << 1) & 0x7FFF;
+            if (top) stream->crc ^= CRC15_POLYNOMIAL;
+        }
+    }
+    stream->state = state;
+}
+
+// Calculate the duration of a frame on the CAN bus in CAN clock cycles.
+// frame_type = FDCAN_DATA_FRAME or FDCAN_REMOTE_FRAME (identical for Rx and Tx)
+// data = NULL if the data bytes are not known (their stuff bits are not counted then)
+static uint32_t busload_calc_frame(uint32_t id, uint32_t id_type, uint32_t frame_type, uint32_t fd_format,
+                                   uint32_t brs, uint32_t esi, uint32_t dlc, uint8_t* data)
+{
+    bool extended = (id_type    == FDCAN_EXTENDED_ID);
+    bool remote   = (frame_type == FDCAN_REMOTE_FRAME);
+    bool fd       = (fd_format  == FDCAN_FD_CAN);
+    int  bytes    = utils_dlc_to_byte_count(dlc);
+    if (!fd && bytes > 8)
+        bytes = 8; // classic frames with DLC 9...15 have 8 data bytes
+
+    kBitStream stream = { STUFF_START_STATE, 0, 0 };
+    busload_feed_bits(&stream, 0, 1, !fd); // SOF (dominant)
+    if (extended)
+    {
+        busload_feed_bits(&stream, id >> 18, 11, !fd);  // base ID
+        busload_feed_bits(&stream, 3, 2, !fd);          // SRR, IDE (both recessive)
+        busload_feed_bits(&stream, id & 0x3FFFF, 18, !fd); // ID extension
+    }
+    else
+    {
+        busload_feed_bits(&stream, id, 11, !fd);
+    }
+
+    if (!fd)
+    {
+        // 11 bit: RTR, IDE, r0 / 29 bit: RTR, r1, r0
+        busload_feed_bits(&stream, remote ? 4 : 0, 3, true);
+        busload_feed_bits(&stream, dlc, 4, true);
+
+        int data_bits = 0;
+        if (!remote)
+        {
+            data_bits = bytes * 8;
+            for (int i=0; data && i<bytes; i++)
+            {
+                busload_feed_bits(&stream, data[i], 8, true);
+            }
+        }
+
+        // The CRC sequence is stuffed, a stuff bit after its last bit is also inserted.
+        busload_feed_bits(&stream, stream.crc, 15, false);
+        if ((stream.state & 7) == 5)
+            stream.stuff ++;
+
+        uint32_t bits = (extended ? 39 : 19) + data_bits + 15 + stream.stuff + BITS_TRAILER;
+        return bits * busload_nom_cycles;
+    }
+
+    // 11 bit: RRS, IDE, FDF, res, BRS / 29 bit: RRS, FDF, res, BRS
+    bool brs_on = (brs == FDCAN_BRS_ON);
+    busload_feed_bits(&stream, brs_on ? 5 : 4, extended ? 4 : 5, false);
+
+    // the nominal bit rate is used until the BRS bit
+    uint32_t arbit_bits = (extended ? 36 : 17) + stream.stuff + BITS_TRAILER;
+
+    stream.stuff = 0;
+    busload_feed_bits(&stream, esi == FDCAN_ESI_PASSIVE ? 1 : 0, 1, false);
+    busload_feed_bits(&stream, dlc, 4, false);
+    for (int i=0; data && i<bytes; i++)
+    {
+        busload_feed_bits(&stream, data[i], 8, false);
+    }
+
+    // A dynamic stuff bit after the last data bit is replaced by the first fixed stuff bit.
+    uint32_t data_bits = 5 + bytes * 8 + stream.stuff + (bytes > 16 ? BITS_FD_CRC21 : BITS_FD_CRC17);
+
+    if (brs_on)
+        return arbit_bits * busload_nom_cycles + data_bits * busload_data_cycles;
+    else
+        return (arbit_bits + data_bits) * busload_nom_cycles;
+}
+
+// Called from can_process() for each received frame (accepted and rejected by the filters)
+void busload_add_rx(FDCAN_RxHeaderTypeDef* rx_header, uint8_t* rx_data)
+{
+    if (busload_interval == 0)
+        return;
+
+    busload_cycles += busload_calc_frame(rx_header->Identifier, rx_header->IdType, rx_header->RxFrameType, rx_header->FDFormat,
+                                         rx_header->BitRateSwitch, rx_header->ErrorStateIndicator, rx_header->DataLength, rx_data);
+}
+
+// Called from can_send_packet() for frames that do not produce a Tx Event
+void busload_add_tx(FDCAN_TxHeaderTypeDef* tx_header, uint8_t* tx_data)
+{
+    if (busload_interval == 0)
+        return;
+
+    busload_cycles += busload_calc_frame(tx_header->Identifier, tx_header->IdType, tx_header->TxFrameType, tx_header->FDFormat,
+                                         tx_header->BitRateSwitch, tx_header->ErrorStateIndicator, tx_header->DataLength, tx_data);
+}
+
+// Called from can_send_packet() for frames that produce a Tx Event.
+// The duration is stored until busload_add_tx_event() is called.
+void busload_queue_tx(FDCAN_TxHeaderTypeDef* tx_header, uint8_t* tx_data)
+{
+    if (busload_interval == 0)
+        return;
+
+    kTxPending* pending = &busload_tx_pending[busload_tx_pos];
+    busload_tx_pos = (busload_tx_pos + 1) % TX_PENDING_COUNT;
+
+    pending->key    = tx_header->Identifier | (tx_header->IdType == FDCAN_EXTENDED_ID ? 0x80000000 : 0);
+    pending->marker = tx_header->MessageMarker;
+    pending->cycles = busload_calc_frame(tx_header->Identifier, tx_header->IdType, tx_header->TxFrameType, tx_header->FDFormat,
+                                         tx_header->BitRateSwitch, tx_header->ErrorStateIndicator, tx_header->DataLength, tx_data);
+    pending->used   = true;
+}
+
+// Called from can_process() when the processor has sent a frame
+void busload_add_tx_event(FDCAN_TxEventFifoTypeDef* tx_event)
+{
+    if (busload_interval == 0)
+        return;
+
+    // In priority mode the frames are not sent in the order in which they were queued --> search by ID and marker
+    uint32_t key = tx_event->Identifier | (tx_event->IdType == FDCAN_EXTENDED_ID ? 0x80000000 : 0);
+    for (int i=1; i<=TX_PENDING_COUNT; i++)
+    {
+        kTxPending* pending = &busload_tx_pending[(busload_tx_pos + i) % TX_PENDING_COUNT]; // oldest first
+        if (pending->used && pending->key == key && pending->marker == tx_event->MessageMarker)
+        {
+            pending->used   = false;
+            busload_cycles += pending->cycles;
+            return;
+        }
+    }
+
+    // The frame was queued before the bus load report was enabled
+    busload_cycles += busload_calc_frame(tx_event->Identifier, tx_event->IdType, tx_event->TxFrameType, tx_event->FDFormat,
+                                         tx_event->BitRateSwitch, tx_event->ErrorStateIndicator, tx_event->DataLength, NULL);
+}
+
+// Called when the pending Tx requests are aborted
+void busload_clear_tx()
+{
+    for (int i=0; i<TX_PENDING_COUNT; i++)
+    {
+        busload_tx_pending[i].used = false;
+    }
+}
+
+// Called every 100 ms from can_timer_100ms() while the adapter is open
+void busload_timer_100ms()
+{
+    if (busload_interval == 0)
+        return;
+
+    // main() calls this function when at least 100 ms have elapsed, but it may be later.
+    uint32_t tick_now   = HAL_GetTick();
+    uint32_t elapsed_ms = tick_now - busload_last_tick;
+    if (elapsed_ms == 0 || busload_nom_cycles == 0)
+        return;
+
+    busload_last_tick = tick_now;
+
+    // ppm = cycles / (elapsed_ms * cycles per ms) * 1000000
+    uint64_t slot_ppm = busload_cycles * 1000000 / ((uint64_t)elapsed_ms * (system_get_can_clock() / 1000));
+    busload_cycles = 0;
+
+    // The slot ring contains busload_window slots, the oldest slot is replaced
+    if (busload_slot_count >= busload_window) busload_slot_sum -= busload_slots[busload_slot_pos];
+    else                                      busload_slot_count ++;
+
+    busload_slots[busload_slot_pos] = (slot_ppm > 1000000) ? 1000000 : (uint32_t)slot_ppm;
+    busload_slot_sum += busload_slots[busload_slot_pos];
+    busload_slot_pos  = (busload_slot_pos + 1) % busload_window;
+    busload_ppm       = busload_slot_sum / busload_slot_count;
+
+    // --------------
+
+    busload_counter ++;
+    if (busload_counter >= busload_interval)
+    {
+        busload_counter = 0;
+
+        // Suppress displaying "Bus load: 0%" eternally
+        if (busload_ppm == 0 && busload_old_ppm == 0)
+            return;
+
+        busload_old_ppm = busload_ppm;
+        control_report_busload(busload_ppm); // send busload report to the host
+    }
+}
+
+// returns the bus load in ppm (1000000 = 100%), averaged over the window
+uint32_t busload_get_ppm()
+{
+    return busload_ppm;
+}
@@ -0,0 +1,22 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#pragma once
+#include "settings.h"
+
+// The bus load is averaged over a sliding window of 1...32 slots of 100 ms (see busload.c)
+#define BUSLOAD_MAX_WINDOW      32
+#define BUSLOAD_DEFAULT_WINDOW   8
+
+void      busload_open(uint32_t nom_cycles, uint32_t data_cycles);
+eFeedback busload_enable(uint32_t interval, uint32_t window);
+void      busload_add_rx(FDCAN_RxHeaderTypeDef* rx_header, uint8_t* rx_data);
+void      busload_add_tx(FDCAN_TxHeaderTypeDef* tx_header, uint8_t* tx_data);
+void      busload_queue_tx(FDCAN_TxHeaderTypeDef* tx_header, uint8_t* tx_data);
+void      busload_add_tx_event(FDCAN_TxEventFifoTypeDef* tx_event);
+void      busload_clear_tx();
+void      busload_timer_100ms();
+uint32_t  busload_get_ppm();
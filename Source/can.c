@@ -12,35 +12,49 @@
 #include "control.h"
 #include "buffer.h"
 #include "system.h"
-
-// Bit number for each frame type with zero data length
-#define CAN_BIT_NBR_WOD_CBFF            47
-#define CAN_BIT_NBR_WOD_CEFF            67
-#define CAN_BIT_NBR_WOD_FBFF_ARBIT      30
-#define CAN_BIT_NBR_WOD_FEFF_ARBIT      49
-#define CAN_BIT_NBR_WOD_FXFF_DATA_S     26
-#define CAN_BIT_NBR_WOD_FXFF_DATA_L     30
-
-// The user can define 8 mask filters for 11 bit or 29 bit packets
-// The processor allows up to 28 standard filters and up to 8 extended filters.
-#define MAX_FILTERS                     8
+#include "cyclic.h"
+#include "isotp.h"
+#include "responder.h"
+#include "reduce.h"
+#include "idtable.h"
+#include "busload.h"
+#include "idstats.h"
+#include "bufstats.h"
+
+// The processor has 28 filter elements for 11 bit packets and 8 filter elements for 29 bit packets.
+// They are exposed to the user as one table: index 0...27 = 11 bit, index 28...35 = 29 bit.
+#define MAX_STD_FILTERS                28
+#define MAX_EXT_FILTERS                 8
+#define MAX_FILTERS                    (MAX_STD_FILTERS + MAX_EXT_FILTERS)
 #define SECOND_SAMPL_POINT_PERCENT     50  // Secondary Sample Point at 50% of data bit for TDC compensation
 #define CAN_TX_TIMEOUT                500  // after 500 ms cancel pending Tx requests --> clear FIFO and packet buffer
+#define CAN_RX_RING_SIZE               32  // Rx packets buffered by the interrupt handler (must be a power of 2)
+#define CAN_IRQ_PRIORITY                1  // higher priority than USB (2), lower than SysTick (0)
 
 // global variable, used in several places
 eUserFlags USER_Flags;
 
 // Private variables
 FDCAN_HandleTypeDef         can_handle;
-FDCAN_FilterTypeDef         can_filters[MAX_FILTERS];
 FDCAN_ProtocolStatusTypeDef cur_status; // current bus status
 
-uint32_t std_filter_count = 0;
-uint32_t ext_filter_count = 0;
 uint32_t last_tx_tick     = 0;
 int      tx_pending       = 0;
+uint32_t tx_buffer_key[3];  // Tx queue mode: CAN ID (+ 0x80000000 for 29 bit) of the frame in each hardware Tx buffer
 
 can_bitrate_cfg can_bitrate_nominal;
+
+// One filter element. The FDCAN_FilterTypeDef of the HAL needs 24 bytes, this only 12.
+typedef struct
+{
+    uint32_t id1;
+    uint32_t id2;
+    uint8_t  type;   // FDCAN_FILTER_RANGE, FDCAN_FILTER_DUAL, FDCAN_FILTER_MASK
+    uint8_t  config; // FDCAN_FILTER_DISABLE = unused, FDCAN_FILTER_TO_RXFIFO0 = accept, FDCAN_FILTER_TO_RXFIFO1 = reject
+} can_filter_element;
+
+can_filter_element can_filters[MAX_FILTERS];
+bool               open_with_accept = false; // can_open() has routed non-matching packets to FIFO 1
 can_bitrate_cfg can_bitrate_data;
 
 bool can_is_open           = false;
@@ -49,20 +63,43 @@ bool termination_on        = false; // switch 120 Ohm resistor
 bool print_bitrate_once    = true;
 bool print_chip_delay_once = true;
 
-uint32_t bit_cnt_message     = 0;
-uint32_t cycle_max_time_ns   = 0;
-uint32_t cycle_ave_time_ns   = 0;
-uint32_t nom_bit_len_ns      = 0; // for calculation of bus load
-uint32_t busload_ppm         = 0;
-uint8_t  old_busload_percent = 0;
-uint32_t busload_interval    = 0;
-uint32_t busload_counter     = 0;
 uint32_t tdc_offset          = 0;
 
+typedef enum // 8 bit
+{
+    RXP_Extended = 0x01, // FDCAN_EXTENDED_ID
+    RXP_Remote   = 0x02, // FDCAN_REMOTE_FRAME
+    RXP_Passive  = 0x04, // FDCAN_ESI_PASSIVE
+    RXP_BRS      = 0x08, // FDCAN_BRS_ON
+    RXP_FD       = 0x10, // FDCAN_FD_CAN
+    RXP_Accepted = 0x20, // from FIFO 0 (passed the filters), otherwise from FIFO 1 (rejected)
+} eRxPacketFlags;
+
+// A Rx packet that was read from the hardware Rx FIFO in the interrupt handler.
+// The header is packed into 8 bytes instead of the 40 bytes of FDCAN_RxHeaderTypeDef, so rx_ring needs less RAM.
+typedef struct
+{
+    uint32_t identifier;
+    uint32_t timestamp;  // 1 s timestamp of the start of frame on CAN bus
+    uint8_t  dlc;        // DLC code 0...15
+    uint8_t  flags;      // eRxPacketFlags
+    uint8_t  data[64];
+} can_rx_packet;
+
+// Single producer (FDCAN interrupt) / single consumer (can_process()) ring.
+// rx_head is only written by the interrupt, rx_tail is only written by the main loop.
+can_rx_packet     rx_ring[CAN_RX_RING_SIZE];
+volatile uint32_t rx_head     = 0;
+volatile uint32_t rx_tail     = 0;
+volatile bool     rx_overflow = false;
+uint8_t           rx_discard[64]; // receives the data of the packets that are dropped because rx_ring is full
+
 // Private methods
 void      can_reset();
 bool      can_apply_filters();
-uint16_t  can_calc_bit_count_in_frame(FDCAN_RxHeaderTypeDef *header);
+bool      can_write_filter(int index);
+int       can_count_accept_filters(int exclude);
+void      can_drain_rx_fifo(uint32_t fifo);
 
 // Initialize CAN peripheral settings, but don't actually start the peripheral
 void can_init()
@@ -99,6 +136,10 @@ void can_init()
     GPIO_InitStruct.Alternate = GPIO_AF9_FDCAN1;
     HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
 
+    bufstats_set_size(QUE_TxFifo, 3);
+    bufstats_set_size(QUE_RxFifo, 3);
+    bufstats_set_size(QUE_RxRing, CAN_RX_RING_SIZE);
+
     can_reset();
     can_handle.Instance = CAN_INTERFACE; // see settings.h
 }
@@ -110,12 +151,16 @@ void can_reset()
     can_bitrate_nominal.Brp = 0; // invalid = baudrate not set
     can_bitrate_data   .Brp = 0;
 
-    std_filter_count = 0;
-    ext_filter_count = 0;
-    busload_interval = 0;
+    busload_enable(0, 0);
+    bufstats_enable_report(0);
+    idstats_enable(false);
     tx_pending       = 0;
     can_is_open      = false;
 
+    // The filters are removed when the adapter is closed (like the legacy firmware),
+    // otherwise the legacy command "F" would append more filters after each open / close.
+    can_clear_filters();
+
     // this is indispensable here, otherwise Slcan is dead after a Tx buffer overlow and closing the adapter.
     buf_clear_can_buffer();
 
@@ -148,9 +193,12 @@ eFeedback can_open(uint32_t mode)
     can_handle.Init.AutoRetransmission    = (USER_Flags & USR_Retransmit) ? ENABLE : DISABLE;
     can_handle.Init.TransmitPause         = DISABLE;
     can_handle.Init.ProtocolException     = ENABLE;
-    can_handle.Init.TxFifoQueueMode       = FDCAN_TX_FIFO_OPERATION;
-    can_handle.Init.StdFiltersNbr         = std_filter_count;
-    can_handle.Init.ExtFiltersNbr         = ext_filter_count;
+    // In queue mode the 3 hardware Tx buffers are not sent in FIFO order, but the frame with the lowest CAN ID first.
+    can_handle.Init.TxFifoQueueMode       = (USER_Flags & USR_TxPriority) ? FDCAN_TX_QUEUE_OPERATION : FDCAN_TX_FIFO_OPERATION;
+    // All filter elements are always allocated in the message RAM, so any of them can be modified while the adapter is open.
+    // HAL_FDCAN_Init() clears the message RAM, so all unused elements are disabled.
+    can_handle.Init.StdFiltersNbr         = MAX_STD_FILTERS;
+    can_handle.Init.ExtFiltersNbr         = MAX_EXT_FILTERS;
 
     // ------------------- baudrate ------------------------
 
@@ -178,15 +226,10 @@ eFeedback can_open(uint32_t mode)
 
     // ------------------ init bus load ------------------------
 
-    // Calculate the length of 1 nominal CAN bus bit in nanoseconds (500 kBaud --> nom_bit_len_ns = 2000)
-
-    uint32_t clock_MHz = system_get_can_clock() / 1000000; // 160
-    nom_bit_len_ns  = 1 + can_bitrate_nominal.Seg1 + can_bitrate_nominal.Seg2; // time quantums
-    nom_bit_len_ns *= can_bitrate_nominal.Brp; // clock prescaler
-    nom_bit_len_ns *= 1000;                    // s -> ns
-    nom_bit_len_ns /= clock_MHz;
-
-    busload_ppm  = 0;
+    // The CAN clock cycles of one bit (500 kBaud --> 320 cycles @ 160 MHz)
+    uint32_t nom_cycles  = can_bitrate_nominal.Brp * (1 + can_bitrate_nominal.Seg1 + can_bitrate_nominal.Seg2);
+    uint32_t data_cycles = can_bitrate_data   .Brp * (1 + can_bitrate_data   .Seg1 + can_bitrate_data   .Seg2);
+    busload_open(nom_cycles, can_using_BRS() ? data_cycles : nom_cycles);
 
     // ------------------ init FDCAN ----------------------
 
@@ -242,27 +285,39 @@ eFeedback can_open(uint32_t mode)
     if (!can_apply_filters())
         return FBK_ErrorFromHAL;
 
-    // the user can define up to 8 filters
-    bool has_filters = (std_filter_count + ext_filter_count) > 0;
-
-    // If no user filters are defined --> accept all packets in FIFO 0 where they are sent over USB to the host.
+    // If no accept filters are defined --> accept all packets in FIFO 0 where they are sent over USB to the host.
     // Otherwise all packets that do not pass the user filters go to FIFO 1 where they only flash the blue LED.
-    uint32_t non_matching = has_filters ? FDCAN_ACCEPT_IN_RX_FIFO1 : FDCAN_ACCEPT_IN_RX_FIFO0;
+    // Reject filters also route their packets to FIFO 1. The global filter cannot be changed while the adapter is open.
+    open_with_accept = can_count_accept_filters(-1) > 0;
+    uint32_t non_matching = open_with_accept ? FDCAN_ACCEPT_IN_RX_FIFO1 : FDCAN_ACCEPT_IN_RX_FIFO0;
 
     HAL_FDCAN_ConfigGlobalFilter(&can_handle, non_matching, non_matching, FDCAN_FILTER_REMOTE, FDCAN_FILTER_REMOTE);
 
+    // -------------------- interrupts -------------------------
+
+    // Each hardware Rx FIFO can store only 3 packets. At high baudrates they overflow if the main loop is delayed.
+    // The interrupt of a new Rx packet moves all packets from the hardware FIFOs into rx_ring.
+    rx_head     = 0;
+    rx_tail     = 0;
+    rx_overflow = false;
+
+    if (HAL_FDCAN_ActivateNotification(&can_handle, FDCAN_IT_RX_FIFO0_NEW_MESSAGE | FDCAN_IT_RX_FIFO1_NEW_MESSAGE, 0) != HAL_OK)
+        return FBK_ErrorFromHAL; // error detail in can_handle.ErrorCode
+
+    // The interrupt is enabled after HAL_FDCAN_Start(), so it is never left enabled if can_open() fails.
+
     // --------------------- timestamp -------------------------
 
-    // Create a timestamp that is equal to the CAN bitrate
-    // Only needed to calculate cycle time (disabled)
-    // HAL_FDCAN_ConfigTimestampCounter(&can_handle, FDCAN_TIMESTAMP_PRESC_1);
-    // Internal does not work to get time. External use TIM3 as source. See RM0440.
-    // HAL_FDCAN_EnableTimestampCounter(&can_handle, FDCAN_TIMESTAMP_EXTERNAL);
+    // The FDCAN captures the timestamp counter at the start of frame of each Rx packet and Tx event.
+    // So the timestamps sent to the host show the timing on CAN bus, not when the main loop has processed the packet.
+    // The internal counter counts CAN bit times, which cannot be converted into a time.
+    // External uses TIM3 as source which runs with 1 MHz. See RM0440 and system_init_timestamp().
+    // The prescaler is ignored for the external counter.
+    if (HAL_FDCAN_ConfigTimestampCounter(&can_handle, FDCAN_TIMESTAMP_PRESC_1)  != HAL_OK) return FBK_ErrorFromHAL;
+    if (HAL_FDCAN_EnableTimestampCounter(&can_handle, FDCAN_TIMESTAMP_EXTERNAL) != HAL_OK) return FBK_ErrorFromHAL;
 
     // ---------------------- cleanup ---------------------------
 
-    cycle_max_time_ns     = 0;
-    cycle_ave_time_ns     = 0;
     print_bitrate_once    = true;
     print_chip_delay_once = true;
 
@@ -277,6 +332,10 @@ eFeedback can_open(uint32_t mode)
     // sets can_handle.State == HAL_FDCAN_STATE_BUSY
     if (HAL_FDCAN_Start(&can_handle) != HAL_OK) return FBK_ErrorFromHAL; // error detail in can_handle.ErrorCode
 
+    // Packets that have been received between HAL_FDCAN_Start() and here are in the hardware FIFO and raise the interrupt now.
+    HAL_NVIC_SetPriority(FDCAN1_IT0_IRQn, CAN_IRQ_PRIORITY, 0);
+    HAL_NVIC_EnableIRQ  (FDCAN1_IT0_IRQn);
+
     can_is_open = true;
     return FBK_Success;
 }
@@ -288,6 +347,7 @@ void can_close()
     if (!can_is_open)
         return;
 
+    HAL_NVIC_DisableIRQ(FDCAN1_IT0_IRQn);
     HAL_FDCAN_Stop  (&can_handle);
     HAL_FDCAN_DeInit(&can_handle);
 
@@ -296,6 +356,11 @@ void can_close()
     __HAL_RCC_FDCAN_RELEASE_RESET();
 
     can_reset();
+    cyclic_clear();
+    isotp_close();
+    responder_clear();
+    reduce_clear();
+    idtable_clear();
     led_turn_TX(LED_ON); // green on
 }
 
@@ -313,15 +378,40 @@ void can_send_packet(FDCAN_TxHeaderTypeDef* tx_header, uint8_t* tx_data)
         // On error the HAL sets can_handle.ErrorCode to HAL_FDCAN_ERROR_FIFO_FULL or HAL_FDCAN_ERROR_NOT_STARTED
         // Both errors can never happen, because this function is only called when CAN has been initialized and the FIFO is not full.
         error_assert(APP_CanTxFail, true);
+        bufstats_drop(DRP_CanTxFail, 1);
         return;
     }
 
-    if (can_handle.Init.AutoRetransmission == ENABLE)
+    bufstats_level(QUE_TxFifo, 3 - can_get_tx_free_level());
+
+    // Remember the CAN ID in the Tx buffer for can_is_tx_id_pending()
+    if (can_handle.Init.TxFifoQueueMode == FDCAN_TX_QUEUE_OPERATION)
     {
+        uint32_t index = __builtin_ctz(HAL_FDCAN_GetLatestTxFifoQRequestBuffer(&can_handle));
+        tx_buffer_key[index] = can_get_tx_key(tx_header);
+    }
+
+    if (can_handle.Init.AutoRetransmission == ENABLE)
         last_tx_tick = HAL_GetTick();
-        tx_pending ++;
+
+    // Cyclic messages (see cyclic.c) do not produce a Tx Event because the host must not receive an echo for them.
+    // So they are counted for the bus load and flash the LED already when they are passed to the Tx FIFO.
+    if (tx_header->TxEventFifoControl == FDCAN_NO_TX_EVENTS)
+    {
+        if (can_handle.Init.Mode == FDCAN_MODE_NORMAL)
+            busload_add_tx(tx_header, tx_data);
+
+        led_flash_TX(); // flash green 15 ms
+        return;
     }
 
+    // The Tx Event does not contain the data bytes that are needed to count the stuff bits
+    if (can_handle.Init.Mode == FDCAN_MODE_NORMAL)
+        busload_queue_tx(tx_header, tx_data);
+
+    if (can_handle.Init.AutoRetransmission == ENABLE)
+        tx_pending ++;
+
     // Do not flash the Tx LED here! This was wrong in the legacy Candlelight firmware.
     // The packet has not been sent yet. It is still in the Tx FIFO and will stay there until an ACK is received.
     // When an ACK is received HAL_FDCAN_GetTxEvent() will return the Tx Event and the Tx LED will be flashed.
@@ -333,7 +423,6 @@ void can_process(uint32_t tick_now)
 {
     // -------------------------- Tx Event ------------------------------------
 
-    uint8_t can_data_buf[64] = {0};
     char    dbg_msg_buf[100];
 
     // This was competely wrong in the original Candlelight firmware (fixed by Elmsoft).
@@ -352,13 +441,7 @@ void can_process(uint32_t tick_now)
         // In loopback mode do not count the same packet twice (Tx == Rx at the same time without delay)
         // In bus montoring mode and restricted mode sending packets is not possible.
         if (can_handle.Init.Mode == FDCAN_MODE_NORMAL)
-        {
-            // TxEvent and RxHeader are identical except the last 2 members, which are not needed for busload calculation.
-            FDCAN_RxHeaderTypeDef* rx_header = (FDCAN_RxHeaderTypeDef*)&tx_event;
-
-            // for bus load calculation
-            bit_cnt_message += can_calc_bit_count_in_frame(rx_header);
-        }
+            busload_add_tx_event(&tx_event); // for bus load calculation
 
         if (tx_pending > 0)
         {
@@ -370,26 +453,38 @@ void can_process(uint32_t tick_now)
 
     // -------------------------- Rx Packet ------------------------------------
 
-    // Rx FIFO 0 receives all packets that have been accepted by the filters -> write to the USB buffer
-    // Rx FIFO 0 and Rx FIFO 1 can store up to three packets each.
-    FDCAN_RxHeaderTypeDef rx_header;
-    if (HAL_FDCAN_GetRxMessage(&can_handle, FDCAN_RX_FIFO0, &rx_header, can_data_buf) == HAL_OK)
+    // The interrupt handler has moved the packets from the hardware Rx FIFOs into rx_ring.
+    // Process only the packets that are in the ring now, new packets will be processed in the next loop.
+    uint32_t head = rx_head;
+    while (rx_tail != head)
     {
-        buf_store_rx_packet(&rx_header, can_data_buf);
-
-        // for bus load calculation
-        bit_cnt_message += can_calc_bit_count_in_frame(&rx_header);
-
-        led_flash_RX(); // flash 15 ms
-    }
+        can_rx_packet* packet = &rx_ring[rx_tail & (CAN_RX_RING_SIZE - 1)];
+
+        FDCAN_RxHeaderTypeDef header = {0};
+        header.Identifier          = packet->identifier;
+        header.DataLength          = packet->dlc;
+        header.IdType              = (packet->flags & RXP_Extended) ? FDCAN_EXTENDED_ID  : FDCAN_STANDARD_ID;
+        header.RxFrameType         = (packet->flags & RXP_Remote)   ? FDCAN_REMOTE_FRAME : FDCAN_DATA_FRAME;
+        header.ErrorStateIndicator = (packet->flags & RXP_Passive)  ? FDCAN_ESI_PASSIVE  : FDCAN_ESI_ACTIVE;
+        header.BitRateSwitch       = (packet->flags & RXP_BRS)      ? FDCAN_BRS_ON       : FDCAN_BRS_OFF;
+        header.FDFormat            = (packet->flags & RXP_FD)       ? FDCAN_FD_CAN       : FDCAN_CLASSIC_CAN;
+
+        // Rx FIFO 0 receives all packets that have been accepted by the filters -> write to the USB buffer
+        // Rx FIFO 1 receives all packets that have been rejected by the filters -> only flash the blue LED
+        // Packets of the ISO-TP channel are processed in isotp.c, even if the filters reject them.
+        // Automatic responses are sent first, so the host does not delay them.
+        // Periodic packets with unchanged data may be held back by the reduction rules in reduce.c.
+        // The statistics in idstats.c count all packets.
+        bool accepted = (packet->flags & RXP_Accepted) != 0;
+        idstats_receive(&header, packet->timestamp);
+        responder_receive(&header, packet->data, packet->timestamp);
+        if (!isotp_receive(&header, packet->data) && accepted && reduce_forward(&header, packet->data, packet->timestamp))
+            buf_store_rx_packet(&header, packet->data, packet->timestamp);
 
-    // Rx FIFO 1 receives all packets that have been rejected by the filters -> only flash the blue LED
-    // Rx FIFO 0 and Rx FIFO 1 can store up to three packets each.
-    if (HAL_FDCAN_GetRxMessage(&can_handle, FDCAN_RX_FIFO1, &rx_header, can_data_buf) == HAL_OK)
-    {
         // for bus load calculation
-        bit_cnt_message += can_calc_bit_count_in_frame(&rx_header);
+        busload_add_rx(&header, packet->data);
 
+        rx_tail ++; // release the slot after the packet has been copied
         led_flash_RX(); // flash 15 ms
     }
 
@@ -399,13 +494,22 @@ void can_process(uint32_t tick_now)
     if (__HAL_FDCAN_GET_FLAG(&can_handle, FDCAN_FLAG_TX_EVT_FIFO_ELT_LOST))
     {
         error_assert(APP_CanTxFail, false);
+        bufstats_drop(DRP_TxEventLost, 1);
         __HAL_FDCAN_CLEAR_FLAG(&can_handle, FDCAN_FLAG_TX_EVT_FIFO_ELT_LOST);
     }
 
+    // rx_ring was full when the interrupt handler tried to store a packet
+    if (rx_overflow)
+    {
+        rx_overflow = false;
+        error_assert(APP_CanRxFail, false);
+    }
+
     // Rx FIFO 0 packet lost
     if (__HAL_FDCAN_GET_FLAG(&can_handle, FDCAN_FLAG_RX_FIFO0_MESSAGE_LOST))
     {
         error_assert(APP_CanRxFail, false);
+        bufstats_drop(DRP_RxFifoLost, 1);
         __HAL_FDCAN_CLEAR_FLAG(&can_handle, FDCAN_FLAG_RX_FIFO0_MESSAGE_LOST);
     }
 
@@ -413,6 +517,7 @@ void can_process(uint32_t tick_now)
     if (__HAL_FDCAN_GET_FLAG(&can_handle, FDCAN_FLAG_RX_FIFO1_MESSAGE_LOST))
     {
         error_assert(APP_CanRxFail, false);
+        bufstats_drop(DRP_RxFifoLost, 1);
         __HAL_FDCAN_CLEAR_FLAG(&can_handle, FDCAN_FLAG_RX_FIFO1_MESSAGE_LOST);
     }
 
@@ -424,37 +529,22 @@ void can_process(uint32_t tick_now)
 
     // If a message hangs longer than a few milliseconds in the Tx FIFO this means that it was not acknowledged.
     // The processor continues to send the message !!ETERNALLY!! producing a bus load of 95%.
-    // Tx requests must be canceled by firmware to free CAN bus from the congestion.
+    // Tx requests must be canceled by firmware to free CAN bus from the congestion.
     // the processor will never stop alone sending the same packet over and over again.
-    if (tx_pending > 0 && tick_now >= last_tx_tick + CAN_TX_TIMEOUT)
+    // Cyclic messages are not counted in tx_pending, but if they are not acknowledged they block all Tx buffers.
+    bool tx_hangs = tx_pending > 0 || (can_handle.Init.AutoRetransmission == ENABLE && can_get_tx_free_level() == 0);
+    if (tx_hangs && tick_now >= last_tx_tick + CAN_TX_TIMEOUT)
     {
+        // count the frames in the hardware Tx buffers and in the Tx buffer that are discarded
+        bufstats_drop(DRP_CanTxTimeout, 3 - can_get_tx_free_level() + buf_get_can_count());
+
         tx_pending = 0;
         HAL_FDCAN_AbortTxRequest(&can_handle, FDCAN_TX_BUFFER0 | FDCAN_TX_BUFFER1 | FDCAN_TX_BUFFER2);
+        busload_clear_tx();
         buf_clear_can_buffer();
         error_assert(APP_CanTxTimeout, false);
     }
 
-    // --------------------------- Calculate Cycle Time ---------------------------
-
-    /*
-    // this code was written by Nakanishi Kiyomaro.
-    static uint32_t last_time_stamp_cnt = 0;
-
-    uint16_t curr_time_stamp_cnt = HAL_FDCAN_GetTimestampCounter(&can_handle);
-    uint32_t cycle_time_ns;
-    if (last_time_stamp_cnt <= curr_time_stamp_cnt)
-        cycle_time_ns = ((uint32_t)curr_time_stamp_cnt - last_time_stamp_cnt) * 1000;
-    else // counter rollover
-        cycle_time_ns = ((uint32_t)UINT16_MAX - last_time_stamp_cnt + 1 + curr_time_stamp_cnt) * 1000;
-
-    if (cycle_max_time_ns < cycle_time_ns)
-        cycle_max_time_ns = cycle_time_ns;
-
-    cycle_ave_time_ns = ((uint32_t)cycle_ave_time_ns * 15 + cycle_time_ns) >> 4;
-
-    last_time_stamp_cnt = curr_time_stamp_cnt;
-    */
-
     // ------------------------ print bitrate ---------------------------------
 
     // Important: This function must be called from the main loop, not from can_open()
@@ -489,6 +579,63 @@ void can_process(uint32_t tick_now)
     }
 }
 
+// Interrupt: a new packet has arrived in Rx FIFO 0 (accepted by the filters)
+void HAL_FDCAN_RxFifo0Callback(FDCAN_HandleTypeDef *hfdcan, uint32_t RxFifo0ITs)
+{
+    if (RxFifo0ITs & FDCAN_IT_RX_FIFO0_NEW_MESSAGE)
+        can_drain_rx_fifo(FDCAN_RX_FIFO0);
+}
+
+// Interrupt: a new packet has arrived in Rx FIFO 1 (rejected by the filters)
+void HAL_FDCAN_RxFifo1Callback(FDCAN_HandleTypeDef *hfdcan, uint32_t RxFifo1ITs)
+{
+    if (RxFifo1ITs & FDCAN_IT_RX_FIFO1_NEW_MESSAGE)
+        can_drain_rx_fifo(FDCAN_RX_FIFO1);
+}
+
+// Called from the interrupt handler.
+// Move ALL packets from the hardware Rx FIFO into rx_ring, so the FIFO can never overflow while the main loop is busy.
+// If rx_ring is full the packet is dropped and can_process() reports APP_CanRxFail to the host.
+void can_drain_rx_fifo(uint32_t fifo)
+{
+    uint32_t level;
+    while ((level = HAL_FDCAN_GetRxFifoFillLevel(&can_handle, fifo)) > 0)
+    {
+        bufstats_level(QUE_RxFifo, level);
+
+        uint32_t       head   = rx_head;
+        bool           full   = (head - rx_tail) >= CAN_RX_RING_SIZE;
+        can_rx_packet* packet = &rx_ring[head & (CAN_RX_RING_SIZE - 1)];
+
+        // The packet must be read even if rx_ring is full, otherwise the FIFO element is not freed.
+        FDCAN_RxHeaderTypeDef header;
+        if (HAL_FDCAN_GetRxMessage(&can_handle, fifo, &header, full ? rx_discard : packet->data) != HAL_OK)
+            break;
+
+        if (full)
+        {
+            rx_overflow = true;
+            bufstats_drop(DRP_RxRingFull, 1);
+            continue;
+        }
+
+        // RxTimestamp is 16 bit only. The interrupt handler converts it immediately before TIM3 rolls over.
+        packet->timestamp  = system_extend_timestamp(header.RxTimestamp);
+        packet->identifier = header.Identifier;
+        packet->dlc        = (uint8_t)header.DataLength;
+        packet->flags      = 0;
+        if (header.IdType              == FDCAN_EXTENDED_ID)  packet->flags |= RXP_Extended;
+        if (header.RxFrameType         == FDCAN_REMOTE_FRAME) packet->flags |= RXP_Remote;
+        if (header.ErrorStateIndicator == FDCAN_ESI_PASSIVE)  packet->flags |= RXP_Passive;
+        if (header.BitRateSwitch       == FDCAN_BRS_ON)       packet->flags |= RXP_BRS;
+        if (header.FDFormat            == FDCAN_FD_CAN)       packet->flags |= RXP_FD;
+        if (fifo                       == FDCAN_RX_FIFO0)     packet->flags |= RXP_Accepted;
+        __DMB(); // the packet must be completely written before it is published
+        rx_head = head + 1;
+        bufstats_level(QUE_RxRing, rx_head - rx_tail);
+    }
+}
+
 // ATTENTION:
 // The state BusOff (after 248 Tx errors) is a fatal situation where the CAN module is completely blocked.
 // No further transmit operations are possible.
@@ -507,6 +654,7 @@ void can_recover_bus_off()
             control_send_debug_mesg(">> Start recovery from Bus Off");
 
             HAL_FDCAN_AbortTxRequest(&can_handle, FDCAN_TX_BUFFER0 | FDCAN_TX_BUFFER1 | FDCAN_TX_BUFFER2);
+            busload_clear_tx();
             HAL_FDCAN_Stop (&can_handle);
             HAL_FDCAN_Start(&can_handle);
         }
@@ -525,39 +673,13 @@ void can_recover_bus_off()
 }
 
 // Called every 100 ms from main()
-// Calculate bus load, written (and hopefully tested well) by Nakanishi Kiyomaro.
 void can_timer_100ms()
 {
-    if (busload_interval == 0 || !can_is_open)
-        return;
-
-    // The bus load calculation is very rough, as bit stuffing is not considered.
-    // There may be 1 stuff bit for 5 payload bits.
-    // This constant increases the busload by 10% to compensate this.
-    const uint32_t BUS_LOAD_BUILDUP_PPM = 1125000;
-
-    uint32_t rate_us_per_ms = (uint32_t)bit_cnt_message * nom_bit_len_ns / 1000 / 100; // MAX: 1000 @ 1Mbps
-
-    // This calculation is a kind of moving average.
-    // It is implemented to suppress excessive fluctuations.
-    busload_ppm = (busload_ppm * 7 + BUS_LOAD_BUILDUP_PPM * rate_us_per_ms / 1000) >> 3;
-    bit_cnt_message = 0;
-
-    // --------------
-
-    if (busload_counter >= busload_interval)
+    if (can_is_open)
     {
-        uint8_t new_busload = MIN(99, busload_ppm / 10000);
-
-        // Suppress displaying "Bus load: 0%" eternally
-        if (new_busload == 0 && old_busload_percent == 0)
-            return;
-
-        old_busload_percent = new_busload;
-        control_report_busload(new_busload); // send busload report to the host
-        busload_counter = 0;
+        busload_timer_100ms();
+        bufstats_timer_100ms();
     }
-    busload_counter ++;
 }
 
 // ----------------------------------------------------------------------------------------------
@@ -664,7 +786,7 @@ eFeedback can_set_data_baudrate(can_data_bitrate bitrate)
             can_bitrate_data.Seg1 = 11;
             can_bitrate_data.Seg2 = 4;
             break;
-        // For any strange reason the STM32G431 works at 8 Mbaud only if the samplepoint is 50%.
+        // For any strange reason the STM32G431 works at 8 Mbaud only if the samplepoint is 50%.
         // But at 10 Mbaud it works with 75%. Very weird!
         case CAN_DATA_BITRATE_8M:
             can_bitrate_data.Brp  = 2; // 160 MHz / 2 / (1 + 4 + 5) = 8 MBaud
@@ -788,68 +910,143 @@ void can_print_info()
 
 // ----------------------------------------------------------------------------------------------
 
-// The processor allows up to 28 standard filters and up to 8 extended filters.
-// Nobody needs so many filters -> allow 8 user filters.
+// The processor allows up to 28 standard filters and up to 8 extended filters. All of them are available to the user.
 // Rx FIFO 0 receives all packets that pass. They are sent to the host application over USB.
 // Rx FIFO 1 receives all packets that are rejected, they only flash the blue LED.
 // Each FIFO can store 3 Rx packets before it is full.
 // ---------------------------------------------------------
-// While all industry CAN bus adapters allow to set filters after opening the adapter, the STM32 processor is very restricted.
 // The values can_handle.Init.StdFiltersNbr and ExtFiltersNbr cannot be modified anymore after opening the adapter.
-// But HAL_FDCAN_ConfigFilter() can be called after opening the adapter.
-// So the only possible filter modification after opening the adapter is to modify ONE existing filter.
-// The filter type must be the same (11 bit or 29 bit).
-eFeedback can_set_mask_filter(bool extended, uint32_t filter, uint32_t mask)
+// Therefore can_open() always allocates all 36 elements, unused elements are disabled.
+// HAL_FDCAN_ConfigFilter() can be called after opening the adapter, so each element can be modified while on bus.
+// ---------------------------------------------------------
+// Set one filter element.
+// index = 0...27 for 11 bit CAN IDs, 28...35 for 29 bit CAN IDs.
+// If a packet matches multiple filters, the filter with the lowest index decides.
+// type  = eFilterType: FLT_Mask:  id1 = filter, id2 = mask
+//                      FLT_Range: id1 = first CAN ID, id2 = last CAN ID
+//                      FLT_Dual:  id1 = first CAN ID, id2 = second CAN ID
+//         + FLT_Reject: packets that match the filter are not sent to the host.
+// Reject filters do not discard the packets in hardware, they are routed to FIFO 1 like non-matching packets,
+// so they still flash the LED, are counted in the bus load and are seen by ISO-TP and the responder.
+// While the adapter is open any element can be modified, as long as the existence of accept filters does not change,
+// because the route of non-matching packets can only be changed while the adapter is closed.
+eFeedback can_set_filter(uint32_t index, uint32_t type, uint32_t id1, uint32_t id2)
 {
-    int tot_filters = std_filter_count + ext_filter_count;
-    if (tot_filters >= MAX_FILTERS)
+    uint32_t filter_type = type & ~FLT_Reject;
+    if (index >= MAX_FILTERS || filter_type > FLT_Mask)
+        return FBK_InvalidParameter;
+
+    uint32_t maximum = (index >= MAX_STD_FILTERS) ? 0x1FFFFFFF : 0x7FF;
+    if (id1 > maximum || id2 > maximum)
+        return FBK_InvalidParameter;
+
+    if (filter_type == FLT_Range && id1 > id2)
         return FBK_InvalidParameter;
 
-    uint32_t maximum = extended ? 0x1FFFFFFF : 0x7FF;
-    if (filter > maximum || mask > maximum)
+    uint8_t config = (type & FLT_Reject) ? FDCAN_FILTER_TO_RXFIFO1 : FDCAN_FILTER_TO_RXFIFO0;
+    if (can_is_open && (can_count_accept_filters(index) + (config == FDCAN_FILTER_TO_RXFIFO0) > 0) != open_with_accept)
+        return FBK_AdapterMustBeClosed;
+
+    // The FLT_ values are identical with FDCAN_FILTER_RANGE, FDCAN_FILTER_DUAL, FDCAN_FILTER_MASK
+    can_filters[index].type   = filter_type;
+    can_filters[index].config = config;
+    can_filters[index].id1    = id1;
+    can_filters[index].id2    = id2;
+
+    if (can_is_open && !can_write_filter(index))
+        return FBK_ErrorFromHAL;
+
+    return FBK_Success;
+}
+
+// Disable one filter element (index = 0...35)
+eFeedback can_remove_filter(uint32_t index)
+{
+    if (index >= MAX_FILTERS)
         return FBK_InvalidParameter;
 
+    if (can_is_open && (can_count_accept_filters(index) > 0) != open_with_accept)
+        return FBK_AdapterMustBeClosed;
+
+    can_filters[index].config = FDCAN_FILTER_DISABLE;
+
+    if (can_is_open && !can_write_filter(index))
+        return FBK_ErrorFromHAL;
+
+    return FBK_Success;
+}
+
+// Legacy command: add an acceptance mask filter in the first unused element of the type.
+// While the adapter is open only one existing filter of the same type can be replaced (used by HUD ECU Hacker).
+eFeedback can_set_mask_filter(bool extended, uint32_t filter, uint32_t mask)
+{
+    int first = extended ? MAX_STD_FILTERS : 0;
+    int last  = extended ? MAX_FILTERS     : MAX_STD_FILTERS;
     if (can_is_open)
     {
-        // only one existing filter can be modified if the adapter is already open
-        if (tot_filters != 1)
-            return FBK_AdapterMustBeClosed;
+        int used  = 0;
+        int index = 0;
+        for (int i=0; i<MAX_FILTERS; i++)
+        {
+            if (can_filters[i].config != FDCAN_FILTER_DISABLE)
+            {
+                used ++;
+                index = i;
+            }
+        }
 
+        // only one existing filter can be modified if the adapter is already open
         // the filter to be modified must be from the same type
-        if (extended != (ext_filter_count == 1))
+        if (used != 1 || index < first || index >= last)
             return FBK_AdapterMustBeClosed;
 
-        // modify the one and only filter at index 0
-        ext_filter_count = 0;
-        std_filter_count = 0;
-        tot_filters      = 0;
+        return can_set_filter(index, FLT_Mask, filter, mask);
     }
 
-    can_filters[tot_filters].IdType       = extended ? FDCAN_EXTENDED_ID : FDCAN_STANDARD_ID;
-    can_filters[tot_filters].FilterIndex  = extended ? ext_filter_count  : std_filter_count;
-    can_filters[tot_filters].FilterType   = FDCAN_FILTER_MASK;
-    can_filters[tot_filters].FilterConfig = FDCAN_FILTER_TO_RXFIFO0;
-    can_filters[tot_filters].FilterID1    = filter;
-    can_filters[tot_filters].FilterID2    = mask;
-
-    if (extended) ext_filter_count ++;
-    else          std_filter_count ++;
+    for (int i=first; i<last; i++)
+    {
+        if (can_filters[i].config == FDCAN_FILTER_DISABLE)
+            return can_set_filter(i, FLT_Mask, filter, mask);
+    }
+    return FBK_InvalidParameter; // all elements of the type are used
+}
 
-    if (can_is_open && !can_apply_filters())
-        return FBK_ErrorFromHAL;
+// Count the acceptance filters, excluding the element at 'exclude' (-1 = count all)
+int can_count_accept_filters(int exclude)
+{
+    int count = 0;
+    for (int i=0; i<MAX_FILTERS; i++)
+    {
+        if (i != exclude && can_filters[i].config == FDCAN_FILTER_TO_RXFIFO0)
+            count ++;
+    }
+    return count;
+}
 
-    return FBK_Success;
+// Store one filter element into the processor's message RAM
+bool can_write_filter(int index)
+{
+    bool extended = index >= MAX_STD_FILTERS;
+
+    FDCAN_FilterTypeDef element;
+    element.IdType       = extended ? FDCAN_EXTENDED_ID : FDCAN_STANDARD_ID;
+    element.FilterIndex  = extended ? index - MAX_STD_FILTERS : index;
+    element.FilterType   = can_filters[index].type;
+    element.FilterConfig = can_filters[index].config;
+    element.FilterID1    = can_filters[index].id1;
+    element.FilterID2    = can_filters[index].id2;
+
+    // HAL_FDCAN_ConfigFilter() works also while the adapter is open
+    return HAL_FDCAN_ConfigFilter(&can_handle, &element) == HAL_OK; // error detail in can_handle.ErrorCode
 }
 
 // Store all user filters in can_filters into the processor's memory
 bool can_apply_filters()
 {
-    // the user can define up to 8 filters
-    int tot_filters = std_filter_count + ext_filter_count;
-    for (int i=0; i<tot_filters; i++)
+    for (int i=0; i<MAX_FILTERS; i++)
     {
-        if (HAL_FDCAN_ConfigFilter(&can_handle, &can_filters[i]) != HAL_OK) 
-            return false; // error detail in can_handle.ErrorCode
+        if (can_filters[i].config != FDCAN_FILTER_DISABLE && !can_write_filter(i))
+            return false;
     }
     return true;
 }
@@ -860,8 +1057,10 @@ eFeedback can_clear_filters()
     if (can_is_open)
         return FBK_AdapterMustBeClosed; // cannot clear filters while on bus
 
-    ext_filter_count = 0;
-    std_filter_count = 0;
+    for (int i=0; i<MAX_FILTERS; i++)
+    {
+        can_filters[i].config = FDCAN_FILTER_DISABLE;
+    }
     return FBK_Success;
 }
 
@@ -890,21 +1089,6 @@ bool can_get_termination(bool* enabled)
 
 // ----------------------------------------------------------------------------------------------
 
-// interval =   0 --> disable busload report
-// interval =   1 --> report busload every 100 ms     (minimum)
-// interval =   7 --> report busload every 700 ms
-// interval = 100 --> report busload every 10 seconds (maximum)
-eFeedback can_enable_busload(uint32_t interval)
-{
-    if (interval > 100)
-        return FBK_InvalidParameter;
-
-    busload_interval = interval;
-    return FBK_Success;
-}
-
-// ----------------------------------------------------------------------------------------------
-
 // Return bus status
 bool can_is_opened()
 {
@@ -939,82 +1123,58 @@ eFeedback can_is_tx_allowed()
     return FBK_Success;
 }
 
-// Return reference to CAN handle
-FDCAN_HandleTypeDef *can_get_handle()
+// Returns the count of free hardware Tx buffers (0...3)
+// HAL_FDCAN_GetTxFifoFreeLevel() cannot be used because the hardware returns always zero in Tx queue mode.
+uint32_t can_get_tx_free_level()
 {
-    return &can_handle;
-}
+    if (can_handle.Init.TxFifoQueueMode == FDCAN_TX_FIFO_OPERATION)
+        return HAL_FDCAN_GetTxFifoFreeLevel(&can_handle);
 
-// Return the maximum cycle time in nano seconds
-uint32_t can_get_cycle_max_time_ns()
-{
-    return cycle_max_time_ns;
+    // count the Tx buffers that have no pending transmission request
+    return 3 - __builtin_popcount(can_handle.Instance->TXBRP & 7);
 }
 
-// Return the average cycle time in nano seconds
-uint32_t can_get_cycle_ave_time_ns()
+// Returns the CAN ID of a Tx frame + 0x80000000 for 29 bit IDs
+uint32_t can_get_tx_key(FDCAN_TxHeaderTypeDef* tx_header)
 {
-    return cycle_ave_time_ns;
+    return tx_header->Identifier | ((tx_header->IdType == FDCAN_EXTENDED_ID) ? 0x80000000 : 0);
 }
 
-// ---------------------------------------------------------------------------------------------------
-
-// Calculate the transmission duration of a CAN frame.
-// This code was written by Nakanishi Kiyomaro (and hopefully tested well).
-uint16_t can_calc_bit_count_in_frame(FDCAN_RxHeaderTypeDef* header)
+// Tx queue mode (USR_TxPriority): the hardware sends frames with the same CAN ID in the order of the Tx buffer index,
+// not in the order in which they were added. So a later frame could overtake an earlier frame with the same ID.
+// returns true if a frame with the same CAN ID is still pending in a hardware Tx buffer. The caller must wait until it has been sent.
+// In Tx FIFO mode the hardware keeps the order, this returns always false.
+bool can_is_tx_id_pending(FDCAN_TxHeaderTypeDef* tx_header)
 {
-    if (busload_interval == 0)
-        return 0;
+    if (can_handle.Init.TxFifoQueueMode == FDCAN_TX_FIFO_OPERATION)
+        return false;
 
-    uint32_t byte_count = utils_dlc_to_byte_count(header->DataLength);
-
-    uint16_t time_msg, time_data;
-    if (header->RxFrameType == FDCAN_REMOTE_FRAME && header->IdType == FDCAN_STANDARD_ID)
-    {
-        time_msg = CAN_BIT_NBR_WOD_CBFF;
-    }
-    else if (header->RxFrameType == FDCAN_REMOTE_FRAME && header->IdType == FDCAN_EXTENDED_ID)
-    {
-        time_msg = CAN_BIT_NBR_WOD_CEFF;
-    }
-    else if (header->FDFormat == FDCAN_CLASSIC_CAN && header->IdType == FDCAN_STANDARD_ID)
+    uint32_t key     = can_get_tx_key(tx_header);
+    uint32_t pending = can_handle.Instance->TXBRP & 7;
+    for (int i=0; i<3; i++)
     {
-        time_msg = CAN_BIT_NBR_WOD_CBFF + (uint16_t)byte_count * 8;
+        if ((pending & (1 << i)) && tx_buffer_key[i] == key)
+            return true;
     }
-    else if (header->FDFormat == FDCAN_CLASSIC_CAN && header->IdType == FDCAN_EXTENDED_ID)
-    {
-        time_msg = CAN_BIT_NBR_WOD_CEFF + (uint16_t)byte_count * 8;
-    }
-    else // for FD frames
-    {
-        if (header->IdType == FDCAN_STANDARD_ID) time_msg = CAN_BIT_NBR_WOD_FBFF_ARBIT;
-        else                                        time_msg = CAN_BIT_NBR_WOD_FEFF_ARBIT;
-
-        if (byte_count <= 16)
-            time_data = CAN_BIT_NBR_WOD_FXFF_DATA_S;    // Short CRC
-        else
-            time_data = CAN_BIT_NBR_WOD_FXFF_DATA_L;    // Long CRC
-
-        time_data = time_data + (uint16_t)byte_count * 8;
+    return false;
+}
 
-        if (header->BitRateSwitch == FDCAN_BRS_ON)
-        {
-            if (can_bitrate_nominal.Brp == 0) return 0;   // Uninitialized bitrate (avoid zero-div)
+// Returns the priority of a Tx frame in the CAN bus arbitration. The smaller value wins.
+// The bits are compared in the order of the arbitration field:
+// bit 21...31 = 11 bit base ID, bit 20 = RTR (11 bit) or SRR (29 bit, always recessive), bit 19 = IDE,
+// bit 1...18 = ID extension (29 bit), bit 0 = RTR (29 bit).
+// So with the same base ID an 11 bit data frame wins before an 11 bit remote frame which wins before all 29 bit frames.
+uint32_t can_get_tx_priority(uint32_t identifier, bool extended, bool remote)
+{
+    if (!extended)
+        return (identifier << 21) | (remote << 20);
 
-            uint32_t rate_ppm;  // Nominal bit time vs data bit time
-            rate_ppm = ((uint32_t)1 + can_bitrate_data.Seg1 + can_bitrate_data.Seg2);
-            rate_ppm = rate_ppm * can_bitrate_data.Brp;     // Tq in one bit (data)
-            rate_ppm = rate_ppm * 1000000;  // MAX: 32 * (32 + 16) * 1000000
-            rate_ppm = rate_ppm / ((uint32_t)1 + can_bitrate_nominal.Seg1 + can_bitrate_nominal.Seg2);
-            rate_ppm = rate_ppm / can_bitrate_nominal.Brp;
+    return ((identifier >> 18) << 21) | (1 << 20) | (1 << 19) | ((identifier & 0x3FFFF) << 1) | remote;
+}
 
-            time_msg = time_msg + ((uint32_t)time_data * rate_ppm) / 1000000;
-        }
-        else
-        {
-            time_msg = time_msg + time_data;
-        }
-    }
-    return time_msg;
+// Return reference to CAN handle
+FDCAN_HandleTypeDef *can_get_handle()
+{
+    return &can_handle;
 }
 
@@ -51,6 +51,16 @@ typedef struct
     uint32_t  Sjw;  // synchronization jump width  
 } can_bitrate_cfg;
 
+// The type of a filter element (see can_set_filter())
+// The values 0...2 are identical with FDCAN_FILTER_RANGE, FDCAN_FILTER_DUAL, FDCAN_FILTER_MASK
+typedef enum // 8 bit
+{
+    FLT_Range  = 0,    // accept CAN IDs from ID1 to ID2
+    FLT_Dual   = 1,    // accept the two CAN IDs ID1 and ID2
+    FLT_Mask   = 2,    // classic filter: ID1 = filter, ID2 = mask
+    FLT_Reject = 0x80, // flag: packets that match the filter are not sent to the host
+} eFilterType;
+
 typedef struct
 {
     uint8_t  marker;
@@ -77,7 +87,6 @@ eFeedback can_set_baudrate     (can_nom_bitrate bitrate);
 eFeedback can_set_data_baudrate(can_data_bitrate bitrate);
 eFeedback can_set_nom_bit_timing (uint32_t BRP, uint32_t Seg1, uint32_t Seg2, uint32_t Sjw);
 eFeedback can_set_data_bit_timing(uint32_t BRP, uint32_t Seg1, uint32_t Seg2, uint32_t Sjw);
-eFeedback can_enable_busload(uint32_t interval);
 bool      can_set_termination(bool enable);
 bool      can_get_termination(bool* enabled);
 void      can_print_info();
@@ -86,10 +95,14 @@ bool      can_is_passive();
 bool      can_using_FD();
 bool      can_using_BRS();
 eFeedback can_is_tx_allowed();
+uint32_t  can_get_tx_free_level();
+uint32_t  can_get_tx_priority(uint32_t identifier, bool extended, bool remote);
+uint32_t  can_get_tx_key(FDCAN_TxHeaderTypeDef* tx_header);
+bool      can_is_tx_id_pending(FDCAN_TxHeaderTypeDef* tx_header);
+eFeedback can_set_filter(uint32_t index, uint32_t type, uint32_t id1, uint32_t id2);
+eFeedback can_remove_filter(uint32_t index);
 eFeedback can_set_mask_filter(bool extended, uint32_t filter, uint32_t mask);
 eFeedback can_clear_filters();
-uint32_t  can_get_cycle_ave_time_ns();
-uint32_t  can_get_cycle_max_time_ns();
 void      can_recover_bus_off();
 
 FDCAN_HandleTypeDef *can_get_handle();
@@ -0,0 +1,194 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#include "settings.h"
+#include "cyclic.h"
+#include "can.h"
+#include "utils.h"
+#include "system.h"
+
+// Cyclic transmit scheduler.
+// If the host sends periodic messages over USB the period jitters with the 1 ms USB frames and the load of the operating system.
+// Here the firmware sends the messages itself with the 1 s timestamp of TIM2.
+// The main loop runs approx 100 times in one millisecond, so the jitter is in the range of 10 s as long as the CAN bus is free.
+// cyclic_process() is called before buf_process(), so the cyclic messages get a free Tx buffer before the messages from the host.
+// All entries have a common time base, so the phase offsets of different entries have a fixed relation to each other.
+// Cyclic messages are sent without Tx Event, so the host never receives a Tx echo for them (see can_send_packet()).
+// The table is cleared when the adapter is closed.
+// Candlelight calls cyclic_set(), cyclic_remove() and cyclic_clear() from the USB interrupt.
+// So cyclic_process() accesses an entry only while the interrupts are disabled and sends a copy of it.
+
+// The entries store only the members of FDCAN_TxHeaderTypeDef that are not constant (RAM is scarce on the STM32G431).
+typedef enum // 8 bit
+{
+    CYC_Extended = 0x01,
+    CYC_Remote   = 0x02,
+    CYC_FD       = 0x04,
+    CYC_BRS      = 0x08,
+} eCyclicFlags;
+
+typedef struct
+{
+    uint32_t identifier;
+    uint32_t period_us;     // 0 = the entry is not used
+    uint32_t next_us;       // timestamp when the message will be sent the next time
+    uint8_t  dlc;
+    uint8_t  flags;         // eCyclicFlags
+    uint8_t  counter_pos;   // 0 = no counter,  1...64 = the data byte that is incremented with each message
+    uint8_t  checksum_pos;  // 0 = no checksum, 1...64 = the data byte that receives the 8 bit sum of all other data bytes
+    uint8_t  data[64];
+} kCyclicEntry;
+
+kCyclicEntry cyclic_table[CYCLIC_MAX_ENTRIES];
+uint32_t     cyclic_count = 0; // count of active entries
+uint64_t     cyclic_base  = 0; // time base for the phase offsets, set when the first entry is added
+
+// Remove all cyclic messages
+void cyclic_clear()
+{
+    for (int i=0; i<CYCLIC_MAX_ENTRIES; i++)
+    {
+        cyclic_table[i].period_us = 0;
+    }
+    cyclic_count = 0;
+}
+
+// Add or replace a cyclic message.
+// index         = 0...31
+// period_us     = the interval in which the message is sent (minimum 100 s)
+// phase_us      = the offset of the first message from the common time base (must be smaller than the period)
+// counter_byte  = 0 = no counter,  1...64 = this data byte is incremented before each message
+// checksum_byte = 0 = no checksum, 1...64 = this data byte is set to the 8 bit sum of all other data bytes before each message
+// The header must be filled completely with the CAN ID, frame type, DLC and the FD flags.
+eFeedback cyclic_set(uint32_t index, FDCAN_TxHeaderTypeDef* tx_header, uint8_t* tx_data,
+                     uint32_t period_us, uint32_t phase_us, uint32_t counter_byte, uint32_t checksum_byte)
+{
+    // Bus off is only temporary. The messages are sent again after recovery.
+    eFeedback e_Ret = can_is_tx_allowed();
+    if (e_Ret != FBK_Success && e_Ret != FBK_BusIsOff)
+        return e_Ret;
+
+    if (index >= CYCLIC_MAX_ENTRIES || period_us < CYCLIC_MIN_PERIOD_US || phase_us >= period_us)
+        return FBK_InvalidParameter;
+
+    // Sending a message with FDF flag requires a data baudrate to be set.
+    if (tx_header->FDFormat == FDCAN_FD_CAN && !can_using_FD())
+        return FBK_BaudrateNotSet;
+
+    uint32_t byte_count = (tx_header->TxFrameType == FDCAN_REMOTE_FRAME) ? 0 : utils_dlc_to_byte_count(tx_header->DataLength);
+    if (counter_byte > byte_count || checksum_byte > byte_count || (counter_byte > 0 && counter_byte == checksum_byte))
+        return FBK_InvalidParameter;
+
+    uint64_t now = system_get_timestamp64();
+    kCyclicEntry* entry = &cyclic_table[index];
+    if (entry->period_us == 0)
+    {
+        if (cyclic_count == 0)
+            cyclic_base = now;
+        cyclic_count ++;
+    }
+
+    entry->identifier = tx_header->Identifier;
+    entry->dlc        = tx_header->DataLength;
+    entry->flags      = 0;
+    if (tx_header->IdType        == FDCAN_EXTENDED_ID)  entry->flags |= CYC_Extended;
+    if (tx_header->TxFrameType   == FDCAN_REMOTE_FRAME) entry->flags |= CYC_Remote;
+    if (tx_header->FDFormat      == FDCAN_FD_CAN)       entry->flags |= CYC_FD;
+    if (tx_header->BitRateSwitch == FDCAN_BRS_ON)       entry->flags |= CYC_BRS;
+    memcpy(entry->data, tx_data, byte_count);
+
+    entry->counter_pos  = counter_byte;
+    entry->checksum_pos = checksum_byte;
+
+    // Calculate the first send time after now that is a multiple of the period after the time base + phase offset.
+    // The time base may be older than the 71 minutes after which the 32 bit timestamp rolls over.
+    uint64_t start = cyclic_base + phase_us;
+    uint64_t next  = start;
+    if (now >= start)
+        next += ((now - start) / period_us + 1) * period_us;
+
+    entry->next_us   = (uint32_t)next;
+    entry->period_us = period_us; // activates the entry
+    return FBK_Success;
+}
+
+// Remove one cyclic message
+eFeedback cyclic_remove(uint32_t index)
+{
+    if (index >= CYCLIC_MAX_ENTRIES)
+        return FBK_InvalidParameter;
+
+    if (cyclic_table[index].period_us > 0)
+    {
+        cyclic_table[index].period_us = 0;
+        cyclic_count --;
+    }
+    return FBK_Success;
+}
+
+// Called from the main loop approx 100 times in one millisecond.
+// Sends all cyclic messages that are due as long as there is a free Tx buffer.
+// A message that cannot be sent in time (bus busy, bus off) is sent as soon as possible.
+// If more than one period has been missed, the missed messages are skipped and the phase is kept.
+void cyclic_process()
+{
+    if (cyclic_count == 0 || can_is_tx_allowed() != FBK_Success)
+        return;
+
+    FDCAN_TxHeaderTypeDef tx_header;
+    tx_header.TxEventFifoControl  = FDCAN_NO_TX_EVENTS;
+    tx_header.MessageMarker       = 0;
+    tx_header.ErrorStateIndicator = can_is_passive() ? FDCAN_ESI_PASSIVE : FDCAN_ESI_ACTIVE;
+
+    uint8_t  tx_data[64];
+    uint32_t now = system_get_timestamp();
+    for (int i=0; i<CYCLIC_MAX_ENTRIES; i++)
+    {
+        kCyclicEntry* entry = &cyclic_table[i];
+        if (entry->period_us == 0 || (int32_t)(now - entry->next_us) < 0)
+            continue;
+
+        if (can_get_tx_free_level() == 0)
+            return;
+
+        // check again, the USB interrupt may have removed or replaced the entry in the meantime
+        system_disable_irq();
+        if (entry->period_us == 0 || (int32_t)(now - entry->next_us) < 0)
+        {
+            system_enable_irq();
+            continue;
+        }
+
+        if (entry->counter_pos > 0)
+            entry->data[entry->counter_pos - 1] ++;
+
+        if (entry->checksum_pos > 0)
+        {
+            uint8_t sum = 0;
+            int byte_count = utils_dlc_to_byte_count(entry->dlc);
+            for (int b=0; b<byte_count; b++)
+            {
+                if (b != entry->checksum_pos - 1)
+                    sum += entry->data[b];
+            }
+            entry->data[entry->checksum_pos - 1] = sum;
+        }
+
+        tx_header.Identifier    = entry->identifier;
+        tx_header.DataLength    = entry->dlc;
+        tx_header.IdType        = (entry->flags & CYC_Extended) ? FDCAN_EXTENDED_ID  : FDCAN_STANDARD_ID;
+        tx_header.TxFrameType   = (entry->flags & CYC_Remote)   ? FDCAN_REMOTE_FRAME : FDCAN_DATA_FRAME;
+        tx_header.FDFormat      = (entry->flags & CYC_FD)       ? FDCAN_FD_CAN       : FDCAN_CLASSIC_CAN;
+        tx_header.BitRateSwitch = (entry->flags & CYC_BRS)      ? FDCAN_BRS_ON       : FDCAN_BRS_OFF;
+        memcpy(tx_data, entry->data, utils_dlc_to_byte_count(entry->dlc));
+
+        uint32_t late = now - entry->next_us;
+        entry->next_us += (late / entry->period_us + 1) * entry->period_us;
+        system_enable_irq();
+
+        can_send_packet(&tx_header, tx_data);
+    }
+}
@@ -0,0 +1,19 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#pragma once
+#include "settings.h"
+
+// The firmware sends up to 32 cyclic messages without any involvement of the host (see cyclic.c)
+#define CYCLIC_MAX_ENTRIES     32
+// The shortest period that can be configured (100 s allows 10 messages per millisecond)
+#define CYCLIC_MIN_PERIOD_US  100
+
+void      cyclic_clear();
+eFeedback cyclic_set(uint32_t index, FDCAN_TxHeaderTypeDef* tx_header, uint8_t* tx_data,
+                     uint32_t period_us, uint32_t phase_us, uint32_t counter_byte, uint32_t checksum_byte);
+eFeedback cyclic_remove(uint32_t index);
+void      cyclic_process();
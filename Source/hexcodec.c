@@ -0,0 +1,95 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#include "hexcodec.h"
+
+// Table driven ASCII hex conversion for the hot paths of the Slcan firmware (Rx frames, Tx commands, Tx echo, error report).
+// A 64 byte CAN FD frame has 128 data characters. Converting them nibble by nibble with if / else costs
+// several branches per character. The tables below need one memory access per byte or per character.
+// Both tables are in flash (512 + 256 bytes).
+
+#define HEX_ROW(h)  {h,'0'},{h,'1'},{h,'2'},{h,'3'},{h,'4'},{h,'5'},{h,'6'},{h,'7'}, \
+                    {h,'8'},{h,'9'},{h,'A'},{h,'B'},{h,'C'},{h,'D'},{h,'E'},{h,'F'}
+
+// byte value --> two uppercase hex characters
+static const char HEX_PAIRS[256][2] =
+{
+    HEX_ROW('0'), HEX_ROW('1'), HEX_ROW('2'), HEX_ROW('3'), HEX_ROW('4'), HEX_ROW('5'), HEX_ROW('6'), HEX_ROW('7'),
+    HEX_ROW('8'), HEX_ROW('9'), HEX_ROW('A'), HEX_ROW('B'), HEX_ROW('C'), HEX_ROW('D'), HEX_ROW('E'), HEX_ROW('F'),
+};
+
+// ASCII character --> nibble value, 0xFF for all characters that are not hex digits (including the zero termination)
+static const uint8_t HEX_NIBBLES[256] =
+{
+    [0 ... 255] = 0xFF,
+    ['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4, ['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+    ['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+    ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+};
+
+// writes two hex characters and returns the position behind them
+char* hex_encode_byte(char* dest, uint8_t value)
+{
+    dest[0] = HEX_PAIRS[value][0];
+    dest[1] = HEX_PAIRS[value][1];
+    return dest + 2;
+}
+
+// writes 2 * count hex characters and returns the position behind them
+char* hex_encode_bytes(char* dest, const uint8_t* src, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        dest = hex_encode_byte(dest, src[i]);
+    }
+    return dest;
+}
+
+// writes the lower 'digits' nibbles of value (1...8) with leading zeroes and returns the position behind them
+char* hex_encode_value(char* dest, uint32_t value, int digits)
+{
+    for (int i = digits - 1; i >= 0; i--)
+    {
+        dest[i] = HEX_PAIRS[value & 0xF][1];
+        value >>= 4;
+    }
+    return dest + digits;
+}
+
+// reads 'digits' hex characters (1...8) from 'src' and stores the binary value in 'value'.
+// returns false on an invalid character.
+// The string must be zero terminated, so reading behind the end stops at the zero which is an invalid character.
+bool hex_decode_value(const char* src, int digits, uint32_t* value)
+{
+    uint32_t result = 0;
+    for (int i = 0; i < digits; i++)
+    {
+        uint8_t nibble = HEX_NIBBLES[(uint8_t)src[i]];
+        if (nibble > 0xF)
+            return false;
+
+        result = (result << 4) | nibble;
+    }
+    *value = result;
+    return true;
+}
+
+// reads 2 * count hex characters from 'src' and stores 'count' bytes in 'dest'.
+// Invalid characters are not checked in the loop. All nibbles are OR'ed and checked once at the end.
+// The caller must make sure that the string has 2 * count characters (the zero termination may be the last one).
+bool hex_decode_bytes(const char* src, uint8_t* dest, int count)
+{
+    uint8_t invalid = 0;
+    for (int i = 0; i < count; i++)
+    {
+        uint8_t high = HEX_NIBBLES[(uint8_t)src[0]];
+        uint8_t low  = HEX_NIBBLES[(uint8_t)src[1]];
+        invalid |= high | low;
+        dest[i]  = (high << 4) | low;
+        src += 2;
+    }
+    return invalid < 0x10;
+}
@@ -0,0 +1,14 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#pragma once
+#include "settings.h"
+
+char* hex_encode_byte (char* dest, uint8_t value);
+char* hex_encode_bytes(char* dest, const uint8_t* src, int count);
+char* hex_encode_value(char* dest, uint32_t value, int digits);
+bool  hex_decode_value(const char* src, int digits, uint32_t* value);
+bool  hex_decode_bytes(const char* src, uint8_t* dest, int count);
@@ -0,0 +1,130 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#include "settings.h"
+#include "idstats.h"
+
+// Statistics of each CAN ID on the bus: count, last timestamp, min / max / average period and last DLC.
+// A bus survey needs only these statistics instead of streaming all frames over USB to the host.
+// All received frames are counted, also those that the filters have rejected.
+// The statistics are stored in a hash table like idtable.c, but separate from the state of the reduction in reduce.c.
+// The key is the same as in idtable.c, so the zero initialized table is empty. Collisions are resolved by linear probing.
+// The table has space for 64 different IDs. Frames of IDs that do not fit into the table are only counted in idstats_overflow.
+// A table for all 2048 standard IDs would need 56 kB RAM, but the STM32G431 has only 32 kB.
+// The host reads the table entry by entry with idstats_get_next().
+
+kIdStats idstats_table[IDSTATS_SIZE];
+uint32_t idstats_count    = 0;
+bool     idstats_enabled  = false;
+uint32_t idstats_overflow = 0;
+
+// Enable or disable the statistics. Enabling resets all statistics.
+void idstats_enable(bool enable)
+{
+    for (int i=0; i<IDSTATS_SIZE; i++)
+    {
+        idstats_table[i].key = 0;
+    }
+    idstats_count    = 0;
+    idstats_overflow = 0;
+    idstats_enabled  = enable;
+}
+
+bool idstats_is_enabled()
+{
+    return idstats_enabled;
+}
+
+// Find the entry of the CAN ID in the Rx header. If it does not exist, a new entry with all members zero is created.
+// returns NULL if the table is full
+static kIdStats* idstats_lookup(FDCAN_RxHeaderTypeDef* rx_header)
+{
+    uint32_t key = idtable_make_key(rx_header);
+
+    // Fibonacci hashing spreads consecutive CAN IDs over the table
+    uint32_t slot = (key * 2654435761u) >> 24;
+    for (int i=0; i<IDSTATS_SIZE; i++)
+    {
+        kIdStats* entry = &idstats_table[(slot + i) & (IDSTATS_SIZE - 1)];
+        if (entry->key == key)
+            return entry;
+
+        if (entry->key == 0)
+        {
+            memset(entry, 0, sizeof(kIdStats));
+            entry->key = key;
+            idstats_count ++;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Called from can_process() for each received frame
+void idstats_receive(FDCAN_RxHeaderTypeDef* rx_header, uint32_t rx_timestamp)
+{
+    if (!idstats_enabled)
+        return;
+
+    kIdStats* entry = idstats_lookup(rx_header);
+    if (entry == NULL)
+    {
+        idstats_overflow ++; // table full
+        return;
+    }
+
+    if (entry->count > 0)
+    {
+        uint32_t period = rx_timestamp - entry->last_us;
+        if (entry->count == 1)
+        {
+            entry->min_us = period;
+            entry->max_us = period;
+            entry->avg_us = period;
+        }
+        else
+        {
+            if (period < entry->min_us) entry->min_us = period;
+            if (period > entry->max_us) entry->max_us = period;
+
+            // exponential moving average over approx. 8 periods
+            entry->avg_us = (uint32_t)((int32_t)entry->avg_us + (int32_t)(period - entry->avg_us) / 8);
+        }
+    }
+
+    if (entry->count < 0xFFFFFFFF)
+        entry->count ++;
+
+    entry->last_us = rx_timestamp;
+    entry->dlc     = (uint8_t)rx_header->DataLength;
+}
+
+// Returns the first entry with statistics at a table slot >= *slot or NULL if there are no more entries.
+// *slot is set to the slot of the returned entry. The host continues with the next slot.
+kIdStats* idstats_get_next(uint32_t* slot)
+{
+    for (uint32_t i=*slot; i<IDSTATS_SIZE; i++)
+    {
+        if (idstats_table[i].key != 0)
+        {
+            *slot = i;
+            return &idstats_table[i];
+        }
+    }
+    return NULL;
+}
+
+// returns the count of different IDs in the table
+uint32_t idstats_get_count()
+{
+    return idstats_count;
+}
+
+// returns the count of frames that have not been counted because the ID table was full
+uint32_t idstats_get_overflow()
+{
+    return idstats_overflow;
+}
@@ -0,0 +1,31 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#pragma once
+#include "settings.h"
+#include "idtable.h"
+
+// The count of different CAN IDs that can be stored (must be a power of 2, see idstats.c)
+#define IDSTATS_SIZE          64
+
+// The statistics of one CAN ID
+typedef struct
+{
+    uint32_t key;       // CAN ID + IDT_Extended + IDT_Used (see idtable.h)
+    uint32_t count;     // count of frames received
+    uint32_t last_us;   // timestamp of the last frame
+    uint32_t min_us;    // shortest period between two frames
+    uint32_t max_us;    // longest period between two frames
+    uint32_t avg_us;    // average period between two frames
+    uint8_t  dlc;       // DLC of the last frame
+} kIdStats;
+
+void      idstats_enable(bool enable);
+bool      idstats_is_enabled();
+void      idstats_receive(FDCAN_RxHeaderTypeDef* rx_header, uint32_t rx_timestamp);
+kIdStats* idstats_get_next(uint32_t* slot);
+uint32_t  idstats_get_count();
+uint32_t  idstats_get_overflow();
@@ -0,0 +1,70 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#include "settings.h"
+#include "idtable.h"
+
+// A hash table that stores the state of each CAN ID that has been received.
+// The key is the CAN ID + IDT_Extended + IDT_Used, so the zero initialized table is empty. Collisions are resolved by linear probing.
+// Entries are never removed, only the entire table is cleared when the adapter is closed.
+// If the table is full, idtable_lookup() returns NULL for new IDs and the caller must handle the frame without state.
+// The table is small because the STM32G431 has only 32 kB RAM. On a typical vehicle bus 64 IDs cover the periodic traffic.
+// idstats.c has its own table with the same key, so the statistics do not take entries away from the reduction.
+
+kIdEntry idtable[IDTABLE_SIZE];
+uint32_t idtable_count = 0;
+
+void idtable_clear()
+{
+    for (int i=0; i<IDTABLE_SIZE; i++)
+    {
+        idtable[i].key = 0;
+    }
+    idtable_count = 0;
+}
+
+// Find the entry of the CAN ID in the Rx header. If it does not exist, a new entry with all members zero is created.
+// created = true if the entry is new
+// returns NULL if the table is full
+kIdEntry* idtable_lookup(FDCAN_RxHeaderTypeDef* rx_header, bool* created)
+{
+    uint32_t key = idtable_make_key(rx_header);
+
+    // Fibonacci hashing spreads consecutive CAN IDs over the table
+    uint32_t slot = (key * 2654435761u) >> 24;
+    for (int i=0; i<IDTABLE_SIZE; i++)
+    {
+        kIdEntry* entry = &idtable[(slot + i) & (IDTABLE_SIZE - 1)];
+        if (entry->key == key)
+        {
+            *created = false;
+            return entry;
+        }
+
+        if (entry->key == 0)
+        {
+            if (idtable_count >= IDTABLE_SIZE - 1) // keep one entry empty, so the search always terminates early
+                return NULL;
+
+            memset(entry, 0, sizeof(kIdEntry));
+            entry->key = key;
+            idtable_count ++;
+            *created = true;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// returns the key of the CAN ID in the Rx header: CAN ID + IDT_Extended + IDT_Used
+uint32_t idtable_make_key(FDCAN_RxHeaderTypeDef* rx_header)
+{
+    uint32_t key = rx_header->Identifier | IDT_Used;
+    if (rx_header->IdType == FDCAN_EXTENDED_ID)
+        key |= IDT_Extended;
+
+    return key;
+}
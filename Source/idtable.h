@@ -0,0 +1,27 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#pragma once
+#include "settings.h"
+
+// The count of different CAN IDs that can be stored (must be a power of 2, see idtable.c)
+#define IDTABLE_SIZE          64
+
+#define IDT_Extended          0x80000000 // this bit is set in the key for 29 bit IDs
+#define IDT_Used              0x40000000 // this bit is set in the key of all used entries (key = 0 --> empty)
+
+// The state of one CAN ID
+typedef struct
+{
+    uint32_t key;       // CAN ID + IDT_Extended + IDT_Used
+    uint32_t fwd_us;    // reduce.c: timestamp of the last frame that was passed to the host
+    uint32_t hash;      // reduce.c: hash over DLC and data of the last frame that was passed to the host
+    uint16_t skipped;   // reduce.c: count of frames that have not been passed to the host since the last one
+} kIdEntry;
+
+void      idtable_clear();
+kIdEntry* idtable_lookup(FDCAN_RxHeaderTypeDef* rx_header, bool* created);
+uint32_t  idtable_make_key(FDCAN_RxHeaderTypeDef* rx_header);
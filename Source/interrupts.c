@@ -8,6 +8,7 @@
 #include "interrupts.h"
 #include "can.h"
 #include "led.h"
+#include "profiler.h"
 
 extern PCD_HandleTypeDef hpcd_USB_FS;
 
@@ -58,13 +59,17 @@ void PendSV_Handler(void)
 // Handle USB interrupts
 void USB_LP_IRQHandler(void)
 {
+  uint32_t start = profiler_start();
   HAL_PCD_IRQHandler(&hpcd_USB_FS);
+  profiler_stop(PRF_UsbIsr, start);
 }
 
 // Handle USB interrupts
 void USB_HP_IRQHandler(void)
 {
+  uint32_t start = profiler_start();
   HAL_PCD_IRQHandler(&hpcd_USB_FS);
+  profiler_stop(PRF_UsbIsr, start);
 }
 
 // Handle SysTick interrupt
@@ -79,3 +84,11 @@ void SysTick_Handler(void)
 //{
 //     HAL_CAN_IRQHandler(can_get_handle());
 // }
+
+// Handle CAN interrupts (new packet in Rx FIFO 0 or Rx FIFO 1)
+void FDCAN1_IT0_IRQHandler(void)
+{
+  uint32_t start = profiler_start();
+  HAL_FDCAN_IRQHandler(can_get_handle());
+  profiler_stop(PRF_CanIsr, start);
+}
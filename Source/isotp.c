@@ -0,0 +1,497 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#include "settings.h"
+#include "isotp.h"
+#include "can.h"
+#include "utils.h"
+#include "system.h"
+#include "buffer.h"
+#include "control.h"
+
+// ISO-TP (ISO 15765-2) transport layer for one channel with a Tx ID and an Rx ID.
+// Without this engine the host must answer each First Frame with a Flow Control frame and must send each Consecutive Frame
+// with the correct separation time. Each of these round trips goes through USB and the operating system of the host,
+// which takes milliseconds and makes flashing and diagnostics slow.
+// Here the host sends an entire PDU (up to 4095 bytes) and the firmware segments it, waits for the Flow Control frames
+// of the peer and sends the Consecutive Frames with the separation time STmin measured with the 1 s timer.
+// Received PDUs are reassembled here and passed to the host in chunks of 64 bytes after the last Consecutive Frame.
+// The first chunk in both directions contains the length of the PDU (see buf_store_isotp_data()).
+// The frames of the Rx ID are not passed to the host as CAN frames.
+// ISO-TP frames are sent without Tx Event, so the host does not receive Tx echoes for them (see can_send_packet()).
+// Sending and receiving use the same buffer, so while a PDU is sent the peer cannot send a multi-frame PDU.
+// This is the normal request / response sequence of diagnostic protocols (UDS, KWP2000).
+// The channel is closed when the adapter is closed.
+// Candlelight calls isotp_open() and isotp_close() from the USB interrupt while the main loop may be in isotp_process().
+// So they only store the new channel in isotp_request. The main loop applies it in isotp_apply_request() before it uses the channel.
+
+// Protocol Control Information (upper nibble of the first data byte)
+#define PCI_SingleFrame         0x00
+#define PCI_FirstFrame          0x10
+#define PCI_ConsecutiveFrame    0x20
+#define PCI_FlowControl         0x30
+
+// Flow Status in a Flow Control frame
+#define FS_ContinueToSend       0
+#define FS_Wait                 1
+#define FS_Overflow             2
+#define FS_None                -1
+
+typedef enum
+{
+    ISS_Closed = 0,    // no channel configured
+    ISS_Idle,          // waiting for PDU data from the host or a frame from the peer
+    ISS_TxAppend,      // the host is appending the data of a Tx PDU
+    ISS_TxFirst,       // the Single Frame or First Frame is waiting for a free Tx buffer
+    ISS_TxWaitFC,      // waiting for a Flow Control frame from the peer
+    ISS_TxSending,     // sending Consecutive Frames
+    ISS_RxReceiving,   // receiving Consecutive Frames
+    ISS_RxDelivering,  // passing the received PDU to the host
+} eIsoTpState;
+
+typedef struct
+{
+    uint32_t    tx_id;
+    uint32_t    rx_id;
+    uint8_t     flags;        // eIsoTpFlags
+    uint8_t     block_size;   // BS    sent in the Flow Control frames of the adapter
+    uint8_t     st_min;       // STmin sent in the Flow Control frames of the adapter
+    uint8_t     pad_byte;
+    eIsoTpState state;
+    int         flow_status;  // Flow Control frame that is waiting for a free Tx buffer (FS_None = nothing to send)
+    uint32_t    length;       // length of the PDU
+    uint32_t    position;     // bytes sent, received or passed to the host
+    uint8_t     sequence;     // sequence number of the next Consecutive Frame (0...15)
+    uint32_t    block_count;  // remaining Consecutive Frames in the current block (0 = no limit)
+    uint32_t    peer_block;   // BS    received in the Flow Control frame of the peer
+    uint32_t    peer_st_us;   // STmin received in the Flow Control frame of the peer in s
+    uint32_t    next_us;      // Tx: time of the next Consecutive Frame, otherwise the timeout
+    uint32_t    tx_buffer;    // the hardware Tx buffer of the last frame
+    bool        st_waiting;   // STmin starts when the last Consecutive Frame has left the hardware Tx buffer
+} kIsoTpChannel;
+
+kIsoTpChannel isotp = { .state = ISS_Closed };
+uint8_t       isotp_buf[ISOTP_MAX_PDU];
+
+kIsoTpChannel isotp_request;                   // written by isotp_open() and isotp_close()
+volatile bool isotp_request_pending = false;   // isotp_request must be copied into isotp
+
+// Convert STmin into s: 0x00...0x7F = 0...127 ms, 0xF1...0xF9 = 100...900 s, reserved values = 127 ms
+static inline uint32_t isotp_decode_st_min(uint8_t st_min)
+{
+    if (st_min <= 0x7F)                  return st_min * 1000;
+    if (st_min >= 0xF1 && st_min <= 0xF9) return (st_min - 0xF0) * 100;
+    return 127000;
+}
+
+// Close the channel and discard a PDU that is currently sent or received
+void isotp_close()
+{
+    isotp_request.state   = ISS_Closed;
+    __DMB(); // the request must be completely written before it is published
+    isotp_request_pending = true;
+}
+
+// Main loop: apply the channel that isotp_open() or isotp_close() has stored.
+// The interrupts are disabled, so the USB interrupt cannot modify the request while it is copied.
+static void isotp_apply_request()
+{
+    if (!isotp_request_pending)
+        return;
+
+    system_disable_irq();
+    isotp = isotp_request;
+    isotp_request_pending = false;
+    system_enable_irq();
+}
+
+// Open the channel
+// tx_id      = CAN ID of the frames sent by the adapter
+// rx_id      = CAN ID of the frames sent by the peer
+// flags      = eIsoTpFlags
+// block_size = BS    that the adapter sends in it's Flow Control frames (0 = the peer may send all Consecutive Frames without waiting)
+// st_min     = STmin that the adapter sends in it's Flow Control frames (0 = the peer may send as fast as possible)
+// pad_byte   = the byte that is used to fill the unused bytes of a frame
+eFeedback isotp_open(uint32_t tx_id, uint32_t rx_id, uint8_t flags, uint8_t block_size, uint8_t st_min, uint8_t pad_byte)
+{
+    // Bus off is only temporary
+    eFeedback e_Ret = can_is_tx_allowed();
+    if (e_Ret != FBK_Success && e_Ret != FBK_BusIsOff)
+        return e_Ret;
+
+    uint32_t max_id = (flags & ISO_Extended) ? 0x1FFFFFFF : 0x7FF;
+    if (tx_id > max_id || rx_id > max_id || tx_id == rx_id)
+        return FBK_InvalidParameter;
+
+    // Sending a message with FDF flag requires a data baudrate to be set.
+    if ((flags & ISO_FD) && !can_using_FD())
+        return FBK_BaudrateNotSet;
+
+    // The main loop copies the request when it uses the channel the next time
+    memset(&isotp_request, 0, sizeof(isotp_request));
+    isotp_request.tx_id       = tx_id;
+    isotp_request.rx_id       = rx_id;
+    isotp_request.flags       = flags;
+    isotp_request.block_size  = block_size;
+    isotp_request.st_min      = st_min;
+    isotp_request.pad_byte    = pad_byte;
+    isotp_request.flow_status = FS_None;
+    isotp_request.state       = ISS_Idle;
+    __DMB(); // the request must be completely written before it is published
+    isotp_request_pending = true;
+    return FBK_Success;
+}
+
+// Start a new Tx PDU with the given length. A PDU that has not been appended completely is discarded.
+eFeedback isotp_begin(uint32_t length)
+{
+    isotp_apply_request();
+    if (isotp.state == ISS_Closed)
+        return FBK_InvalidCommand;
+
+    if (isotp.state != ISS_Idle && isotp.state != ISS_TxAppend)
+        return FBK_TxBufferFull; // a PDU is currently sent or received
+
+    if (length == 0 || length > ISOTP_MAX_PDU)
+        return FBK_InvalidParameter;
+
+    isotp.length   = length;
+    isotp.position = 0;
+    isotp.state    = ISS_TxAppend;
+    return FBK_Success;
+}
+
+// Append data from the host to the Tx PDU. When the PDU is complete it is sent.
+eFeedback isotp_append(const uint8_t* data, uint32_t count)
+{
+    isotp_apply_request();
+    if (isotp.state != ISS_TxAppend)
+        return FBK_InvalidParameter; // isotp_begin() has not been called
+
+    if (isotp.position + count > isotp.length)
+    {
+        isotp.state = ISS_Idle; // discard the PDU
+        return FBK_InvalidParameter;
+    }
+
+    memcpy(isotp_buf + isotp.position, data, count);
+    isotp.position += count;
+
+    if (isotp.position == isotp.length)
+        isotp.state = ISS_TxFirst;
+    return FBK_Success;
+}
+
+// Pass a frame to the CAN Tx FIFO. Unused bytes are filled with the pad byte.
+// The caller must check that a Tx buffer is free.
+void isotp_send_frame(uint8_t* frame, uint32_t len)
+{
+    FDCAN_TxHeaderTypeDef tx_header;
+    tx_header.Identifier          = isotp.tx_id;
+    tx_header.IdType              = (isotp.flags & ISO_Extended) ? FDCAN_EXTENDED_ID : FDCAN_STANDARD_ID;
+    tx_header.TxFrameType         = FDCAN_DATA_FRAME;
+    tx_header.FDFormat            = (isotp.flags & ISO_FD)  ? FDCAN_FD_CAN : FDCAN_CLASSIC_CAN;
+    tx_header.BitRateSwitch       = (isotp.flags & ISO_BRS) ? FDCAN_BRS_ON : FDCAN_BRS_OFF;
+    tx_header.ErrorStateIndicator = can_is_passive() ? FDCAN_ESI_PASSIVE : FDCAN_ESI_ACTIVE;
+    tx_header.TxEventFifoControl  = FDCAN_NO_TX_EVENTS;
+    tx_header.MessageMarker       = 0;
+
+    // CAN FD allows only lengths that can be expressed by the DLC (e.g. 10 bytes must be sent as 12 bytes)
+    uint32_t padded = len;
+    if (isotp.flags & ISO_FD)        padded = utils_dlc_to_byte_count(utils_byte_count_to_dlc(len));
+    if (isotp.flags & ISO_Padding)   padded = MAX(padded, 8);
+
+    memset(frame + len, isotp.pad_byte, padded - len);
+    tx_header.DataLength = utils_byte_count_to_dlc(padded);
+
+    can_send_packet(&tx_header, frame);
+    isotp.tx_buffer = HAL_FDCAN_GetLatestTxFifoQRequestBuffer(can_get_handle());
+}
+
+// Called from can_process() for each received frame.
+// returns true if the frame belongs to the ISO-TP channel and must not be passed to the host.
+bool isotp_receive(FDCAN_RxHeaderTypeDef* rx_header, uint8_t* rx_data)
+{
+    isotp_apply_request();
+    if (isotp.state == ISS_Closed || rx_header->Identifier != isotp.rx_id || rx_header->RxFrameType != FDCAN_DATA_FRAME)
+        return false;
+
+    if ((rx_header->IdType == FDCAN_EXTENDED_ID) != ((isotp.flags & ISO_Extended) > 0))
+        return false;
+
+    uint32_t len = utils_dlc_to_byte_count(rx_header->DataLength);
+    if (len == 0)
+        return true; // invalid frame
+
+    uint32_t now = system_get_timestamp();
+    switch (rx_data[0] & 0xF0)
+    {
+        case PCI_SingleFrame:
+        {
+            // CAN FD frames longer than 8 bytes have the length in the second byte
+            uint32_t offset = 1;
+            uint32_t sf_len = rx_data[0] & 0x0F;
+            if (sf_len == 0 && len > 8)
+            {
+                sf_len = rx_data[1];
+                offset = 2;
+            }
+            if (sf_len == 0 || sf_len + offset > len)
+                return true; // invalid frame
+
+            // A Single Frame during the reception of a multi-frame PDU terminates the reception (ISO 15765-2)
+            if (isotp.state == ISS_RxReceiving)
+                isotp.state = ISS_Idle;
+
+            // The received PDU must be passed to the host before any newer PDU.
+            if (isotp.state == ISS_RxDelivering || !buf_store_isotp_data(rx_data + offset, sf_len, sf_len))
+                control_report_isotp(ISO_RxOverflow);
+            return true;
+        }
+        case PCI_FirstFrame:
+        {
+            if (len < 8)
+                return true; // invalid frame
+
+            // A PDU that fits into a Single Frame must not be sent as First Frame --> ignore it (ISO 15765-2)
+            uint32_t ff_len = ((rx_data[0] & 0x0F) << 8) | rx_data[1];
+            uint32_t sf_max = (len > 8) ? len - 2 : 7;
+            if (ff_len > 0 && ff_len <= sf_max)
+                return true;
+
+            // A First Frame during the reception of a multi-frame PDU terminates the reception (ISO 15765-2)
+            if (isotp.state == ISS_RxReceiving)
+                isotp.state = ISS_Idle;
+
+            // A length of zero announces a 32 bit length (ISO 15765-2:2016) which is always longer than ISOTP_MAX_PDU.
+            if (ff_len == 0 || isotp.state != ISS_Idle)
+            {
+                isotp.flow_status = FS_Overflow;
+                control_report_isotp(ISO_RxOverflow);
+                return true;
+            }
+
+            isotp.length      = ff_len;
+            isotp.position    = MIN(len - 2, ff_len);
+            isotp.sequence    = 1;
+            isotp.block_count = isotp.block_size;
+            isotp.next_us     = now + ISOTP_TIMEOUT_US;
+            isotp.flow_status = FS_ContinueToSend;
+            isotp.state       = ISS_RxReceiving;
+            memcpy(isotp_buf, rx_data + 2, isotp.position);
+            return true;
+        }
+        case PCI_ConsecutiveFrame:
+        {
+            if (isotp.state != ISS_RxReceiving)
+                return true; // not expected --> ignore
+
+            if ((rx_data[0] & 0x0F) != isotp.sequence)
+            {
+                isotp.state = ISS_Idle;
+                control_report_isotp(ISO_RxSequence);
+                return true;
+            }
+
+            uint32_t count = MIN(len - 1, isotp.length - isotp.position);
+            memcpy(isotp_buf + isotp.position, rx_data + 1, count);
+            isotp.position += count;
+            isotp.sequence  = (isotp.sequence + 1) & 0x0F;
+            isotp.next_us   = now + ISOTP_TIMEOUT_US;
+
+            if (isotp.position == isotp.length)
+            {
+                isotp.position = 0;
+                isotp.state    = ISS_RxDelivering;
+            }
+            else if (isotp.block_size > 0 && --isotp.block_count == 0)
+            {
+                isotp.block_count = isotp.block_size;
+                isotp.flow_status = FS_ContinueToSend;
+            }
+            return true;
+        }
+        case PCI_FlowControl:
+        {
+            if (isotp.state != ISS_TxWaitFC || len < 3)
+                return true; // not expected --> ignore
+
+            switch (rx_data[0] & 0x0F)
+            {
+                case FS_ContinueToSend:
+                    isotp.peer_block  = rx_data[1];
+                    isotp.block_count = rx_data[1];
+                    isotp.peer_st_us  = isotp_decode_st_min(rx_data[2]);
+                    isotp.next_us     = now; // send the first Consecutive Frame immediately
+                    isotp.st_waiting  = false;
+                    isotp.state       = ISS_TxSending;
+                    break;
+                case FS_Wait:
+                    isotp.next_us = now + ISOTP_TIMEOUT_US;
+                    break;
+                case FS_Overflow:
+                    isotp.state = ISS_Idle;
+                    control_report_isotp(ISO_TxOverflow);
+                    break;
+                default: // reserved Flow Status --> abort the transmission (ISO 15765-2)
+                    isotp.state = ISS_Idle;
+                    control_report_isotp(ISO_TxInvalidFS);
+                    break;
+            }
+            return true;
+        }
+    }
+    return true; // invalid PCI
+}
+
+// Returns true if the last frame is still waiting in it's hardware Tx buffer
+static inline bool isotp_tx_pending()
+{
+    return HAL_FDCAN_IsTxBufferMessagePending(can_get_handle(), isotp.tx_buffer) != 0;
+}
+
+// Returns true if a frame can be passed to the CAN Tx FIFO now
+// The next frame always waits until the last frame has been sent.
+// In Tx queue mode (USR_TxPriority) the hardware sends frames with the same CAN ID in the order of the Tx buffer index,
+// not in the order in which they were added. In FIFO mode frames from the host may be waiting before the last frame,
+// so the separation time must not start before the last frame has really been sent.
+static inline bool isotp_can_send()
+{
+    if (can_is_tx_allowed() != FBK_Success || can_get_tx_free_level() == 0)
+        return false;
+
+    return !isotp_tx_pending();
+}
+
+// Called from the main loop approx 100 times in one millisecond.
+// Sends Flow Control frames, Single Frames, First Frames and Consecutive Frames, checks the timeouts
+// and passes a received PDU to the host as long as there is space in the USB buffer.
+void isotp_process()
+{
+    isotp_apply_request();
+    if (isotp.state == ISS_Closed)
+        return;
+
+    uint8_t  frame[64];
+    uint32_t max_len = (isotp.flags & ISO_FD) ? 64 : 8;
+    uint32_t now     = system_get_timestamp();
+
+    // A Flow Control frame must be sent before anything else
+    if (isotp.flow_status != FS_None)
+    {
+        if (!isotp_can_send())
+            return;
+
+        frame[0] = PCI_FlowControl | isotp.flow_status;
+        frame[1] = isotp.block_size;
+        frame[2] = isotp.st_min;
+        isotp_send_frame(frame, 3);
+        isotp.flow_status = FS_None;
+    }
+
+    switch (isotp.state)
+    {
+        case ISS_TxFirst:
+        {
+            if (!isotp_can_send())
+                return;
+
+            // Single Frame: classic frames up to 7 bytes, CAN FD frames up to 62 bytes (with the length in the second byte)
+            if (isotp.length <= 7 || isotp.length <= max_len - 2)
+            {
+                uint32_t offset = 1;
+                if (isotp.length <= 7)
+                {
+                    frame[0] = PCI_SingleFrame | isotp.length;
+                }
+                else
+                {
+                    frame[0] = PCI_SingleFrame;
+                    frame[1] = isotp.length;
+                    offset   = 2;
+                }
+                memcpy(frame + offset, isotp_buf, isotp.length);
+                isotp_send_frame(frame, isotp.length + offset);
+                isotp.state = ISS_Idle;
+                control_report_isotp(ISO_TxDone);
+                return;
+            }
+
+            frame[0] = PCI_FirstFrame | (isotp.length >> 8);
+            frame[1] = isotp.length & 0xFF;
+            memcpy(frame + 2, isotp_buf, max_len - 2);
+            isotp_send_frame(frame, max_len);
+
+            isotp.position = max_len - 2;
+            isotp.sequence = 1;
+            isotp.next_us  = now + ISOTP_TIMEOUT_US;
+            isotp.state    = ISS_TxWaitFC;
+            return;
+        }
+        case ISS_TxSending:
+        {
+            // STmin is the time between the end of the last Consecutive Frame on CAN bus and the start of the next one.
+            if (isotp.st_waiting)
+            {
+                if (isotp_tx_pending())
+                    return;
+
+                isotp.next_us    = now + isotp.peer_st_us;
+                isotp.st_waiting = false;
+            }
+
+            if ((int32_t)(now - isotp.next_us) < 0 || !isotp_can_send())
+                return;
+
+            uint32_t count = MIN(max_len - 1, isotp.length - isotp.position);
+            frame[0] = PCI_ConsecutiveFrame | isotp.sequence;
+            memcpy(frame + 1, isotp_buf + isotp.position, count);
+            isotp_send_frame(frame, count + 1);
+
+            isotp.position += count;
+            isotp.sequence  = (isotp.sequence + 1) & 0x0F;
+
+            if (isotp.position == isotp.length)
+            {
+                isotp.state = ISS_Idle;
+                control_report_isotp(ISO_TxDone);
+            }
+            else if (isotp.peer_block > 0 && --isotp.block_count == 0)
+            {
+                isotp.next_us = now + ISOTP_TIMEOUT_US;
+                isotp.state   = ISS_TxWaitFC;
+            }
+            else isotp.st_waiting = true;
+            return;
+        }
+        case ISS_TxWaitFC:
+        case ISS_RxReceiving:
+        {
+            if ((int32_t)(now - isotp.next_us) < 0)
+                return;
+
+            control_report_isotp(isotp.state == ISS_TxWaitFC ? ISO_TxTimeout : ISO_RxTimeout);
+            isotp.state = ISS_Idle;
+            return;
+        }
+        case ISS_RxDelivering:
+        {
+            while (isotp.position < isotp.length)
+            {
+                uint32_t count = MIN(ISOTP_CHUNK_SIZE, isotp.length - isotp.position);
+                uint32_t pdu_length = (isotp.position == 0) ? isotp.length : 0;
+                if (!buf_store_isotp_data(isotp_buf + isotp.position, count, pdu_length))
+                    return; // no space in the USB buffer --> try again later
+
+                isotp.position += count;
+            }
+            isotp.state = ISS_Idle;
+            return;
+        }
+        default:
+            return;
+    }
+}
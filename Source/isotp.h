@@ -0,0 +1,46 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#pragma once
+#include "settings.h"
+
+// The maximum length of a PDU that can be sent or received (12 bit length in the First Frame).
+// The 32 bit First Frame length of ISO 15765-2:2016 is not supported because the processor has only 32 kB RAM.
+#define ISOTP_MAX_PDU         4095
+// The host sends a PDU in chunks of up to 64 bytes and receives a PDU in chunks of 64 bytes.
+// The first chunk contains the length of the entire PDU, so the end of the PDU is known without any additional flag.
+#define ISOTP_CHUNK_SIZE        64
+// N_Bs and N_Cr: maximum time to wait for a Flow Control frame or for the next Consecutive Frame
+#define ISOTP_TIMEOUT_US   1000000
+
+// Flags for isotp_open()
+typedef enum // 8 bit
+{
+    ISO_Extended = 0x01, // Tx ID and Rx ID are 29 bit
+    ISO_FD       = 0x02, // send CAN FD frames with up to 64 bytes
+    ISO_BRS      = 0x04, // send CAN FD frames with baudrate switch
+    ISO_Padding  = 0x08, // pad all Tx frames to 8 bytes (CAN FD frames are always padded to the next valid DLC)
+} eIsoTpFlags;
+
+// Events reported to the host (Slcan: "Ixx\r", Candlelight: MSG_IsoTpEvent)
+typedef enum // 8 bit
+{
+    ISO_TxDone = 1,  // the Tx PDU has been sent completely
+    ISO_TxTimeout,   // the peer did not send a Flow Control frame within one second
+    ISO_TxOverflow,  // the peer has answered with Flow Control "Overflow" (the PDU is too long for the peer)
+    ISO_TxRejected,  // the host has sent PDU data while a PDU was sent or received, or more data than announced (only Candlelight)
+    ISO_RxTimeout,   // the peer did not send the next Consecutive Frame within one second
+    ISO_RxSequence,  // a Consecutive Frame with a wrong sequence number has been received
+    ISO_RxOverflow,  // the peer has sent a First Frame for a PDU that is too long or while the channel was busy
+    ISO_TxInvalidFS, // the peer has sent a Flow Control frame with an invalid Flow Status, the Tx PDU has been aborted
+} eIsoTpEvent;
+
+void      isotp_close();
+eFeedback isotp_open(uint32_t tx_id, uint32_t rx_id, uint8_t flags, uint8_t block_size, uint8_t st_min, uint8_t pad_byte);
+eFeedback isotp_begin(uint32_t length);
+eFeedback isotp_append(const uint8_t* data, uint32_t count);
+bool      isotp_receive(FDCAN_RxHeaderTypeDef* rx_header, uint8_t* rx_data);
+void      isotp_process();
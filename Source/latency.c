@@ -0,0 +1,249 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#include "settings.h"
+#include "latency.h"
+#include "system.h"
+
+// Latency of the Rx frames from the start of frame on CAN bus until the USB IN transfer to the host has completed.
+// This includes the time in the Rx FIFO, in rx_ring, in the buffer to the host and the USB transfer itself.
+// A position identifies the place of a frame in the buffer to the host. The buffer defines what a position is:
+// Slcan: the free running count of bytes written to buf_cdc_tx, Candlelight: the free running count of messages in ring_to_host.
+// buffer.c tags each Rx frame with the position behind the frame and the CAN timestamp.
+// Slcan tags the frames when they are written to buf_cdc_tx. Candlelight stores the timestamp with the message in ring_to_host
+// and tags the frames when they are packed into a USB IN transfer, so only the frames of one transfer need a tag.
+// Before a USB IN transfer is started, buffer.c passes the position behind the last byte of the transfer.
+// When the transfer has completed, the USB interrupt adds the latency of all tagged frames up to this position to the histogram.
+// If LATENCY_MAX_TAGS tags are waiting, a new frame is merged into the newest tag, so every frame is measured.
+// A merged tag stores the position and timestamp of its oldest and newest frame. The frames between them are interpolated.
+// If a transfer ends inside a merged tag, the frames up to the end are estimated from the positions and measured.
+// The oldest frame of each tag is measured exactly, so the maximum is never too low.
+// The histogram has 2 bins per octave: bin 0: < 16 s, bin 1: < 24 s, bin 2: < 32 s, bin 3: < 48 s, bin 4: < 64 s, ...
+// bin 30: < 524 ms, bin 31: longer. Percentiles are interpolated linearly inside a bin.
+
+typedef struct
+{
+    uint32_t pos_first; // position behind the oldest frame
+    uint32_t pos;       // position behind the newest frame
+    uint32_t first;     // 1 s timestamp of the start of frame on CAN bus of the oldest frame
+    uint32_t last;      // 1 s timestamp of the start of frame on CAN bus of the newest frame
+    uint32_t count;     // count of frames in this tag
+} kLatencyTag;
+
+// Single producer (main loop) / single consumer (USB interrupt) ring of tags
+kLatencyTag       latency_tags[LATENCY_MAX_TAGS];
+volatile uint32_t latency_tag_head = 0;
+volatile uint32_t latency_tag_tail = 0;
+volatile uint32_t latency_end_pos  = 0; // position behind the running USB IN transfer
+
+uint32_t latency_bins[LATENCY_BINS];
+uint32_t latency_count    = 0;
+uint32_t latency_merged   = 0;
+uint32_t latency_min      = 0;
+uint32_t latency_max      = 0;
+
+// Clear the histogram. The frames that are waiting for the host stay tagged.
+void latency_reset()
+{
+    memset(latency_bins, 0, sizeof(latency_bins));
+    latency_count    = 0;
+    latency_merged   = 0;
+    latency_min      = 0;
+    latency_max      = 0;
+}
+
+// Called from the main loop when an Rx frame has been stored in the buffer to the host (Slcan)
+// or when it has been packed into a USB IN transfer (Candlelight).
+// pos = the position behind the frame, rx_timestamp = 1 s timestamp of the start of frame on CAN bus
+void latency_tag(uint32_t pos, uint32_t rx_timestamp)
+{
+    uint32_t head = latency_tag_head;
+    if (head - latency_tag_tail >= LATENCY_MAX_TAGS)
+    {
+        // The USB interrupt may measure a part of the newest tag at the same time
+        system_disable_irq();
+        kLatencyTag* newest = &latency_tags[(latency_tag_head - 1) % LATENCY_MAX_TAGS];
+        newest->pos  = pos;
+        newest->last = rx_timestamp;
+        newest->count ++;
+        system_enable_irq();
+        latency_merged ++;
+        return;
+    }
+
+    kLatencyTag* tag = &latency_tags[head % LATENCY_MAX_TAGS];
+    tag->pos_first = pos;
+    tag->pos       = pos;
+    tag->first     = rx_timestamp;
+    tag->last      = rx_timestamp;
+    tag->count     = 1;
+
+    __DMB(); // the tag must be completely written before head is incremented
+    latency_tag_head = head + 1;
+}
+
+// Called from the main loop before a USB IN transfer is started.
+// end_pos = the position behind the last byte or message of the transfer
+void latency_begin_transfer(uint32_t end_pos)
+{
+    latency_end_pos = end_pos;
+}
+
+// Called when the buffer to the host is cleared. The tagged frames will never be transferred.
+void latency_clear_tags()
+{
+    system_disable_irq();
+    latency_tag_tail = latency_tag_head;
+    system_enable_irq();
+}
+
+// returns the bin for a latency in s
+static inline uint32_t latency_calc_bin(uint32_t latency_us)
+{
+    if (latency_us < 16)
+        return 0;
+
+    uint32_t msb  = 31 - __CLZ(latency_us);        // 4 for 16...31 s
+    uint32_t half = (latency_us >> (msb - 1)) & 1; // second half of the octave
+    uint32_t bin  = 1 + (msb - 4) * 2 + half;
+    return (bin < LATENCY_BINS) ? bin : LATENCY_BINS - 1;
+}
+
+// returns the lowest latency in s that falls into the bin
+static uint32_t latency_bin_low(uint32_t bin)
+{
+    if (bin == 0)
+        return 0;
+
+    uint32_t octave = (bin - 1) / 2;
+    return (((bin - 1) & 1) ? 24 : 16) << octave;
+}
+
+// Add count frames with latencies evenly distributed from low_us to high_us to the histogram
+static void latency_add(uint32_t low_us, uint32_t high_us, uint32_t count)
+{
+    if (latency_count == 0 || low_us < latency_min) latency_min = low_us;
+    if (high_us > latency_max)                      latency_max = high_us;
+    latency_count += count;
+
+    uint32_t bin_low  = latency_calc_bin(low_us);
+    uint32_t bin_high = latency_calc_bin(high_us);
+    uint32_t added    = 0;
+    for (uint32_t bin=bin_low; bin<bin_high; bin++)
+    {
+        // the count of frames with a latency below the upper limit of the bin
+        uint32_t below = (uint32_t)((uint64_t)(latency_bin_low(bin + 1) - low_us) * count / (high_us - low_us));
+        latency_bins[bin] += below - added;
+        added = below;
+    }
+    latency_bins[bin_high] += count - added;
+}
+
+// Called from the USB interrupt when the IN transfer to the host has completed
+void latency_end_transfer()
+{
+    uint32_t now = system_get_timestamp();
+    uint32_t end = latency_end_pos;
+    uint32_t tail = latency_tag_tail;
+    while (tail != latency_tag_head)
+    {
+        kLatencyTag* tag = &latency_tags[tail % LATENCY_MAX_TAGS];
+        if ((int32_t)(end - tag->pos_first) < 0)
+            break; // the frame has not yet been sent
+
+        if ((int32_t)(end - tag->pos) >= 0)
+        {
+            // all frames of the tag have been sent, the newest frame has the lowest latency
+            latency_add(now - tag->last, now - tag->first, tag->count);
+            tail ++;
+            continue;
+        }
+
+        // The transfer ends inside a merged tag: measure the older frames up to the end
+        // and keep the rest with the interpolated position and timestamp of the next frame.
+        uint32_t rest  = tag->count - 1;
+        uint32_t sent  = 1 + (uint32_t)((uint64_t)rest * (end - tag->pos_first) / (tag->pos - tag->pos_first));
+        uint32_t stamp = tag->first + (uint32_t)((uint64_t)(tag->last - tag->first) * (sent - 1) / rest);
+        latency_add(now - stamp, now - tag->first, sent);
+
+        tag->first     = tag->first     + (uint32_t)((uint64_t)(tag->last - tag->first)   * sent / rest);
+        tag->pos_first = tag->pos_first + (uint32_t)((uint64_t)(tag->pos  - tag->pos_first) * sent / rest);
+        tag->count    -= sent;
+        break;
+    }
+    latency_tag_tail = tail;
+}
+
+// returns the latency in s below which per_mille / 1000 of the frames have been transferred (e.g. 990 = 99 %)
+uint32_t latency_get_percentile(uint32_t per_mille)
+{
+    if (latency_count == 0)
+        return 0;
+
+    if (per_mille > 1000)
+        per_mille = 1000;
+
+    // the rank of the frame, 1 ... latency_count
+    uint32_t rank = (uint32_t)(((uint64_t)latency_count * per_mille + 999) / 1000);
+    if (rank == 0)
+        rank = 1;
+
+    uint32_t below = 0;
+    for (uint32_t bin=0; bin<LATENCY_BINS; bin++)
+    {
+        uint32_t count = latency_bins[bin];
+        if (below + count < rank)
+        {
+            below += count;
+            continue;
+        }
+
+        if (bin == LATENCY_BINS - 1)
+            return latency_max;
+
+        uint32_t low  = latency_bin_low(bin);
+        uint32_t high = latency_bin_low(bin + 1);
+        uint32_t value = low + (uint32_t)((uint64_t)(high - low) * (rank - below) / count);
+
+        // the interpolation must not leave the measured range
+        if (value > latency_max) value = latency_max;
+        if (value < latency_min) value = latency_min;
+        return value;
+    }
+    return latency_max;
+}
+
+// returns the count of frames in the bin and the lowest latency of the bin in low_us.
+uint32_t latency_get_bin(uint32_t bin, uint32_t* low_us)
+{
+    if (bin >= LATENCY_BINS)
+        return 0;
+
+    *low_us = latency_bin_low(bin);
+    return latency_bins[bin];
+}
+
+// returns the count of frames that have been measured
+uint32_t latency_get_count()
+{
+    return latency_count;
+}
+
+// returns the count of frames that have been merged into another tag because LATENCY_MAX_TAGS tags were waiting
+uint32_t latency_get_merged()
+{
+    return latency_merged;
+}
+
+uint32_t latency_get_min()
+{
+    return latency_min;
+}
+
+uint32_t latency_get_max()
+{
+    return latency_max;
+}
@@ -0,0 +1,24 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#pragma once
+#include "settings.h"
+
+// The count of histogram bins and the count of tags for the frames that wait for their USB transfer (see latency.c)
+#define LATENCY_BINS          32
+#define LATENCY_MAX_TAGS      32
+
+void     latency_reset();
+void     latency_tag(uint32_t pos, uint32_t rx_timestamp);
+void     latency_begin_transfer(uint32_t end_pos);
+void     latency_end_transfer();
+void     latency_clear_tags();
+uint32_t latency_get_percentile(uint32_t per_mille);
+uint32_t latency_get_bin(uint32_t bin, uint32_t* low_us);
+uint32_t latency_get_count();
+uint32_t latency_get_merged();
+uint32_t latency_get_min();
+uint32_t latency_get_max();
@@ -12,6 +12,9 @@
 #include "system.h"
 #include "utils.h"
 #include "buffer.h"
+#include "cyclic.h"
+#include "isotp.h"
+#include "profiler.h"
 #include "usb_def.h"
 #include "usb_lowlevel.h"
 #include "usb_core.h"
@@ -34,6 +37,7 @@ int main(void)
     can_init();
     utils_init();
     control_init(); // AFTER utils_init()
+    profiler_init();
     
     // This loop runs approx 100 times in one millisecond
     while (true)
@@ -57,18 +61,32 @@ int main(void)
             led_blink_power_on(); // blink blue / green 8 times (blocking function)            
         }
         
+        // measure the CPU cycles of each stage (see profiler.c)
+        uint32_t loop_start = profiler_start();
+        uint32_t prof_start = loop_start;
+
         uint32_t tick_now = HAL_GetTick();        
         led_process(tick_now);
+        prof_start = profiler_stop(PRF_Led,     prof_start);
+        cyclic_process();          // BEFORE buf_process()        --> Cyclic messages have precedence over the host messages
+        prof_start = profiler_stop(PRF_Cyclic,  prof_start);
+        isotp_process();           // BEFORE buf_process()        --> Flow Control frames are sent without delay
+        prof_start = profiler_stop(PRF_IsoTp,   prof_start);
         buf_process(tick_now);
+        prof_start = profiler_stop(PRF_Buffer,  prof_start);
         control_process(tick_now); // calls error_is_report_due() --> First report the error "Bus Off"
+        prof_start = profiler_stop(PRF_Control, prof_start);
         can_process(tick_now);     // AFTER control!              --> After recover from Bus Off
+        prof_start = profiler_stop(PRF_Can,     prof_start);
         
         if (tick_now - tick_last >= 100)
         {
             tick_last = tick_now;            
             can_timer_100ms();
+            system_timer_100ms();
             dfu_timer_100ms(tick_now);
         }
+        profiler_stop(PRF_Loop, loop_start);
     }
 }
 
@@ -0,0 +1,82 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#include "settings.h"
+#include "profiler.h"
+
+// Profiler that measures the execution time of each stage of the main loop and of the interrupts in CPU cycles.
+// The cycle counter of the DWT (Data Watchpoint and Trace unit) runs with the CPU clock (160 MHz), so one cycle is 6.25 ns.
+// Reading the counter costs 1 cycle. The stages of the main loop are chained: the end of one stage is the start of the next one.
+// The execution time of a main loop stage includes the interrupts that occurred while it was running.
+// A 32 bit counter overflows after 26 seconds, which is far longer than any stage may take.
+// The profiler is disabled after power-on because the statistics cost approx. 30 cycles per measurement.
+// The histogram has bins that are 4 times wider than the previous bin:
+// bin 0: < 0.4 s, bin 1: < 1.6 s, bin 2: < 6.4 s, bin 3: < 25.6 s, bin 4: < 102 s, bin 5: < 410 s, bin 6: < 1.6 ms, bin 7: longer
+
+bool       profiler_enabled = false;
+kProfStage profiler_stages[PRF_StageCount];
+
+const char* PROFILER_NAMES[PRF_StageCount] = { "Loop", "Led", "Cyclic", "IsoTp", "Buffer", "Control", "Can", "UsbIsr", "CanIsr" };
+
+// Start the cycle counter
+void profiler_init()
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL  |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+// Enable or disable the profiler. Enabling resets all statistics.
+void profiler_enable(bool enable)
+{
+    profiler_enabled = false; // do not write from an interrupt while resetting
+    memset(profiler_stages, 0, sizeof(profiler_stages));
+    profiler_enabled = enable;
+}
+
+// Called from profiler_stop()
+void profiler_add(eProfStage stage, uint32_t cycles)
+{
+    kProfStage* prof = &profiler_stages[stage];
+    if (prof->count == 0 || cycles < prof->min) prof->min = cycles;
+    if (cycles > prof->max)                     prof->max = cycles;
+
+    // bit count: 0...6 --> bin 0, 7...8 --> bin 1, 9...10 --> bin 2, ...
+    int bits = 32 - __CLZ(cycles);
+    int bin  = (bits - 5) / 2;
+    if (bin < 0)                  bin = 0;
+    if (bin > PROFILER_BINS - 1)  bin = PROFILER_BINS - 1;
+
+    prof->bins[bin] ++;
+    prof->sum += cycles;
+    prof->count ++;
+}
+
+// returns NULL if the stage is invalid
+kProfStage* profiler_get_stage(uint32_t stage)
+{
+    if (stage >= PRF_StageCount)
+        return NULL;
+
+    return &profiler_stages[stage];
+}
+
+const char* profiler_get_name(uint32_t stage)
+{
+    if (stage >= PRF_StageCount)
+        return "";
+
+    return PROFILER_NAMES[stage];
+}
+
+// returns the average execution time in cycles
+uint32_t profiler_get_average(kProfStage* prof)
+{
+    if (prof->count == 0)
+        return 0;
+
+    return (uint32_t)(prof->sum / prof->count);
+}
@@ -0,0 +1,60 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#pragma once
+#include "settings.h"
+
+// The count of histogram bins per stage (see profiler.c)
+#define PROFILER_BINS          8
+
+typedef enum // 8 bit
+{
+    PRF_Loop = 0,  // one complete pass of the main loop
+    PRF_Led,       // led_process()
+    PRF_Cyclic,    // cyclic_process()
+    PRF_IsoTp,     // isotp_process()
+    PRF_Buffer,    // buf_process()
+    PRF_Control,   // control_process()
+    PRF_Can,       // can_process()
+    PRF_UsbIsr,    // USB interrupt
+    PRF_CanIsr,    // FDCAN interrupt
+    PRF_StageCount,
+} eProfStage;
+
+// The statistics of one stage in CPU cycles
+typedef struct
+{
+    uint32_t count;                // count of measurements
+    uint32_t min;                  // shortest execution time
+    uint32_t max;                  // longest  execution time
+    uint64_t sum;                  // sum of all execution times for the average
+    uint32_t bins[PROFILER_BINS];  // histogram, bin N counts execution times < 64 * 4^N cycles, the last bin counts all longer times
+} kProfStage;
+
+extern bool profiler_enabled;
+
+void        profiler_init();
+void        profiler_enable(bool enable);
+void        profiler_add(eProfStage stage, uint32_t cycles);
+kProfStage* profiler_get_stage(uint32_t stage);
+const char* profiler_get_name(uint32_t stage);
+uint32_t    profiler_get_average(kProfStage* prof);
+
+// returns the current value of the CPU cycle counter
+static inline uint32_t profiler_start()
+{
+    return DWT->CYCCNT;
+}
+
+// Add the cycles since 'start' to the stage.
+// returns the current value of the cycle counter, which is the start of the next stage in the main loop.
+static inline uint32_t profiler_stop(eProfStage stage, uint32_t start)
+{
+    uint32_t now = DWT->CYCCNT;
+    if (profiler_enabled)
+        profiler_add(stage, now - start);
+    return now;
+}
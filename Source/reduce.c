@@ -0,0 +1,175 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#include "settings.h"
+#include "reduce.h"
+#include "idtable.h"
+#include "utils.h"
+
+// Reduction of the Rx traffic to the host.
+// On a typical vehicle bus most frames are periodic with unchanged data. Passing all of them to the host
+// fills the USB buffer and costs host CPU although the host gets no new information.
+// A rule selects a range of CAN IDs with an ID and a mask and defines how the frames of each of these IDs are reduced.
+// The state of each ID is stored in idtable.c. The first frame of each ID is always passed to the host.
+// If the ID table is full, frames of IDs that are not in the table are passed to the host without reduction.
+// The rules are removed when the adapter is closed.
+
+typedef struct
+{
+    uint32_t can_id;
+    uint32_t mask;
+    uint32_t param;
+    uint8_t  mode;     // eReduceMode
+    bool     extended;
+    bool     used;
+} kReduceRule;
+
+kReduceRule reduce_rules[REDUCE_MAX_RULES];
+uint32_t    reduce_count      = 0; // count of active rules
+uint32_t    reduce_suppressed = 0; // count of frames that have not been passed to the host
+
+// Remove all rules
+void reduce_clear()
+{
+    for (int i=0; i<REDUCE_MAX_RULES; i++)
+    {
+        reduce_rules[i].used = false;
+    }
+    reduce_count      = 0;
+    reduce_suppressed = 0;
+}
+
+// Add or replace a rule.
+// index    = 0...7. If multiple rules match a CAN ID, the rule with the lowest index is applied.
+// can_id   = the CAN ID
+// mask     = only the bits that are set in the mask are compared (e.g. 0x7FF for one ID, 0x700 for 256 IDs, 0 for all IDs)
+// extended = true for 29 bit IDs
+// mode     = eReduceMode
+// param    = RED_OnChange: 0 or 1...65535 ms, RED_Interval: 1...65535 ms, RED_EveryNth: 2...65535
+eFeedback reduce_set_rule(uint32_t index, uint32_t can_id, uint32_t mask, bool extended, uint32_t mode, uint32_t param)
+{
+    if (index >= REDUCE_MAX_RULES || mode > RED_EveryNth || param > 0xFFFF)
+        return FBK_InvalidParameter;
+
+    if ((mode == RED_Interval && param < 1) || (mode == RED_EveryNth && param < 2))
+        return FBK_InvalidParameter;
+
+    // Candlelight calls this from the USB interrupt while reduce_forward() may use the rule in the main loop.
+    // The rule is disabled while it is modified and enabled again when all members have been written.
+    kReduceRule* rule = &reduce_rules[index];
+    if (!rule->used)
+        reduce_count ++;
+
+    rule->used     = false;
+    __DMB();
+    rule->can_id   = can_id & mask;
+    rule->mask     = mask;
+    rule->extended = extended;
+    rule->mode     = mode;
+    rule->param    = (mode == RED_EveryNth) ? param : param * 1000; // ms --> s
+    __DMB(); // all members must be written before the rule is enabled
+    rule->used     = true;
+    return FBK_Success;
+}
+
+// Remove one rule
+eFeedback reduce_remove_rule(uint32_t index)
+{
+    if (index >= REDUCE_MAX_RULES)
+        return FBK_InvalidParameter;
+
+    if (reduce_rules[index].used)
+    {
+        reduce_rules[index].used = false;
+        reduce_count --;
+    }
+    return FBK_Success;
+}
+
+// 32 bit FNV-1a hash over DLC and data.
+// A changed payload with the same hash is not detected. With 32 bit this happens once in 4 billion changes,
+// so in average less than once in a year on a bus with 100 changes per second of the reduced IDs.
+static inline uint32_t reduce_hash(FDCAN_RxHeaderTypeDef* rx_header, uint8_t* rx_data)
+{
+    uint32_t hash = (2166136261u ^ rx_header->DataLength) * 16777619u;
+    if (rx_header->RxFrameType != FDCAN_REMOTE_FRAME)
+    {
+        int byte_count = utils_dlc_to_byte_count(rx_header->DataLength);
+        for (int i=0; i<byte_count; i++)
+        {
+            hash = (hash ^ rx_data[i]) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+// Called from can_process() for each frame that has passed the filters.
+// returns false if the frame must not be passed to the host.
+bool reduce_forward(FDCAN_RxHeaderTypeDef* rx_header, uint8_t* rx_data, uint32_t rx_timestamp)
+{
+    if (reduce_count == 0)
+        return true;
+
+    bool extended = (rx_header->IdType == FDCAN_EXTENDED_ID);
+    kReduceRule* rule = NULL;
+    for (int i=0; i<REDUCE_MAX_RULES; i++)
+    {
+        kReduceRule* cur = &reduce_rules[i];
+        if (cur->used && cur->extended == extended && (rx_header->Identifier & cur->mask) == cur->can_id)
+        {
+            rule = cur;
+            break;
+        }
+    }
+
+    if (rule == NULL || rule->mode == RED_Off)
+        return true;
+
+    bool created;
+    kIdEntry* entry = idtable_lookup(rx_header, &created);
+    if (entry == NULL)
+        return true; // table full
+
+    uint32_t hash    = 0;
+    uint32_t elapsed = rx_timestamp - entry->fwd_us;
+    bool     forward = created;
+    switch (rule->mode)
+    {
+        case RED_OnChange:
+            hash = reduce_hash(rx_header, rx_data);
+            if (hash != entry->hash || (rule->param > 0 && elapsed >= rule->param))
+                forward = true;
+            break;
+        case RED_Interval:
+            if (elapsed >= rule->param)
+                forward = true;
+            break;
+        case RED_EveryNth:
+            if (entry->skipped + 1 >= rule->param)
+                forward = true;
+            break;
+    }
+
+    if (!forward)
+    {
+        if (entry->skipped < 0xFFFF)
+            entry->skipped ++;
+
+        reduce_suppressed ++;
+        return false;
+    }
+
+    entry->hash    = hash;
+    entry->fwd_us  = rx_timestamp;
+    entry->skipped = 0;
+    return true;
+}
+
+// Returns the count of frames that have not been passed to the host since the last reduce_clear()
+uint32_t reduce_get_suppressed()
+{
+    return reduce_suppressed;
+}
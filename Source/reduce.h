@@ -0,0 +1,25 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#pragma once
+#include "settings.h"
+
+// The count of reduction rules (see reduce.c)
+#define REDUCE_MAX_RULES       8
+
+typedef enum // 8 bit
+{
+    RED_Off = 0,   // pass all frames of the IDs to the host (the rule excludes IDs from the following rules)
+    RED_OnChange,  // pass a frame only if DLC or data have changed, param = pass an unchanged frame after param ms (0 = never)
+    RED_Interval,  // pass a frame at most every param ms
+    RED_EveryNth,  // pass only every param'th frame
+} eReduceMode;
+
+void      reduce_clear();
+eFeedback reduce_set_rule(uint32_t index, uint32_t can_id, uint32_t mask, bool extended, uint32_t mode, uint32_t param);
+eFeedback reduce_remove_rule(uint32_t index);
+bool      reduce_forward(FDCAN_RxHeaderTypeDef* rx_header, uint8_t* rx_data, uint32_t rx_timestamp);
+uint32_t  reduce_get_suppressed();
@@ -0,0 +1,213 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#include "settings.h"
+#include "responder.h"
+#include "can.h"
+#include "utils.h"
+#include "system.h"
+
+// Automatic responses for gateway and ECU emulation.
+// If the host answers a request frame itself the response is delayed by at least 1 or 2 ms of USB latency.
+// Here a received frame that matches the CAN ID, the mask and an optional data pattern triggers a response frame immediately.
+// Bytes of the request can be copied into the response (e.g. a counter or a sub-function byte).
+// responder_receive() is called from can_process() for each received frame, before the frame is passed to the host.
+// The main loop runs approx 100 times in one millisecond, so the response is sent approx 10 s after the request has been read.
+// The request is passed to the host as usual, the response is sent without Tx Event, so the host does not get a Tx echo.
+// The table is cleared when the adapter is closed.
+
+typedef enum // 8 bit
+{
+    RSP_Used          = 0x01,
+    RSP_MatchExtended = 0x02, // the request has a 29 bit ID
+    RSP_Extended      = 0x04, // the response has a 29 bit ID
+    RSP_FD            = 0x08,
+    RSP_BRS           = 0x10,
+    RSP_Remote        = 0x20,
+} eResponderFlags;
+
+typedef struct
+{
+    uint32_t match_id;
+    uint32_t match_mask;
+    uint32_t identifier;                         // CAN ID of the response
+    uint8_t  flags;                              // eResponderFlags
+    uint8_t  pattern_len;                        // 0 = match only the CAN ID, otherwise the request must have at least this count of bytes
+    uint8_t  dlc;                                // DLC of the response
+    uint8_t  copy_source;                        // first byte in the request that is copied into the response
+    uint8_t  copy_target;                        // position in the response where the bytes are copied to
+    uint8_t  copy_count;                         // 0 = nothing is copied
+    uint8_t  pattern     [RESPONDER_MAX_DATA];
+    uint8_t  pattern_mask[RESPONDER_MAX_DATA];   // only the bits that are set in the mask are compared
+    uint8_t  data        [RESPONDER_MAX_DATA];   // the response
+} kResponderEntry;
+
+kResponderEntry responder_table[RESPONDER_MAX_ENTRIES];
+uint32_t        responder_count = 0; // count of active entries
+kResponderStats responder_stats = {0};
+
+// Remove all responses and reset the latency statistics
+void responder_clear()
+{
+    for (int i=0; i<RESPONDER_MAX_ENTRIES; i++)
+    {
+        responder_table[i].flags = 0;
+    }
+    responder_count = 0;
+    memset(&responder_stats, 0, sizeof(responder_stats));
+}
+
+// Add or replace an automatic response.
+// index          = 0...7. If multiple entries match the same request, the entry with the lowest index is sent.
+// match_id       = the CAN ID of the request
+// match_mask     = only the bits that are set in the mask are compared (e.g. 0x7FF for one ID, 0x7F0 for 16 IDs)
+// pattern        = 0...8 bytes that are compared with the first data bytes of the request
+// pattern_mask   = only the bits that are set in the mask are compared
+// copy_source    = the first byte in the request that is copied into the response (0 based)
+// copy_target    = the position in the response where these bytes are stored (0 based)
+// copy_count     = the count of bytes to copy (0 = none). If the request is too short, nothing is copied.
+// The header must be filled completely with the CAN ID, frame type, DLC and the FD flags of the response.
+eFeedback responder_set(uint32_t index, uint32_t match_id, uint32_t match_mask, bool match_extended,
+                        const uint8_t* pattern, const uint8_t* pattern_mask, uint32_t pattern_len,
+                        FDCAN_TxHeaderTypeDef* tx_header, const uint8_t* tx_data,
+                        uint32_t copy_source, uint32_t copy_target, uint32_t copy_count)
+{
+    // Bus off is only temporary. The responses are sent again after recovery.
+    eFeedback e_Ret = can_is_tx_allowed();
+    if (e_Ret != FBK_Success && e_Ret != FBK_BusIsOff)
+        return e_Ret;
+
+    if (index >= RESPONDER_MAX_ENTRIES || pattern_len > RESPONDER_MAX_DATA)
+        return FBK_InvalidParameter;
+
+    // Sending a message with FDF flag requires a data baudrate to be set.
+    if (tx_header->FDFormat == FDCAN_FD_CAN && !can_using_FD())
+        return FBK_BaudrateNotSet;
+
+    uint32_t byte_count = (tx_header->TxFrameType == FDCAN_REMOTE_FRAME) ? 0 : utils_dlc_to_byte_count(tx_header->DataLength);
+    if (byte_count > RESPONDER_MAX_DATA || copy_target + copy_count > byte_count || copy_source + copy_count > 64)
+        return FBK_InvalidParameter;
+
+    // Candlelight calls this from the USB interrupt while responder_receive() may use the entry in the main loop.
+    // The entry is disabled while it is modified and enabled again when all members have been written.
+    kResponderEntry* entry = &responder_table[index];
+    if (entry->flags == 0)
+        responder_count ++;
+
+    entry->flags = 0;
+    __DMB();
+    entry->match_id    = match_id & match_mask;
+    entry->match_mask  = match_mask;
+    entry->identifier  = tx_header->Identifier;
+    entry->dlc         = tx_header->DataLength;
+    entry->pattern_len = pattern_len;
+    entry->copy_source = copy_source;
+    entry->copy_target = copy_target;
+    entry->copy_count  = copy_count;
+    for (int i=0; i<pattern_len; i++)
+    {
+        entry->pattern_mask[i] = pattern_mask[i];
+        entry->pattern     [i] = pattern[i] & pattern_mask[i];
+    }
+    memcpy(entry->data, tx_data, byte_count);
+
+    uint8_t flags = RSP_Used;
+    if (match_extended)                                 flags |= RSP_MatchExtended;
+    if (tx_header->IdType        == FDCAN_EXTENDED_ID)  flags |= RSP_Extended;
+    if (tx_header->FDFormat      == FDCAN_FD_CAN)       flags |= RSP_FD;
+    if (tx_header->BitRateSwitch == FDCAN_BRS_ON)       flags |= RSP_BRS;
+    if (tx_header->TxFrameType   == FDCAN_REMOTE_FRAME) flags |= RSP_Remote;
+    __DMB(); // all members must be written before the entry is activated
+    entry->flags = flags; // activates the entry
+    return FBK_Success;
+}
+
+// Remove one automatic response
+eFeedback responder_remove(uint32_t index)
+{
+    if (index >= RESPONDER_MAX_ENTRIES)
+        return FBK_InvalidParameter;
+
+    if (responder_table[index].flags != 0)
+    {
+        responder_table[index].flags = 0;
+        responder_count --;
+    }
+    return FBK_Success;
+}
+
+// Returns true if the entry matches the received frame
+static inline bool responder_match(kResponderEntry* entry, FDCAN_RxHeaderTypeDef* rx_header, uint8_t* rx_data, uint32_t rx_len)
+{
+    if (((entry->flags & RSP_MatchExtended) > 0) != (rx_header->IdType == FDCAN_EXTENDED_ID))
+        return false;
+
+    if ((rx_header->Identifier & entry->match_mask) != entry->match_id)
+        return false;
+
+    if (rx_len < entry->pattern_len)
+        return false;
+
+    for (int i=0; i<entry->pattern_len; i++)
+    {
+        if ((rx_data[i] & entry->pattern_mask[i]) != entry->pattern[i])
+            return false;
+    }
+    return true;
+}
+
+// Called from can_process() for each received frame (accepted and rejected by the filters).
+// Sends the response of the first matching entry.
+void responder_receive(FDCAN_RxHeaderTypeDef* rx_header, uint8_t* rx_data, uint32_t rx_timestamp)
+{
+    if (responder_count == 0)
+        return;
+
+    uint32_t rx_len = (rx_header->RxFrameType == FDCAN_REMOTE_FRAME) ? 0 : utils_dlc_to_byte_count(rx_header->DataLength);
+    for (int i=0; i<RESPONDER_MAX_ENTRIES; i++)
+    {
+        kResponderEntry* entry = &responder_table[i];
+        if (entry->flags == 0 || !responder_match(entry, rx_header, rx_data, rx_len))
+            continue;
+
+        if (can_is_tx_allowed() != FBK_Success || can_get_tx_free_level() == 0)
+        {
+            responder_stats.dropped ++;
+            return;
+        }
+
+        uint8_t tx_data[RESPONDER_MAX_DATA];
+        memcpy(tx_data, entry->data, RESPONDER_MAX_DATA);
+        if (entry->copy_count > 0 && entry->copy_source + entry->copy_count <= rx_len)
+            memcpy(tx_data + entry->copy_target, rx_data + entry->copy_source, entry->copy_count);
+
+        FDCAN_TxHeaderTypeDef tx_header;
+        tx_header.Identifier          = entry->identifier;
+        tx_header.DataLength          = entry->dlc;
+        tx_header.IdType              = (entry->flags & RSP_Extended) ? FDCAN_EXTENDED_ID  : FDCAN_STANDARD_ID;
+        tx_header.TxFrameType         = (entry->flags & RSP_Remote)   ? FDCAN_REMOTE_FRAME : FDCAN_DATA_FRAME;
+        tx_header.FDFormat            = (entry->flags & RSP_FD)       ? FDCAN_FD_CAN       : FDCAN_CLASSIC_CAN;
+        tx_header.BitRateSwitch       = (entry->flags & RSP_BRS)      ? FDCAN_BRS_ON       : FDCAN_BRS_OFF;
+        tx_header.ErrorStateIndicator = can_is_passive() ? FDCAN_ESI_PASSIVE : FDCAN_ESI_ACTIVE;
+        tx_header.TxEventFifoControl  = FDCAN_NO_TX_EVENTS;
+        tx_header.MessageMarker       = 0;
+        can_send_packet(&tx_header, tx_data);
+
+        // The timestamp of the request is the start of frame, so the latency includes the transmission time of the request.
+        uint32_t latency = system_get_timestamp() - rx_timestamp;
+        responder_stats.count ++;
+        responder_stats.last_us = latency;
+        if (latency > responder_stats.max_us)
+            responder_stats.max_us = latency;
+        return;
+    }
+}
+
+// Returns the count of responses and the response latency
+kResponderStats* responder_get_stats()
+{
+    return &responder_stats;
+}
@@ -0,0 +1,31 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#pragma once
+#include "settings.h"
+
+// The firmware answers up to 8 request frames without any involvement of the host (see responder.c)
+#define RESPONDER_MAX_ENTRIES   8
+// The maximum count of data bytes in the pattern and in the response (RAM is scarce on the STM32G431)
+#define RESPONDER_MAX_DATA      8
+
+// Response latency measured from the start of frame of the request until the response is passed to the Tx FIFO
+typedef struct
+{
+    uint32_t count;    // count of responses sent
+    uint32_t dropped;  // count of responses not sent because the Tx FIFO was full or sending was not allowed
+    uint32_t last_us;  // latency of the last response in s
+    uint32_t max_us;   // maximum latency in s since the last responder_clear()
+} kResponderStats;
+
+void             responder_clear();
+eFeedback        responder_set(uint32_t index, uint32_t match_id, uint32_t match_mask, bool match_extended,
+                               const uint8_t* pattern, const uint8_t* pattern_mask, uint32_t pattern_len,
+                               FDCAN_TxHeaderTypeDef* tx_header, const uint8_t* tx_data,
+                               uint32_t copy_source, uint32_t copy_target, uint32_t copy_count);
+eFeedback        responder_remove(uint32_t index);
+void             responder_receive(FDCAN_RxHeaderTypeDef* rx_header, uint8_t* rx_data, uint32_t rx_timestamp);
+kResponderStats* responder_get_stats();
@@ -167,7 +167,7 @@ typedef enum // sent as 8 bit
 // Whenever you add new Slcan commands, don't forget to increment the version number and write a documentation for them.
 // So the controlling application knows with which firmware it is dealing.
 // (Candlelight does not need a version number because it returns the supported features as bit flags)
-#define SLCAN_VERSION          100
+#define SLCAN_VERSION          113
 
 
 
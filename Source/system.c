@@ -10,6 +10,8 @@
 #include "control.h"
 
 uint32_t canfd_clock;
+uint32_t timestamp_high = 0; // count of TIM2 roll overs (upper 32 bit of the 64 bit timestamp)
+uint32_t timestamp_last = 0; // TIM2 value of the last call to system_get_timestamp64()
 
 void  system_init_timestamp();
 
@@ -113,6 +115,10 @@ uint32_t system_get_can_clock()
 }
 
 // 1 s timer
+// TIM2 is the 32 bit timestamp of the firmware.
+// TIM3 is the 16 bit source of the FDCAN timestamp counter (FDCAN_TIMESTAMP_EXTERNAL, see RM0440).
+// The FDCAN captures TIM3 at the start of frame of each Rx packet and Tx event.
+// Both timers run with 1 MHz, so system_extend_timestamp() can convert a 16 bit capture into a TIM2 timestamp.
 void system_init_timestamp()
 {
     __HAL_RCC_TIM2_CLK_ENABLE();
@@ -127,6 +133,53 @@ void system_init_timestamp()
     TIM2->ARR   = 0xFFFFFFFF;
     TIM2->CR1  |= TIM_CR1_CEN;
     TIM2->EGR   = TIM_EGR_UG;
+
+    __HAL_RCC_TIM3_CLK_ENABLE();
+    TIM3->CR1   = 0;
+    TIM3->CR2   = 0;
+    TIM3->SMCR  = 0;
+    TIM3->DIER  = 0;
+    TIM3->CCMR1 = 0;
+    TIM3->CCMR2 = 0;
+    TIM3->CCER  = 0;
+    TIM3->PSC   = (SystemCoreClock / 1000000) - 1; // 1 MHz
+    TIM3->ARR   = 0xFFFF;
+    TIM3->CR1  |= TIM_CR1_CEN;
+    TIM3->EGR   = TIM_EGR_UG;
+}
+
+// 64 bit timestamp with 1 s precision that never rolls over.
+// TIM2 rolls over after 71 minutes. The firmware counts the roll overs, so the host does not need a roll over detection.
+// system_timer_100ms() guarantees that no roll over is missed.
+// The interrupts are disabled, so the roll over is counted only once if an interrupt handler calls this function at the same time.
+uint64_t system_get_timestamp64()
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    uint32_t now = TIM2->CNT;
+    if (now < timestamp_last)
+        timestamp_high ++;
+
+    timestamp_last = now;
+    uint64_t stamp64 = ((uint64_t)timestamp_high << 32) | now;
+
+    __set_PRIMASK(primask); // enable the interrupts only if they were enabled before
+    return stamp64;
+}
+
+// Convert a 32 bit timestamp from system_get_timestamp() or system_extend_timestamp() into a 64 bit timestamp.
+// The timestamp must be in the past (less than 71 minutes).
+uint64_t system_extend_timestamp64(uint32_t timestamp)
+{
+    uint64_t now = system_get_timestamp64();
+    return now - (uint32_t)((uint32_t)now - timestamp); // subtract the age of the timestamp
+}
+
+// Called every 100 ms from main()
+void system_timer_100ms()
+{
+    system_get_timestamp64(); // count the roll overs of TIM2 also while no timestamps are sent
 }
 
 // returns true if the requested option is set in the Option Bytes
@@ -27,6 +27,9 @@ bool      system_is_option_enabled(eOptionBytes e_Option);
 eFeedback system_set_option_bytes (eOptionBytes e_Option);
 uint32_t  system_get_can_clock();
 eMcuSerie system_get_mcu_serie();
+uint64_t  system_get_timestamp64();
+uint64_t  system_extend_timestamp64(uint32_t timestamp);
+void      system_timer_100ms();
 
 // get timestamp with 1 s precision
 static inline uint32_t system_get_timestamp()
@@ -34,6 +37,24 @@ static inline uint32_t system_get_timestamp()
     return TIM2->CNT;
 }
 
+// Convert a 16 bit FDCAN timestamp (RxTimestamp, TxTimestamp captured from TIM3) into a 32 bit timestamp
+// that is compatible with system_get_timestamp(). TIM3 rolls over after 65 ms.
+// The packet must be converted before it is older than 65 ms, otherwise the result is a multiple of 65 ms too late.
+// Both timers must be read at the same time. If an interrupt delayed the read of TIM3, the packet would look older by the
+// duration of the interrupt, and if this age exceeded 65 ms, the 16 bit age would roll over and the result would be 65 ms too late.
+// With the interrupts disabled the two reads are less than 1 s apart. TIM3 is read after TIM2, so it has already counted
+// past the captured value and the 16 bit subtraction also handles a roll over of TIM3 between capture and conversion.
+static inline uint32_t system_extend_timestamp(uint32_t hw_stamp)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint32_t now32 = TIM2->CNT;
+    uint16_t now16 = TIM3->CNT;
+    __set_PRIMASK(primask); // enable the interrupts only if they were enabled before
+
+    return now32 - (uint16_t)(now16 - (uint16_t)hw_stamp); // subtract the age of the packet
+}
+
 // ARM's
 // "Application Note 321 ARM Cortex-M Programming Guide to Memory Barrier Instructions"
 // (from https://developer.arm.com/documentation/dai0321/latest) says that
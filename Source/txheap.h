@@ -0,0 +1,85 @@
+/*
+    The MIT License
+    Copyright (c) 2025 ElmueSoft / Nakanishi Kiyomaro / Normadotcom
+    https://netcult.ch/elmue/CANable Firmware Update
+*/
+
+#pragma once
+#include "settings.h"
+
+// Binary min heap of Tx buffer slot indexes for the priority transmit mode (USR_TxPriority).
+// The firmware passes the waiting Tx frame with the smallest key to the CAN Tx FIFO first.
+// The upper 32 bit of the key are the arbitration priority from can_get_tx_priority(), the lower 32 bit are a sequence number,
+// so frames with the same CAN ID are always passed in the order in which the host has sent them (required for ISO-TP).
+// In Tx queue mode the hardware would send frames with the same ID in the order of the Tx buffer index,
+// so a frame is held back while can_is_tx_id_pending() reports an earlier frame with the same ID.
+// With a key of only the sequence number the heap behaves like a FIFO.
+// The heap is only used by the main loop, so no interrupts must be disabled.
+
+#define TXHEAP_SIZE   64
+
+typedef struct
+{
+    uint64_t key  [TXHEAP_SIZE];
+    uint8_t  index[TXHEAP_SIZE];
+    uint32_t count;
+} kTxHeap;
+
+static inline void txheap_clear(kTxHeap *heap)
+{
+    heap->count = 0;
+}
+
+// returns the slot index with the smallest key. The heap must not be empty.
+static inline uint8_t txheap_top(const kTxHeap *heap)
+{
+    return heap->index[0];
+}
+
+// The caller must check that the heap is not full.
+static inline void txheap_push(kTxHeap *heap, uint64_t key, uint8_t index)
+{
+    // move the new entry up until the parent is smaller
+    uint32_t pos = heap->count ++;
+    while (pos > 0)
+    {
+        uint32_t parent = (pos - 1) / 2;
+        if (heap->key[parent] <= key)
+            break;
+
+        heap->key  [pos] = heap->key  [parent];
+        heap->index[pos] = heap->index[parent];
+        pos = parent;
+    }
+    heap->key  [pos] = key;
+    heap->index[pos] = index;
+}
+
+// removes the entry from txheap_top(). The heap must not be empty.
+static inline void txheap_pop(kTxHeap *heap)
+{
+    uint32_t count = -- heap->count;
+    uint64_t key   = heap->key  [count];
+    uint8_t  index = heap->index[count];
+
+    // move the last entry down from the root until both children are larger
+    uint32_t pos = 0;
+    while (true)
+    {
+        uint32_t child = 2 * pos + 1;
+        if (child >= count)
+            break;
+
+        if (child + 1 < count && heap->key[child + 1] < heap->key[child])
+            child ++;
+
+        if (key <= heap->key[child])
+            break;
+
+        heap->key  [pos] = heap->key  [child];
+        heap->index[pos] = heap->index[child];
+        pos = child;
+    }
+    heap->key  [pos] = key;
+    heap->index[pos] = index;
+}
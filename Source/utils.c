@@ -155,22 +155,6 @@ bool utils_parse_hex_delimiter(char buf[], int* pos, char separator, int* digits
     }    
 }
 
-// reads 'digits' hex digits from 'buf' at 'pos' and stores the binary value in 'value'.
-bool utils_parse_hex_value(char buf[], int* pos, int digits, uint32_t* value)
-{
-    *value = 0;
-    for (int i=0; i<digits; i++)
-    {
-        if (!utils_to_hex_value(buf, *pos))
-            return false;
-        
-        *value <<= 4;
-        *value |= buf[*pos];
-        (*pos)++;        
-    } 
-    return true;
-}
-
 // converts hex ASCII into numeric value in the same buffer location
 // returns false on invalid character or end of string 
 // (the string has been zero terminated in control_parse_str(), so reading behind the end is not possible)
@@ -186,9 +170,3 @@ bool utils_to_hex_value(char buf[], int pos)
     buf[pos] = u8_Char;
     return true;
 }
-
-uint8_t utils_nibble_to_ascii(uint8_t nibble)
-{
-    if (nibble < 10) return nibble + '0';
-    else             return nibble + 'A' - 10;
-}
@@ -20,6 +20,11 @@ typedef enum // 32 bit
     USR_Feedback    = 0x20, // enable feedback mode (return execution status of a command with enum eFeedback) (Candlelight uses ELM_ReqGetLastError instead)
     USR_ProtoElmue  = 0x40, // enable the new ElmSoft protocol for maximum USB throughput instead of the inefficient GS protocol (Candlelight only)
     USR_Timestamp   = 0x80, // send timestamps to the host
+    USR_BatchIN     = 0x100, // pack multiple messages into one USB IN transfer (Candlelight only, requires USR_ProtoElmue)
+    USR_Timestamp64 = 0x200, // send 64 bit timestamps that never roll over (Candlelight only, requires USR_ProtoElmue and USR_Timestamp)
+    USR_Binary      = 0x400, // send and receive binary records instead of ASCII hex strings (Slcan only, see slcan_def.h)
+    USR_Credit      = 0x800, // report the free slots of the Tx buffer as credits to the host (Slcan only, see buf_report_credit())
+    USR_TxPriority  = 0x1000, // send waiting Tx frames in CAN bus priority order (lowest CAN ID first) instead of FIFO order (see txheap.h)
     // --------------------
     // IMPORTANT:
     // Never *EVER* modify these defaults!!! You will break all applications that have been written for CANable adapters!
@@ -47,10 +52,8 @@ bool        utils_mem_is_empty(void* ptr, int size);
 int8_t      utils_dlc_to_byte_count(uint32_t hal_dlc_code);
 int8_t      utils_byte_count_to_dlc(uint32_t byte_count);
 bool        utils_parse_next_decimal    (char buf[], int* pos, char separator, uint32_t* value);
-bool        utils_parse_hex_value(char buf[], int* pos, int digits, uint32_t* value);
 bool        utils_parse_hex_delimiter(char buf[], int* pos, char separator, int* digits, uint32_t* value);
 bool        utils_to_hex_value(char buf[], int pos);
-uint8_t     utils_nibble_to_ascii(uint8_t nibble);
 const char* utils_get_MCU_name();
 
 